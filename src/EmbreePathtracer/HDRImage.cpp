@@ -1,24 +1,54 @@
 #include "HDRImage.h"
+#include <algorithm>
 #include <iostream>
+#include "sampling.h"
 
 using namespace std;
 using namespace glm;
+using namespace pathtracer;
 
 void HDRImage::load(const string& filename)
 {
-	stbi_set_flip_vertically_on_load(false);
-	data = stbi_loadf(filename.c_str(), &width, &height, &components, 3);
-	stbi_set_flip_vertically_on_load(true);
-	if(data == NULL)
+	m_cache = EnvironmentCache::load(filename);
+	if(m_cache == nullptr)
 	{
 		std::cout << "Failed to load image: " << filename << ".\n";
 		exit(1);
 	}
+	width = m_cache->width;
+	height = m_cache->height;
 };
 
-vec3 HDRImage::sample(float u, float v)
+vec3 HDRImage::sample(float u, float v) const
 {
+	if(empty())
+		return vec3(0.0f);
 	int x = int(u * width) % width;
 	int y = int(v * height) % height;
-	return vec3(data[(y * width + x) * 3 + 0], data[(y * width + x) * 3 + 1], data[(y * width + x) * 3 + 2]);
-}
\ No newline at end of file
+	return m_cache->pixel(x, y);
+}
+
+vec2 HDRImage::sampleUV(float u1, float u2, float& pdf) const
+{
+	if(empty())
+	{
+		pdf = 0.0f;
+		return vec2(0.0f);
+	}
+	const EnvironmentCache& c = *m_cache;
+	float v_offset, u_offset;
+	const uint32_t y = sampleAliasTable(c.row_probability, c.row_alias, height, u1, v_offset);
+	const size_t row = size_t(y) * width;
+	const uint32_t x = sampleAliasTable(c.column_probability + row, c.column_alias + row, width, u2, u_offset);
+	pdf = c.row_pdf[y] * c.column_pdf[row + x] * float(width * height);
+	return vec2((float(x) + u_offset) / float(width), (float(y) + v_offset) / float(height));
+}
+
+float HDRImage::pdfUV(float u, float v) const
+{
+	if(empty())
+		return 0.0f;
+	const int x = std::max(0, std::min(int(u * width), width - 1));
+	const int y = std::max(0, std::min(int(v * height), height - 1));
+	return m_cache->row_pdf[y] * m_cache->column_pdf[size_t(y) * width + x] * float(width * height);
+}
@@ -1,21 +1,42 @@
 #pragma once
-#include <stb_image.h>
+#include <memory>
 #include <string>
 #include <glm/glm.hpp>
+#include "envcache.h"
 
 ///////////////////////////////////////////////////////////////////////////
-// Simple helper class for loading HDR images with STB image
+// Simple helper class for loading HDR images, through the environment
+// cache (see envcache.h), which holds the pixels and everything derived
+// from them
 ///////////////////////////////////////////////////////////////////////////
 struct HDRImage
 {
-	int width, height, components;
-	float* data = nullptr;
-	HDRImage(){};
-	~HDRImage()
-	{
-		if(data != nullptr)
-			stbi_image_free(data);
-	};
+	int width = 0, height = 0;
 	void load(const std::string& filename);
-	glm::vec3 sample(float u, float v);
+	bool empty() const
+	{
+		return m_cache == nullptr;
+	}
+	const pathtracer::EnvironmentCache& cache() const
+	{
+		return *m_cache;
+	}
+	// Without an image, this is black and sampleUV() returns pdf 0
+	glm::vec3 sample(float u, float v) const;
+
+	///////////////////////////////////////////////////////////////////////
+	// Importance sampling of the image as a latitude-longitude environment
+	// map, where v = theta / pi. Pixels are drawn with a probability
+	// proportional to their luminance times sin(theta), the area of the
+	// sphere they cover, by first drawing a row from the marginal
+	// distribution and then a pixel within it. The alias tables for both
+	// are in the cache.
+	///////////////////////////////////////////////////////////////////////
+	// Draw (u, v) from two numbers in [0, 1), and return the pdf of it
+	// with respect to area in the (u, v) square
+	glm::vec2 sampleUV(float u1, float u2, float& pdf) const;
+	float pdfUV(float u, float v) const;
+
+private:
+	std::shared_ptr<const pathtracer::EnvironmentCache> m_cache;
 };
\ No newline at end of file
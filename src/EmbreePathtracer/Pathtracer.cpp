@@ -5,10 +5,13 @@
 #include <iostream>
 #include <map>
 #include <algorithm>
+#include <chrono>
+#include <fstream>
 
 #include "material.h"
 #include "embree.h"
 #include "sampling.h"
+#include "fastmath.h"
 
 
 
@@ -33,6 +36,93 @@ namespace pathtracer
 	{
 		// No need to clear image,
 		rendered_image.number_of_samples = 0;
+		integrator_stats.total_time_ms = 0.0f;
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Reference image
+	///////////////////////////////////////////////////////////////////////////
+	Image reference_image;
+
+	void storeReferenceImage()
+	{
+		reference_image = rendered_image;
+	}
+
+	float referenceError()
+	{
+		if (reference_image.data.empty() || reference_image.width != rendered_image.width
+			|| reference_image.height != rendered_image.height)
+		{
+			return -1.0f;
+		}
+		double sum = 0.0;
+		for (size_t i = 0; i < rendered_image.data.size(); i++)
+		{
+			const vec3 d = rendered_image.data[i] - reference_image.data[i];
+			sum += dot(d, d) / 3.0f;
+		}
+		return float(sqrt(sum / double(rendered_image.data.size())));
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// The reference is stored as a little endian PFM, the simplest format
+	// that keeps the full float radiance. Rows go from the bottom up, just
+	// like in rendered_image.
+	///////////////////////////////////////////////////////////////////////////
+	bool saveReferenceImage(const std::string& filename)
+	{
+		if (reference_image.data.empty())
+			return false;
+		ofstream file(filename, ios::binary);
+		if (!file)
+			return false;
+		file << "PF\n" << reference_image.width << " " << reference_image.height << "\n-1.0\n";
+		file.write(reinterpret_cast<const char*>(reference_image.data.data()),
+		           reference_image.data.size() * sizeof(vec3));
+		return bool(file);
+	}
+
+	bool loadReferenceImage(const std::string& filename)
+	{
+		ifstream file(filename, ios::binary);
+		string format;
+		int width, height;
+		float scale;
+		file >> format >> width >> height >> scale;
+		file.get(); // The single whitespace before the data
+		if (!file || format != "PF" || width <= 0 || height <= 0 || scale >= 0.0f)
+		{
+			cout << "Can't read reference image " << filename << " (expected a little endian color PFM)\n";
+			return false;
+		}
+		vector<vec3> data(size_t(width) * size_t(height));
+		file.read(reinterpret_cast<char*>(data.data()), data.size() * sizeof(vec3));
+		if (!file)
+			return false;
+		reference_image.width = width;
+		reference_image.height = height;
+		reference_image.data.swap(data);
+		return true;
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// With a reference image, print the error every time the number of
+	// samples doubles, which gives the convergence of the current sampler.
+	// The efficiency 1 / (RMSE^2 * seconds) compares settings that trade
+	// noise for speed, such as Russian roulette: higher is better.
+	///////////////////////////////////////////////////////////////////////////
+	static void reportConvergence()
+	{
+		const int n = rendered_image.number_of_samples;
+		if ((n & (n - 1)) != 0)
+			return;
+		const float error = referenceError();
+		if (error < 0.0f)
+			return;
+		const float seconds = integrator_stats.total_time_ms / 1000.0f;
+		cout << SAMPLER_NAMES[sampling_settings.sampler] << " sampler, " << n << " spp, " << seconds
+		     << " s: RMSE " << error << ", efficiency " << 1.0f / (error * error * seconds) << "\n";
 	}
 
 	///////////////////////////////////////////////////////////////////////////
@@ -51,102 +141,554 @@ namespace pathtracer
 	// Return the radiance from a certain direction wi from the environment
 	// map.
 	///////////////////////////////////////////////////////////////////////////
-	vec3 Lenvironment(const vec3& wi)
+	// Where direction wi is in the latitude-longitude map
+	static vec2 environmentUV(const vec3& wi)
 	{
-		const float theta = acos(std::max(-1.0f, std::min(1.0f, wi.y)));
-		float phi = atan(wi.z, wi.x);
+		const float theta = fastAcos(std::max(-1.0f, std::min(1.0f, wi.y)));
+		float phi = fastAtan2(wi.z, wi.x);
 		if (phi < 0.0f)
-			phi = phi + 2.0f * M_PI;
-		vec2 lookup = vec2(phi / (2.0 * M_PI), theta / M_PI);
+			phi = phi + 2.0f * float(M_PI);
+		return vec2(phi * float(0.5 / M_PI), theta * float(1.0 / M_PI));
+	}
+
+	vec3 Lenvironment(const vec3& wi)
+	{
+		if (!environment.octahedral.empty())
+			return environment.multiplier * environment.octahedral.lookup(wi, environment.bilinear);
+		vec2 lookup = environmentUV(wi);
 		return environment.multiplier * environment.map.sample(lookup.x, lookup.y);
 		//return vec3(0.0f, 0.0f, 0.0f);
 	}
 
+	void Lenvironment(const float* const wi[3], size_t count, float* const radiance[3])
+	{
+		if (environment.octahedral.empty())
+		{
+			for (size_t i = 0; i < count; i++)
+			{
+				const vec3 L = Lenvironment(vec3(wi[0][i], wi[1][i], wi[2][i]));
+				radiance[0][i] = L.x;
+				radiance[1][i] = L.y;
+				radiance[2][i] = L.z;
+			}
+			return;
+		}
+		environment.octahedral.lookup(wi, count, radiance, environment.bilinear);
+		for (int c = 0; c < 3; c++)
+		{
+			for (size_t i = 0; i < count; i++)
+			{
+				radiance[c][i] *= environment.multiplier;
+			}
+		}
+	}
+
+	void loadEnvironment(const std::string& filename)
+	{
+		environment.map.load(filename);
+		const EnvironmentCache& cache = environment.map.cache();
+		environment.octahedral.attach(cache.octahedral_size, cache.scale, cache.octahedral_texels);
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Offset a ray origin along the geometry normal by a number of ulps
+	// rather than a fixed distance, so that it is large enough far from the
+	// origin and small enough close to it. (Wächter and Binder, "A Fast and
+	// Robust Method for Avoiding Self-Intersection", Ray Tracing Gems 2019.)
+	///////////////////////////////////////////////////////////////////////////
+	static float offsetComponent(float p, float n)
+	{
+		const float origin = 1.0f / 32.0f;
+		const float float_scale = 1.0f / 65536.0f;
+		const float int_scale = 256.0f;
+		if (std::abs(p) < origin)
+			return p + float_scale * n;
+		const int of_i = int(int_scale * n);
+		return intBitsToFloat(floatBitsToInt(p) + (p < 0.0f ? -of_i : of_i));
+	}
+
+	vec3 offsetRayOrigin(const vec3& p, const vec3& n)
+	{
+		return vec3(offsetComponent(p.x, n.x), offsetComponent(p.y, n.y), offsetComponent(p.z, n.z));
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Set up the shadow ray towards the point light. The ray stops just
+	// short of the light so that geometry behind it can't occlude it and
+	// traversal can terminate early.
+	///////////////////////////////////////////////////////////////////////////
+	void samplePointLight(const Intersection& hit, Ray& shadow_ray, vec3& wi, vec3& Li)
+	{
+		const vec3 to_light = point_light.position - hit.position;
+		const float distance_to_light = length(to_light);
+		const float falloff_factor = 1.0f / (distance_to_light * distance_to_light);
+		Li = point_light.intensity_multiplier * point_light.color * falloff_factor;
+		wi = to_light / distance_to_light;
+		const vec3 n = dot(wi, hit.geometry_normal) < 0.0f ? -hit.geometry_normal : hit.geometry_normal;
+		const vec3 origin = offsetRayOrigin(hit.position, n);
+		shadow_ray = Ray(origin, wi, 0.0f, length(point_light.position - origin) * (1.0f - EPSILON));
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Environment light sampling. Directions are drawn from the distribution
+	// of the map's pixels that load() builds, which follows their luminance,
+	// so the sun is found by shadow rays rather than by chance. The pdf over
+	// the (u, v) square becomes one over solid angle through the Jacobian
+	// of the latitude-longitude mapping, 2 pi^2 sin(theta). Light samples
+	// are combined with BRDF sampling through multiple importance sampling,
+	// so that glossy reflections still converge from the BRDF samples.
+	///////////////////////////////////////////////////////////////////////////
+	void sampleEnvironmentLight(const Intersection& hit, Ray& shadow_ray, vec3& wi, vec3& Li, float& pdf)
+	{
+		const float u1 = randf();
+		const float u2 = randf();
+		float pdf_uv;
+		const vec2 uv = environment.map.sampleUV(u1, u2, pdf_uv);
+		const float theta = uv.y * float(M_PI);
+		const float sin_theta = sin(theta);
+		float sin_phi, cos_phi;
+		fastSinCos(2.0f * float(M_PI) * uv.x, sin_phi, cos_phi);
+		wi = vec3(sin_theta * cos_phi, cos(theta), sin_theta * sin_phi);
+		// At the poles the pdf over solid angle is undefined. The sample is
+		// then dropped, which makes no difference as it has zero area.
+		pdf = sin_theta > 0.0f ? pdf_uv / (2.0f * float(M_PI) * float(M_PI) * sin_theta) : 0.0f;
+		Li = pdf > 0.0f ? Lenvironment(wi) : vec3(0.0f);
+		const vec3 n = dot(wi, hit.geometry_normal) < 0.0f ? -hit.geometry_normal : hit.geometry_normal;
+		shadow_ray = Ray(offsetRayOrigin(hit.position, n), wi);
+	}
+
+	float environmentLightPdf(const vec3& wi)
+	{
+		const float sin_theta = sqrt(std::max(0.0f, 1.0f - wi.y * wi.y));
+		if (sin_theta <= 0.0f)
+			return 0.0f;
+		const vec2 uv = environmentUV(wi);
+		return environment.map.pdfUV(uv.x, uv.y) / (2.0f * float(M_PI) * float(M_PI) * sin_theta);
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Emissive triangle sampling. A triangle is drawn by its power and then
+	// a point uniformly on it, so the pdf per area of the point, p(triangle)
+	// / area, is the luminance it emits over the total power. A BRDF sample
+	// that hits an emissive surface gets that pdf from its material, without
+	// finding its triangle in the list. Towards the point it becomes a pdf
+	// per solid angle through the squared distance over the cosine at the
+	// light. Emission is two-sided, as when it is hit.
+	///////////////////////////////////////////////////////////////////////////
+	static bool emissiveLightSampling()
+	{
+		return settings.emissive_light_sampling && emissive_lights.power.sum > 0.0f;
+	}
+
+	void sampleEmissiveLight(const Intersection& hit, Ray& shadow_ray, vec3& wi, vec3& Li, float& pdf)
+	{
+		pdf = 0.0f;
+		Li = vec3(0.0f);
+		if (!emissiveLightSampling())
+			return;
+		float u;
+		const uint32_t index = emissive_lights.power.sample(randf(), u);
+		const float v = randf();
+		const EmissiveTriangle& triangle = emissive_lights.triangles[index];
+		const float sqrt_u = sqrt(u);
+		const vec3 point = triangle.p0 + triangle.edge1 * (sqrt_u * (1.0f - v)) + triangle.edge2 * (sqrt_u * v);
+		const vec3 to_light = point - hit.position;
+		const float distance2 = dot(to_light, to_light);
+		if (!(distance2 > 0.0f))
+			return;
+		wi = to_light / sqrt(distance2);
+		const float cos_light = abs(dot(triangle.normal, wi));
+		if (!(cos_light > 0.0f))
+			return;
+		pdf = emissive_lights.power.pdf[index] / triangle.area * distance2 / cos_light;
+		Li = triangle.emission;
+		const vec3 n = dot(wi, hit.geometry_normal) < 0.0f ? -hit.geometry_normal : hit.geometry_normal;
+		const vec3 origin = offsetRayOrigin(hit.position, n);
+		shadow_ray = Ray(origin, wi, 0.0f, length(point - origin) * (1.0f - EPSILON));
+	}
+
+	float emissionWeight(const Intersection& hit, const Ray& ray, float pdf)
+	{
+		if (pdf <= 0.0f || !emissiveLightSampling())
+			return 1.0f;
+		const vec3 to_hit = hit.position - ray.o;
+		const float cos_light = abs(dot(hit.geometry_normal, hit.wo));
+		if (!(cos_light > 0.0f))
+			return 1.0f;
+		const float pdf_area = luminance(hit.material->emission) / emissive_lights.power.sum;
+		return powerHeuristic(pdf, pdf_area * dot(to_hit, to_hit) / cos_light);
+	}
+
+	vec3 Lemitted(const Ray& ray, float pdf)
+	{
+		if (!emissiveLightSampling())
+			return vec3(0.0f);
+		const Intersection hit = getIntersection(ray);
+		if (hit.material->emission == vec3(0.0f))
+			return vec3(0.0f);
+		return hit.material->emission * emissionWeight(hit, ray, pdf);
+	}
+
+	bool continuePath(const Intersection& hit, const vec3& wi, const vec3& brdf, float pdf, vec3& path_throughput,
+		Ray& next_ray)
+	{
+		auto cosine_term = abs(dot(wi, hit.shading_normal));
+
+		if (pdf < EPSILON) return false; // Without this check we get a stupid memory access exception
+		path_throughput = path_throughput * (brdf * cosine_term) / pdf;
+
+		// If path_throughput is zero there is no need to continue
+		if (path_throughput == vec3(0.0f))
+			return false;
+
+		// Create next ray on path (existing instance can't be reused)
+		// Point next ray in direction wi
+		next_ray = Ray();
+		next_ray.d = wi;
+		next_ray.o = offsetRayOrigin(hit.position,
+		                             dot(wi, hit.geometry_normal) < 0.0f ? -hit.geometry_normal : hit.geometry_normal);
+		return true;
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Paths whose throughput has become small contribute little, so they are
+	// only followed with a probability that follows the throughput. Dividing
+	// the survivors by that probability keeps the estimate unbiased; the
+	// lower clamp bounds how much a survivor can be scaled up, and so the
+	// fireflies roulette adds.
+	///////////////////////////////////////////////////////////////////////////
+	bool survivesRoulette(int bounce, vec3& path_throughput)
+	{
+		if (!settings.russian_roulette || bounce < settings.roulette_start_bounce)
+			return true;
+		const float largest = std::max(path_throughput.x, std::max(path_throughput.y, path_throughput.z));
+		const float survival = std::min(std::max(largest, settings.roulette_min_survival), 1.0f);
+		if (randf() >= survival)
+			return false;
+		path_throughput /= survival;
+		return true;
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Shade one vertex of a path: add the emitted radiance at the hit to L,
+	// queue shadow rays for direct light, then sample the direction the path
+	// continues in and update the path throughput. Returns false if the path
+	// ends here. Without direct_light, environment_light (or emission) the
+	// point light, the environment (or the emission of materials) is known
+	// to contribute nothing and skipped.
+	//
+	// The point light can't be hit by BRDF sampling, so its light sample
+	// gets the full weight. Environment and emissive triangle light samples
+	// are weighted against the BRDF pdf with the power heuristic. Li()
+	// weights the paths that escape to the environment the other way around,
+	// and the emission at hit is weighted here by the pdf of the ray that
+	// found it, which next_ray and pdf hold on the way in.
+	///////////////////////////////////////////////////////////////////////////
+	template <bool direct_light, bool environment_light, bool emission>
+	static bool shadeVertex(const Intersection& hit, vec3& path_throughput, vec3& L, Ray& next_ray, float& pdf,
+		DirectLightBatch& direct_light_batch, uint32_t id)
+	{
+		const MaterialClosure& mat = *hit.material;
+
+		// Direct illumination. The shadow rays are traced by the caller, and
+		// the contributions only added if the light is visible.
+		if (direct_light)
+		{
+			LightSample light_sample;
+			vec3 wi, Li;
+			samplePointLight(hit, light_sample.shadow_ray, wi, Li);
+			light_sample.contribution = path_throughput * mat.f(wi, hit.wo, hit.shading_normal) * Li
+			                            * std::max(0.0f, dot(wi, hit.shading_normal));
+			if (light_sample.contribution != vec3(0.0f))
+				direct_light_batch.add(light_sample, id);
+		}
+		if (environment_light)
+		{
+			LightSample light_sample;
+			vec3 wi, Li;
+			float light_pdf;
+			sampleEnvironmentLight(hit, light_sample.shadow_ray, wi, Li, light_pdf);
+			if (light_pdf > 0.0f)
+			{
+				const float weight = powerHeuristic(light_pdf, mat.pdf(wi, hit.wo, hit.shading_normal));
+				light_sample.contribution = path_throughput * mat.f(wi, hit.wo, hit.shading_normal) * Li
+				                            * (std::max(0.0f, dot(wi, hit.shading_normal)) * weight / light_pdf);
+				if (light_sample.contribution != vec3(0.0f))
+					direct_light_batch.add(light_sample, id);
+			}
+		}
+
+		if (emission)
+		{
+			LightSample light_sample;
+			vec3 wi, Li;
+			float light_pdf;
+			sampleEmissiveLight(hit, light_sample.shadow_ray, wi, Li, light_pdf);
+			if (light_pdf > 0.0f)
+			{
+				const float weight = powerHeuristic(light_pdf, mat.pdf(wi, hit.wo, hit.shading_normal));
+				light_sample.contribution = path_throughput * mat.f(wi, hit.wo, hit.shading_normal) * Li
+				                            * (std::max(0.0f, dot(wi, hit.shading_normal)) * weight / light_pdf);
+				if (light_sample.contribution != vec3(0.0f))
+					direct_light_batch.add(light_sample, id);
+			}
+		}
+
+		// Add emitted radiance from intersection
+		if (emission && mat.emission != vec3(0.0f))
+			L += path_throughput * mat.emission * emissionWeight(hit, next_ray, pdf);
+
+		vec3 wi;
+
+		// Sample an incoming direction (and the brdf and pdf for that direction)
+		const Frame frame = { hit.tangent, hit.bitangent, hit.shading_normal };
+		auto brdf = mat.sample_wi(wi, hit.wo, frame, pdf);
+		return continuePath(hit, wi, brdf, pdf, path_throughput, next_ray);
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Specialized integrators
+	///////////////////////////////////////////////////////////////////////////
+	IntegratorStats integrator_stats;
+
+	// What the scene and settings need from the integrators this frame
+	static IntegratorFeatures selectFeatures()
+	{
+		IntegratorFeatures features = { true, true, true, 0 };
+		if (!settings.specialize_integrator)
+			return features;
+		features.direct_light = point_light.intensity_multiplier != 0.0f && point_light.color != vec3(0.0f);
+		features.environment_light = environment.multiplier != 0.0f && !environment.map.empty();
+		features.emission = anyEmissiveMaterial();
+		for (int bounces : SPECIALIZED_BOUNCES)
+		{
+			if (settings.max_bounces == bounces)
+				features.bounces = bounces;
+		}
+		return features;
+	}
+
+	// The wavefront integrator shades with the variant for this frame
+	template <bool direct_light>
+	static bool shadePathVertexWith(const Intersection& hit, vec3& path_throughput, vec3& L, Ray& next_ray,
+		float& pdf, DirectLightBatch& batch, uint32_t id)
+	{
+		const IntegratorFeatures& features = integrator_stats.features;
+		if (features.environment_light)
+		{
+			return features.emission
+				? shadeVertex<direct_light, true, true>(hit, path_throughput, L, next_ray, pdf, batch, id)
+				: shadeVertex<direct_light, true, false>(hit, path_throughput, L, next_ray, pdf, batch, id);
+		}
+		return features.emission
+			? shadeVertex<direct_light, false, true>(hit, path_throughput, L, next_ray, pdf, batch, id)
+			: shadeVertex<direct_light, false, false>(hit, path_throughput, L, next_ray, pdf, batch, id);
+	}
+
+	bool shadePathVertex(const Intersection& hit, vec3& path_throughput, vec3& L, Ray& next_ray, float& pdf,
+		DirectLightBatch& batch, uint32_t id)
+	{
+		return integrator_stats.features.direct_light
+			? shadePathVertexWith<true>(hit, path_throughput, L, next_ray, pdf, batch, id)
+			: shadePathVertexWith<false>(hit, path_throughput, L, next_ray, pdf, batch, id);
+	}
+
 	///////////////////////////////////////////////////////////////////////////
 	// Calculate the radiance going from one point (r.hitPosition()) in one
-	// direction (-r.d), through path tracing.
+	// direction (-r.d), through path tracing. Direct light is not included
+	// but added to direct_light_batch under id, to be traced later. With
+	// bounces 0 the number of bounces is settings.max_bounces.
 	///////////////////////////////////////////////////////////////////////////
-	vec3 Li(Ray& primary_ray)
+	template <bool direct_light, bool environment_light, bool emission, int bounces>
+	static vec3 Li(Ray& primary_ray, DirectLightBatch& direct_light_batch, uint32_t id)
 	{
 		vec3 L = vec3(0.0f);
 		vec3 path_throughput = vec3(1.0);
 		Ray current_ray = primary_ray;
-		Ray shadowRay;
+		const int max_bounces = bounces > 0 ? bounces : settings.max_bounces;
+
+		// The pdf of the ray that found each hit, 0 for the camera ray
+		float pdf = 0.0f;
 
 		// TASK 5: Path tracer
-		for (size_t i = 0; i < settings.max_bounces; i++)
+		for (int i = 0; i < max_bounces; i++)
 		{
 			// Get the intersection information from the ray
 			Intersection hit = getIntersection(current_ray);
 
-			// Create a Material tree
-			Diffuse diffuse(hit.material->m_color);
-			BlinnPhong dielectric(hit.material->m_shininess, hit.material->m_fresnel, &diffuse);
-			BlinnPhongMetal metal(hit.material->m_color, hit.material->m_shininess,
-				hit.material->m_fresnel);
-			LinearBlend metal_blend(hit.material->m_metalness, &metal, &dielectric);
-			LinearBlend reflectivity_blend(hit.material->m_reflectivity, &metal_blend, &diffuse);
-			BRDF& mat = reflectivity_blend;
-
-			// Direct illumination
-			shadowRay = Ray();
-			shadowRay.d = normalize(point_light.position - hit.position + EPSILON);
-			shadowRay.o = hit.position + EPSILON;
-
-			if (!occluded(shadowRay))
-			{
-				const float distance_to_light = length(point_light.position - hit.position);
-				const float falloff_factor = 1.0f / (distance_to_light * distance_to_light);
-				vec3 Li = point_light.intensity_multiplier * point_light.color * falloff_factor;
-				vec3 wi = normalize(point_light.position - hit.position);
+			const bool path_continues = shadeVertex<direct_light, environment_light, emission>(
+				hit, path_throughput, L, current_ray, pdf, direct_light_batch, id);
+			if (!path_continues || !survivesRoulette(i + 1, path_throughput))
+				return L;
 
-				L += mat.f(wi, hit.wo, hit.shading_normal) * Li * std::max(0.0f, dot(wi, hit.shading_normal));
+			if (!intersect(current_ray))
+			{
+				if (!environment_light)
+					return L;
+				const float weight = powerHeuristic(pdf, environmentLightPdf(current_ray.d));
+				return L + path_throughput * Lenvironment(current_ray.d) * weight;
 			}
+		}
 
-			// Add emitted radiance from intersection			
-			L += path_throughput * hit.material->m_emission * hit.material->m_color;
-			
-			float pdf;
-			vec3 wi;
-
-			// Sample an incoming direction (and the brdf and pdf for that direction)
-			auto brdf = mat.sample_wi(wi, hit.wo, hit.shading_normal, pdf);
-			auto cosine_term = abs(dot(wi, hit.shading_normal));
-			
-			if (pdf < EPSILON) return L; // Without this check we get a stupid memory access exception
-			path_throughput = path_throughput * (brdf * cosine_term) / pdf;
-			
-
-			// If path_throughput is zero there is no need to continue
-			if(path_throughput == vec3(0.0f)) 
-				return L;
-
+		// Out of bounces, keep what the path has gathered so far. With
+		// emissive light sampling, the light samples of the last vertex were
+		// weighted against its ray finding the emission, so like the
+		// environment for paths that escape, that emission is included.
+		if (emission && max_bounces > 0)
+			L += path_throughput * Lemitted(current_ray, pdf);
+		return L;
+	}
 
-			// Create next ray on path (existing instance can't be reused)
-			// Point next ray in direction wi
-			current_ray = Ray();
-			current_ray.d = wi;
-			current_ray.o = hit.position;
-			current_ray.o += EPSILON * hit.shading_normal; 
+	///////////////////////////////////////////////////////////////////////////
+	// Fill a packet with camera rays for the block of pixels whose lower left
+	// corner is (x0, y0). Since the unprojection is linear in the pixel
+	// coordinates (up to the homogenization), this only needs the columns of
+	// inverse(P * V) and vectorizes over the lanes.
+	///////////////////////////////////////////////////////////////////////////
+	void generateCameraRays(RayPacket& packet, int x0, int y0, const vec3& camera_pos, const mat4& inv_PV)
+	{
+		RTCRay8& rays = packet.rays;
+		const vec4 dx = inv_PV[0] * (2.0f / float(rendered_image.width));
+		const vec4 dy = inv_PV[1] * (2.0f / float(rendered_image.height));
+		const vec4 base = inv_PV[3] + inv_PV[2] - inv_PV[0] - inv_PV[1];
+		for (int lane = 0; lane < RAY_PACKET_SIZE; lane++)
+		{
+			const int x = x0 + lane % PACKET_WIDTH;
+			const int y = y0 + lane / PACKET_WIDTH;
+			packet.valid[lane] = (x < rendered_image.width && y < rendered_image.height) ? -1 : 0;
+			// Place the sample within the pixel with the first dimensions of
+			// the sampler
+			const vec2 jitter = pixelSample(uint32_t(x), uint32_t(y), uint32_t(rendered_image.number_of_samples));
+			const vec4 p = base + (float(x) + jitter.x) * dx + (float(y) + jitter.y) * dy;
+			const float inv_w = 1.0f / p.w;
+			const float dir_x = p.x * inv_w - camera_pos.x;
+			const float dir_y = p.y * inv_w - camera_pos.y;
+			const float dir_z = p.z * inv_w - camera_pos.z;
+			const float inv_length = 1.0f / sqrt(dir_x * dir_x + dir_y * dir_y + dir_z * dir_z);
+			rays.orgx[lane] = camera_pos.x;
+			rays.orgy[lane] = camera_pos.y;
+			rays.orgz[lane] = camera_pos.z;
+			rays.dirx[lane] = dir_x * inv_length;
+			rays.diry[lane] = dir_y * inv_length;
+			rays.dirz[lane] = dir_z * inv_length;
+			rays.tnear[lane] = 0.0f;
+			rays.tfar[lane] = FLT_MAX;
+			rays.time[lane] = 0.0f;
+			rays.mask[lane] = 0xFFFFFFFF;
+			rays.geomID[lane] = RTC_INVALID_GEOMETRY_ID;
+			rays.primID[lane] = RTC_INVALID_GEOMETRY_ID;
+			rays.instID[lane] = RTC_INVALID_GEOMETRY_ID;
+		}
+	}
 
+	///////////////////////////////////////////////////////////////////////////
+	// Add a sample to the running average of a pixel
+	///////////////////////////////////////////////////////////////////////////
+	void accumulateSample(int pixel, const vec3& color)
+	{
+		float n = float(rendered_image.number_of_samples);
+		rendered_image.data[pixel] = rendered_image.data[pixel] * (n / (n + 1.0f)) + (1.0f / (n + 1.0f)) * color;
+	}
 
-			//return L;
+	///////////////////////////////////////////////////////////////////////////
+	// The depth first integrator, for one combination of features
+	///////////////////////////////////////////////////////////////////////////
+	template <bool direct_light, bool environment_light, bool emission, int bounces>
+	static void tracePathsDepthFirst(const vec3& camera_pos, const mat4& inv_PV)
+	{
+		const int blocks_x = (rendered_image.width + PACKET_WIDTH - 1) / PACKET_WIDTH;
+		const int blocks_y = (rendered_image.height + PACKET_HEIGHT - 1) / PACKET_HEIGHT;
+		// Trace one path per pixel (the omp parallel stuf magically distributes the
+		// pathtracing on all cores of your CPU). The shadow rays of a row of
+		// blocks are traced together once all its paths are done.
+		#pragma omp parallel
+		{
+			RayPacket packet;
+			DirectLightBatch light_batch;
+			vector<vec3> row_radiance(blocks_x * RAY_PACKET_SIZE);
 
-			if (!intersect(current_ray))
-				return L + path_throughput * Lenvironment(current_ray.d);
+			#pragma omp for schedule(dynamic)
+			for (int block_y = 0; block_y < blocks_y; block_y++)
+			{
+				const int y0 = block_y * PACKET_HEIGHT;
+				light_batch.clear();
+				for (int block_x = 0; block_x < blocks_x; block_x++)
+				{
+					const int x0 = block_x * PACKET_WIDTH;
+					// Create rays that start in the camera position and point toward
+					// the pixels on a virtual screen, and intersect them with the scene
+					generateCameraRays(packet, x0, y0, camera_pos, inv_PV);
+					intersect(packet);
+					for (int lane = 0; lane < RAY_PACKET_SIZE; lane++)
+					{
+						if (!packet.valid[lane])
+							continue;
+						const uint32_t id = uint32_t(block_x * RAY_PACKET_SIZE + lane);
+						beginSample(uint32_t(x0 + lane % PACKET_WIDTH), uint32_t(y0 + lane / PACKET_WIDTH),
+						            uint32_t(rendered_image.number_of_samples));
+						Ray primaryRay = getRay(packet, lane);
+						if (primaryRay.geomID != RTC_INVALID_GEOMETRY_ID)
+						{
+							// If it hit something, evaluate the radiance from that point
+							row_radiance[id] = Li<direct_light, environment_light, emission, bounces>(primaryRay, light_batch, id);
+						}
+						else
+						{
+							// Otherwise evaluate environment
+							row_radiance[id] = environment_light ? Lenvironment(primaryRay.d) : vec3(0.0f);
+						}
+					}
+				}
+				light_batch.trace([&row_radiance](uint32_t id, const vec3& contribution) {
+					row_radiance[id] += contribution;
+				});
+				// Accumulate the obtained radiance to the pixels color
+				for (int block_x = 0; block_x < blocks_x; block_x++)
+				{
+					for (int lane = 0; lane < RAY_PACKET_SIZE; lane++)
+					{
+						const int x = block_x * PACKET_WIDTH + lane % PACKET_WIDTH;
+						const int y = y0 + lane / PACKET_WIDTH;
+						if (x < rendered_image.width && y < rendered_image.height)
+							accumulateSample(y * rendered_image.width + x, row_radiance[block_x * RAY_PACKET_SIZE + lane]);
+					}
+				}
+			}
 		}
+	}
 
-		return vec3(0.0f);
+	typedef void (*DepthFirstIntegrator)(const vec3& camera_pos, const mat4& inv_PV);
+
+#define BOUNCE_VARIANTS(direct_light, environment_light, emission)           \
+	{                                                                        \
+		&tracePathsDepthFirst<direct_light, environment_light, emission, 0>, \
+		&tracePathsDepthFirst<direct_light, environment_light, emission, 1>, \
+		&tracePathsDepthFirst<direct_light, environment_light, emission, 2>, \
+		&tracePathsDepthFirst<direct_light, environment_light, emission, 4>, \
+		&tracePathsDepthFirst<direct_light, environment_light, emission, 8>  \
 	}
 
-	///////////////////////////////////////////////////////////////////////////
-	// Used to homogenize points transformed with projection matrices
-	///////////////////////////////////////////////////////////////////////////
-	inline static glm::vec3 homogenize(const glm::vec4& p)
+	static DepthFirstIntegrator selectDepthFirst(const IntegratorFeatures& f)
 	{
-		return glm::vec3(p * (1.f / p.w));
+		// Indexed by the features as bits, then by the bounce count
+		static const DepthFirstIntegrator variants[8][5] = {
+			BOUNCE_VARIANTS(false, false, false), BOUNCE_VARIANTS(false, false, true),
+			BOUNCE_VARIANTS(false, true, false),  BOUNCE_VARIANTS(false, true, true),
+			BOUNCE_VARIANTS(true, false, false),  BOUNCE_VARIANTS(true, false, true),
+			BOUNCE_VARIANTS(true, true, false),   BOUNCE_VARIANTS(true, true, true),
+		};
+		const int features = (f.direct_light ? 4 : 0) + (f.environment_light ? 2 : 0) + (f.emission ? 1 : 0);
+		int bounce_variant = 0;
+		for (int i = 0; i < 4; i++)
+		{
+			if (f.bounces == SPECIALIZED_BOUNCES[i])
+				bounce_variant = i + 1;
+		}
+		return variants[features][bounce_variant];
 	}
 
+#undef BOUNCE_VARIANTS
+
 	///////////////////////////////////////////////////////////////////////////
 	// Trace one path per pixel and accumulate the result in an image
 	///////////////////////////////////////////////////////////////////////////
@@ -158,48 +700,20 @@ namespace pathtracer
 		{
 			return;
 		}
+		// The camera only changes between frames, so set it up once here
+		// rather than once per pixel.
 		vec3 camera_pos = vec3(glm::inverse(V) * vec4(0.0f, 0.0f, 0.0f, 1.0f));
-		// Trace one path per pixel (the omp parallel stuf magically distributes the
-		// pathtracing on all cores of your CPU).
-		int num_rays = 0;
-		vector<vec4> local_image(rendered_image.width * rendered_image.height, vec4(0.0f));
-
-		#pragma omp parallel for
-		for (int y = 0; y < rendered_image.height; y++)
-		{
-			for (int x = 0; x < rendered_image.width; x++)
-			{
-				vec3 color;
-				Ray primaryRay;
-				primaryRay.o = camera_pos;
-				primaryRay.d
-					= vec3(randf(), randf(), randf());	// TASK 1: Jittered Sampling - Random float for vec3 direction using randf()
-				// Create a ray that starts in the camera position and points toward
-				// the current pixel on a virtual screen.
-				vec2 screenCoord = vec2(float(x) / float(rendered_image.width),
-					float(y) / float(rendered_image.height));
-				// Calculate direction
-				vec4 viewCoord = vec4(screenCoord.x * 2.0f - 1.0f, screenCoord.y * 2.0f - 1.0f, 1.0f, 1.0f);
-				vec3 p = homogenize(inverse(P * V) * viewCoord);
-				primaryRay.d = normalize(p - camera_pos);
-				// Intersect ray with scene
-				if (intersect(primaryRay))
-				{
-					// If it hit something, evaluate the radiance from that point
-					color = Li(primaryRay);
-				}
-				else
-				{
-					// Otherwise evaluate environment
-					color = Lenvironment(primaryRay.d);
-				}
-				// Accumulate the obtained radiance to the pixels color
-				float n = float(rendered_image.number_of_samples);
-				rendered_image.data[y * rendered_image.width + x] = 
-					rendered_image.data[y * rendered_image.width + x] * (n / (n + 1.0f)) 
-				  + (1.0f / (n + 1.0f)) * color;
-			}
-		}
+		mat4 inv_PV = inverse(P * V);
+		integrator_stats.features = selectFeatures();
+		auto start_time = chrono::high_resolution_clock::now();
+		if (settings.integrator == INTEGRATOR_WAVEFRONT)
+			tracePathsWavefront(camera_pos, inv_PV);
+		else
+			selectDepthFirst(integrator_stats.features)(camera_pos, inv_PV);
+		chrono::duration<float, milli> trace_time = chrono::high_resolution_clock::now() - start_time;
+		integrator_stats.trace_time_ms = trace_time.count();
+		integrator_stats.total_time_ms += trace_time.count();
 		rendered_image.number_of_samples += 1;
+		reportConvergence();
 	}
 }; // namespace pathtracer
@@ -4,6 +4,9 @@
 #include <Model.h>
 #include <omp.h>
 #include "HDRImage.h"
+#include "envmap.h"
+#include "embree.h"
+#include "raystream.h"
 
 #ifdef M_PI
 #undef M_PI
@@ -16,6 +19,15 @@ using namespace glm;
 
 namespace pathtracer
 {
+///////////////////////////////////////////////////////////////////////////////
+// The available integrators
+///////////////////////////////////////////////////////////////////////////////
+enum Integrator
+{
+	INTEGRATOR_DEPTH_FIRST = 0, // Follow one path at a time to its end (Li())
+	INTEGRATOR_WAVEFRONT = 1,   // Advance all paths of a tile one bounce at a time
+};
+
 ///////////////////////////////////////////////////////////////////////////////
 // Path Tracer settings
 ///////////////////////////////////////////////////////////////////////////////
@@ -24,16 +36,59 @@ extern struct Settings
 	int subsampling;
 	int max_bounces;
 	int max_paths_per_pixel;
+	int integrator;
+	bool ray_streams;  // Trace batched rays in bulk instead of one by one
+	bool reorder_rays; // Sort ray streams for coherence before tracing them
+	bool specialize_integrator; // Run the integrator compiled for the features in use
+	bool simd_shading; // Let the wavefront integrator shade hits in SIMD batches, see brdf_simd.h
+	// Russian roulette: from roulette_start_bounce on, a path continues
+	// with a probability that follows its throughput, clamped to at least
+	// roulette_min_survival, and is reweighted by it when it does
+	bool russian_roulette;
+	int roulette_start_bounce;
+	float roulette_min_survival;
+	// Next event estimation on emissive triangles, see sampleEmissiveLight().
+	// Paths then also keep the emission found after their last bounce, see
+	// Lemitted().
+	bool emissive_light_sampling;
 } settings;
 
+///////////////////////////////////////////////////////////////////////////////
+// The integrators are compiled for every combination of the features
+// below, and each frame runs the variant that leaves out what the scene
+// doesn't need, so that the compiler can drop those branches and unroll
+// the bounce loop. With specialize_integrator off the variant with every
+// feature on and a runtime bounce count is used, for comparison.
+///////////////////////////////////////////////////////////////////////////////
+struct IntegratorFeatures
+{
+	bool direct_light;      // The point light is on
+	bool environment_light; // The environment map is on
+	bool emission;          // Some material emits light
+	int bounces;            // max_bounces if it is in SPECIALIZED_BOUNCES, else 0
+};
+// Bounce counts that get a loop of fixed length
+const int SPECIALIZED_BOUNCES[] = { 1, 2, 4, 8 };
+
+extern struct IntegratorStats
+{
+	float trace_time_ms = 0.0f; // Of the last sample per pixel
+	float total_time_ms = 0.0f; // Of all samples since the last restart()
+	IntegratorFeatures features = { true, true, true, 0 };
+} integrator_stats;
+
 ///////////////////////////////////////////////////////////////////////////////
 // Environment
 ///////////////////////////////////////////////////////////////////////////////
 extern struct Environment
 {
 	float multiplier;
-	HDRImage map;
+	HDRImage map;             // Latitude-longitude, also importance sampled
+	OctahedralMap octahedral; // Its resampling in the cache of map
+	bool bilinear = true;     // Filter lookups in the octahedral map
 } environment;
+// Load the map and build what is derived from it
+void loadEnvironment(const std::string& filename);
 
 ///////////////////////////////////////////////////////////////////////////
 // The rendered image
@@ -63,6 +118,19 @@ extern struct PointLight
 ///////////////////////////////////////////////////////////////////////////
 void restart();
 
+///////////////////////////////////////////////////////////////////////////
+// Keep a copy of the rendered image to compare later renders against,
+// e.g. to measure the error a lossy setting introduces. referenceError()
+// returns the root mean square error of the rendered image against it,
+// or a negative value if there is no reference of the same size.
+///////////////////////////////////////////////////////////////////////////
+void storeReferenceImage();
+float referenceError();
+// The reference as a PFM file, e.g. a long render to compare samplers
+// against at equal sample counts
+bool saveReferenceImage(const std::string& filename);
+bool loadReferenceImage(const std::string& filename);
+
 ///////////////////////////////////////////////////////////////////////////
 // On window resize, window size is passed in, actual size of pathtraced
 // image may be smaller (if we're subsampling for speed)
@@ -73,4 +141,112 @@ void resize(int w, int h);
 // Trace one path per pixel
 ///////////////////////////////////////////////////////////////////////////
 void tracePaths(const mat4& V, const mat4& P);
+
+///////////////////////////////////////////////////////////////////////////
+// Used by the integrators
+///////////////////////////////////////////////////////////////////////////
+// Primary rays are traced in packets covering a small block of pixels
+const int PACKET_WIDTH = 4;
+const int PACKET_HEIGHT = RAY_PACKET_SIZE / PACKET_WIDTH;
+// Fill a packet with camera rays for the block of pixels at (x0, y0)
+void generateCameraRays(RayPacket& packet, int x0, int y0, const vec3& camera_pos, const mat4& inv_PV);
+// Add a sample to the running average of a pixel
+void accumulateSample(int pixel, const vec3& color);
+// Radiance from the environment map in direction wi
+vec3 Lenvironment(const vec3& wi);
+// The same for count directions at once, in SoA form
+void Lenvironment(const float* const wi[3], size_t count, float* const radiance[3]);
+// Move a ray origin off the surface with geometry normal n, towards the
+// side n points to. The offset grows with the magnitude of the position.
+vec3 offsetRayOrigin(const vec3& p, const vec3& n);
+// Direct light reaching a path vertex, if the shadow ray is unoccluded.
+// The shadow ray ends just before the light.
+struct LightSample
+{
+	Ray shadow_ray;
+	vec3 contribution;
+};
+///////////////////////////////////////////////////////////////////////////////
+// Direct lighting is its own stage: the shadow rays of a thread (or tile)
+// are collected here while shading and then traced together. They all end
+// at the light, so they are very coherent.
+///////////////////////////////////////////////////////////////////////////////
+class DirectLightBatch
+{
+public:
+	void clear()
+	{
+		m_shadow_rays.clear();
+		m_contributions.clear();
+		m_ids.clear();
+	}
+	void add(const LightSample& light_sample, uint32_t id)
+	{
+		m_shadow_rays.add(light_sample.shadow_ray, uint32_t(m_ids.size()));
+		m_contributions.push_back(light_sample.contribution);
+		m_ids.push_back(id);
+	}
+	size_t size() const
+	{
+		return m_ids.size();
+	}
+	// Trace all shadow rays and call add_light(id, contribution) for every
+	// sample whose light is visible
+	template <typename F>
+	void trace(F add_light)
+	{
+		m_shadow_rays.occluded(settings.ray_streams, settings.reorder_rays);
+		for(size_t k = 0; k < m_shadow_rays.size(); k++)
+		{
+			if(m_shadow_rays.ray(k).geomID == RTC_INVALID_GEOMETRY_ID)
+			{
+				const uint32_t sample = m_shadow_rays.id(k);
+				add_light(m_ids[sample], m_contributions[sample]);
+			}
+		}
+	}
+
+private:
+	RayStream m_shadow_rays;
+	std::vector<vec3> m_contributions;
+	std::vector<uint32_t> m_ids;
+};
+// The shadow ray from a path vertex towards the point light, the direction
+// wi to the light and the radiance Li arriving from it
+void samplePointLight(const Intersection& hit, Ray& shadow_ray, vec3& wi, vec3& Li);
+// The same for a direction wi drawn towards the environment, with the pdf
+// of drawing it. environmentLightPdf() is that pdf for any direction, to
+// weight paths that escape after sampling the BRDF.
+void sampleEnvironmentLight(const Intersection& hit, Ray& shadow_ray, vec3& wi, vec3& Li, float& pdf);
+float environmentLightPdf(const vec3& wi);
+// The same for a point drawn on an emissive triangle. With no emissive
+// triangles, or settings.emissive_light_sampling off, nothing is drawn
+// and pdf is 0.
+void sampleEmissiveLight(const Intersection& hit, Ray& shadow_ray, vec3& wi, vec3& Li, float& pdf);
+// The weight of the emission at hit when ray found it by sampling the
+// BRDF with pdf, against sampling the emissive triangles. Camera rays
+// have pdf 0 and get the full weight, as no light sample reaches them.
+float emissionWeight(const Intersection& hit, const Ray& ray, float pdf);
+// The weighted emission at the hit of ray, for paths that run out of
+// bounces there. Only with emissive light sampling on, which weighted the
+// light samples of the last vertex against finding it. Without it this
+// is 0, and emission is counted up to the same bounce as the point light
+// and the environment.
+vec3 Lemitted(const Ray& ray, float pdf);
+// Weight the path throughput by the sampled direction wi, with the brdf
+// and pdf for it, and set up the ray that continues the path in that
+// direction. Returns false if the path ends here instead.
+bool continuePath(const Intersection& hit, const vec3& wi, const vec3& brdf, float pdf, vec3& path_throughput,
+                  Ray& next_ray);
+// Russian roulette after the path has been continued for the given bounce
+// (1 for the first continuation ray). Returns false if the path is
+// terminated, otherwise divides the throughput by the survival probability.
+bool survivesRoulette(int bounce, vec3& path_throughput);
+// Shade one vertex of a path and sample the direction it continues in,
+// with the pdf it was sampled with. On the way in next_ray and pdf are
+// those of the ray that found hit. Shadow rays go to direct_light under id.
+bool shadePathVertex(const Intersection& hit, vec3& path_throughput, vec3& L, Ray& next_ray, float& pdf,
+                     DirectLightBatch& direct_light, uint32_t id);
+// Trace one path per pixel with the wavefront integrator
+void tracePathsWavefront(const vec3& camera_pos, const mat4& inv_PV);
 }; // namespace pathtracer
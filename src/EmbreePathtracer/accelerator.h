@@ -0,0 +1,76 @@
+#pragma once
+#include <cstdint>
+#include <glm/glm.hpp>
+#include "embree.h"
+
+namespace pathtracer
+{
+///////////////////////////////////////////////////////////////////////////
+// The vertices and triangles of one mesh, as handed to an accelerator.
+// Vertices are 16 bytes apart with x, y, z first. If shared is set the
+// buffers outlive the accelerator, which may keep reading them instead
+// of copying them.
+///////////////////////////////////////////////////////////////////////////
+struct MeshBuffers
+{
+	const float* vertices;
+	uint32_t number_of_vertices;
+	const uint32_t* indices; // Three per triangle
+	uint32_t number_of_triangles;
+	bool shared;
+};
+
+///////////////////////////////////////////////////////////////////////////
+// The ray tracing kernel behind the functions in embree.h. It only knows
+// about triangles, models and instances; everything needed to shade a
+// hit (normals, materials) is kept by embree.cpp and looked up from the
+// instID, geomID and primID an accelerator writes into the ray.
+//
+// Like embree, an accelerator fills in the hit of a Ray with tfar, the
+// barycentrics u, v of vertex 1 and 2, and the unnormalized geometry
+// normal n = cross(v0 - v1, v2 - v0) in model space. For occlusion rays
+// only geomID is set (to 0) when something is hit.
+///////////////////////////////////////////////////////////////////////////
+class Accelerator
+{
+public:
+	virtual ~Accelerator()
+	{
+	}
+	virtual const char* name() const = 0;
+
+	///////////////////////////////////////////////////////////////////////
+	// Scene setup. Models hold meshes in model space, and are placed in
+	// the scene as instances. Models are built with the bvh_quality in
+	// geometry_settings at the time they are created. Nothing is visible
+	// to rays before the next commit().
+	///////////////////////////////////////////////////////////////////////
+	virtual uint32_t newModel(bool deformable) = 0;
+	virtual uint32_t addMesh(uint32_t model, const MeshBuffers& mesh) = 0;
+	virtual uint32_t addInstance(uint32_t model, const glm::mat4& model_matrix) = 0;
+	virtual void setInstanceTransform(uint32_t instance, const glm::mat4& model_matrix) = 0;
+	// New vertex positions for a mesh of a deformable model, with the
+	// same triangles as before
+	virtual void updateVertices(uint32_t model, uint32_t mesh, const MeshBuffers& buffers) = 0;
+	// Build (or refit) everything that changed since the last commit
+	virtual void commit() = 0;
+	// Memory currently used by the acceleration structures
+	virtual size_t memoryBytes() const = 0;
+
+	///////////////////////////////////////////////////////////////////////
+	// Ray queries, see the functions of the same names in embree.h
+	///////////////////////////////////////////////////////////////////////
+	virtual bool intersect(Ray& r) = 0;
+	virtual bool occluded(Ray& r) = 0;
+	virtual void intersect(Ray* rays, size_t count, bool coherent) = 0;
+	virtual void occluded(Ray* rays, size_t count, bool coherent) = 0;
+	// By default the lanes of a packet are traced one by one
+	virtual void intersect(RayPacket& packet);
+};
+
+///////////////////////////////////////////////////////////////////////////
+// The available accelerators
+///////////////////////////////////////////////////////////////////////////
+Accelerator* createEmbreeAccelerator();
+Accelerator* createBVH8Accelerator();
+} // namespace pathtracer
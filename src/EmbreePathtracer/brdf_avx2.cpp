@@ -0,0 +1,24 @@
+#include "brdf_simd.h"
+
+///////////////////////////////////////////////////////////////////////////
+// Compiled with AVX2 enabled (see CMakeLists.txt). Only called after
+// bestBRDFKernels() has checked that the CPU supports it.
+///////////////////////////////////////////////////////////////////////////
+#if defined(__AVX2__)
+
+#define BRDF_KERNELS_BUILD_AVX2
+#include "brdf_kernels.h"
+
+namespace pathtracer
+{
+const BRDFKernels brdf_kernels_avx2 = { BRDF_KERNELS_AVX2, WIDTH, &evaluate, &sample };
+} // namespace pathtracer
+
+#else
+
+namespace pathtracer
+{
+const BRDFKernels brdf_kernels_avx2 = { BRDF_KERNELS_AVX2, 8, nullptr, nullptr };
+} // namespace pathtracer
+
+#endif
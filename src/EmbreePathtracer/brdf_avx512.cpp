@@ -0,0 +1,24 @@
+#include "brdf_simd.h"
+
+///////////////////////////////////////////////////////////////////////////
+// Compiled with AVX-512F enabled (see CMakeLists.txt). Only called after
+// bestBRDFKernels() has checked that the CPU supports it.
+///////////////////////////////////////////////////////////////////////////
+#if defined(__AVX512F__)
+
+#define BRDF_KERNELS_BUILD_AVX512
+#include "brdf_kernels.h"
+
+namespace pathtracer
+{
+const BRDFKernels brdf_kernels_avx512 = { BRDF_KERNELS_AVX512, WIDTH, &evaluate, &sample };
+} // namespace pathtracer
+
+#else
+
+namespace pathtracer
+{
+const BRDFKernels brdf_kernels_avx512 = { BRDF_KERNELS_AVX512, 16, nullptr, nullptr };
+} // namespace pathtracer
+
+#endif
@@ -0,0 +1,421 @@
+#pragma once
+#include <immintrin.h>
+#include <cstdint>
+#include "brdf_simd.h"
+
+///////////////////////////////////////////////////////////////////////////
+// The body of the SIMD BRDF kernels, included by one translation unit per
+// instruction set, which defines BRDF_KERNELS_BUILD_AVX512 or _AVX2 or
+// nothing (SSE2) and is compiled with the matching flags. Everything here
+// is static, so that no inline function compiled for a wider instruction
+// set can end up being called on a CPU without it. For the same reason the
+// kernels only touch the closure's plain data and never call glm or the
+// standard library.
+//
+// The math mirrors material.cpp term for term. pow, sin and cos are the
+// polynomials of fastmath.h, so the kernels agree with the scalar closure
+// to float rounding when built with PATHTRACER_FAST_MATH, and to within
+// the error of the polynomials otherwise.
+///////////////////////////////////////////////////////////////////////////
+namespace pathtracer
+{
+namespace
+{
+#if defined(BRDF_KERNELS_BUILD_AVX512)
+
+const int WIDTH = 16;
+struct vfloat
+{
+	__m512 v;
+};
+struct vint
+{
+	__m512i v;
+};
+struct vmask
+{
+	__mmask16 m;
+};
+static inline vfloat splat(float x) { return { _mm512_set1_ps(x) }; }
+static inline vfloat load(const float* p) { return { _mm512_load_ps(p) }; }
+static inline void store(float* p, vfloat x) { _mm512_store_ps(p, x.v); }
+static inline vfloat operator+(vfloat a, vfloat b) { return { _mm512_add_ps(a.v, b.v) }; }
+static inline vfloat operator-(vfloat a, vfloat b) { return { _mm512_sub_ps(a.v, b.v) }; }
+static inline vfloat operator*(vfloat a, vfloat b) { return { _mm512_mul_ps(a.v, b.v) }; }
+static inline vfloat operator/(vfloat a, vfloat b) { return { _mm512_div_ps(a.v, b.v) }; }
+static inline vfloat min(vfloat a, vfloat b) { return { _mm512_min_ps(a.v, b.v) }; }
+static inline vfloat max(vfloat a, vfloat b) { return { _mm512_max_ps(a.v, b.v) }; }
+static inline vfloat sqrt(vfloat a) { return { _mm512_sqrt_ps(a.v) }; }
+static inline vfloat floor(vfloat a) { return { _mm512_roundscale_ps(a.v, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC) }; }
+static inline vmask operator<(vfloat a, vfloat b) { return { _mm512_cmp_ps_mask(a.v, b.v, _CMP_LT_OQ) }; }
+static inline vmask operator<=(vfloat a, vfloat b) { return { _mm512_cmp_ps_mask(a.v, b.v, _CMP_LE_OQ) }; }
+static inline vmask operator>(vfloat a, vfloat b) { return { _mm512_cmp_ps_mask(a.v, b.v, _CMP_GT_OQ) }; }
+static inline vmask operator>=(vfloat a, vfloat b) { return { _mm512_cmp_ps_mask(a.v, b.v, _CMP_GE_OQ) }; }
+static inline vmask operator==(vfloat a, vfloat b) { return { _mm512_cmp_ps_mask(a.v, b.v, _CMP_EQ_OQ) }; }
+static inline vmask operator&(vmask a, vmask b) { return { __mmask16(a.m & b.m) }; }
+static inline vmask operator|(vmask a, vmask b) { return { __mmask16(a.m | b.m) }; }
+static inline vmask operator~(vmask a) { return { __mmask16(~a.m) }; }
+static inline vmask allLanes(bool b) { return { __mmask16(b ? 0xffff : 0) }; }
+// a where mask is set, else b
+static inline vfloat select(vmask mask, vfloat a, vfloat b) { return { _mm512_mask_blend_ps(mask.m, b.v, a.v) }; }
+static inline vint bits(vfloat a) { return { _mm512_castps_si512(a.v) }; }
+static inline vfloat fromBits(vint a) { return { _mm512_castsi512_ps(a.v) }; }
+static inline vint splatInt(int x) { return { _mm512_set1_epi32(x) }; }
+static inline vint operator&(vint a, vint b) { return { _mm512_and_si512(a.v, b.v) }; }
+static inline vint operator|(vint a, vint b) { return { _mm512_or_si512(a.v, b.v) }; }
+static inline vint operator+(vint a, vint b) { return { _mm512_add_epi32(a.v, b.v) }; }
+static inline vint shiftRight(vint a, int n) { return { _mm512_srli_epi32(a.v, unsigned(n)) }; }
+static inline vint shiftLeft(vint a, int n) { return { _mm512_slli_epi32(a.v, unsigned(n)) }; }
+static inline vfloat toFloat(vint a) { return { _mm512_cvtepi32_ps(a.v) }; }
+static inline vint toInt(vfloat a) { return { _mm512_cvttps_epi32(a.v) }; }
+
+#elif defined(BRDF_KERNELS_BUILD_AVX2)
+
+const int WIDTH = 8;
+struct vfloat
+{
+	__m256 v;
+};
+struct vint
+{
+	__m256i v;
+};
+struct vmask
+{
+	__m256 m;
+};
+static inline vfloat splat(float x) { return { _mm256_set1_ps(x) }; }
+static inline vfloat load(const float* p) { return { _mm256_load_ps(p) }; }
+static inline void store(float* p, vfloat x) { _mm256_store_ps(p, x.v); }
+static inline vfloat operator+(vfloat a, vfloat b) { return { _mm256_add_ps(a.v, b.v) }; }
+static inline vfloat operator-(vfloat a, vfloat b) { return { _mm256_sub_ps(a.v, b.v) }; }
+static inline vfloat operator*(vfloat a, vfloat b) { return { _mm256_mul_ps(a.v, b.v) }; }
+static inline vfloat operator/(vfloat a, vfloat b) { return { _mm256_div_ps(a.v, b.v) }; }
+static inline vfloat min(vfloat a, vfloat b) { return { _mm256_min_ps(a.v, b.v) }; }
+static inline vfloat max(vfloat a, vfloat b) { return { _mm256_max_ps(a.v, b.v) }; }
+static inline vfloat sqrt(vfloat a) { return { _mm256_sqrt_ps(a.v) }; }
+static inline vfloat floor(vfloat a) { return { _mm256_floor_ps(a.v) }; }
+static inline vmask operator<(vfloat a, vfloat b) { return { _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ) }; }
+static inline vmask operator<=(vfloat a, vfloat b) { return { _mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ) }; }
+static inline vmask operator>(vfloat a, vfloat b) { return { _mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ) }; }
+static inline vmask operator>=(vfloat a, vfloat b) { return { _mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ) }; }
+static inline vmask operator==(vfloat a, vfloat b) { return { _mm256_cmp_ps(a.v, b.v, _CMP_EQ_OQ) }; }
+static inline vmask operator&(vmask a, vmask b) { return { _mm256_and_ps(a.m, b.m) }; }
+static inline vmask operator|(vmask a, vmask b) { return { _mm256_or_ps(a.m, b.m) }; }
+static inline vmask operator~(vmask a) { return { _mm256_xor_ps(a.m, _mm256_castsi256_ps(_mm256_set1_epi32(-1))) }; }
+static inline vmask allLanes(bool b) { return { _mm256_castsi256_ps(_mm256_set1_epi32(b ? -1 : 0)) }; }
+// a where mask is set, else b
+static inline vfloat select(vmask mask, vfloat a, vfloat b) { return { _mm256_blendv_ps(b.v, a.v, mask.m) }; }
+static inline vint bits(vfloat a) { return { _mm256_castps_si256(a.v) }; }
+static inline vfloat fromBits(vint a) { return { _mm256_castsi256_ps(a.v) }; }
+static inline vint splatInt(int x) { return { _mm256_set1_epi32(x) }; }
+static inline vint operator&(vint a, vint b) { return { _mm256_and_si256(a.v, b.v) }; }
+static inline vint operator|(vint a, vint b) { return { _mm256_or_si256(a.v, b.v) }; }
+static inline vint operator+(vint a, vint b) { return { _mm256_add_epi32(a.v, b.v) }; }
+static inline vint shiftRight(vint a, int n) { return { _mm256_srli_epi32(a.v, n) }; }
+static inline vint shiftLeft(vint a, int n) { return { _mm256_slli_epi32(a.v, n) }; }
+static inline vfloat toFloat(vint a) { return { _mm256_cvtepi32_ps(a.v) }; }
+static inline vint toInt(vfloat a) { return { _mm256_cvttps_epi32(a.v) }; }
+
+#else
+
+const int WIDTH = 4;
+struct vfloat
+{
+	__m128 v;
+};
+struct vint
+{
+	__m128i v;
+};
+struct vmask
+{
+	__m128 m;
+};
+static inline vfloat splat(float x) { return { _mm_set1_ps(x) }; }
+static inline vfloat load(const float* p) { return { _mm_load_ps(p) }; }
+static inline void store(float* p, vfloat x) { _mm_store_ps(p, x.v); }
+static inline vfloat operator+(vfloat a, vfloat b) { return { _mm_add_ps(a.v, b.v) }; }
+static inline vfloat operator-(vfloat a, vfloat b) { return { _mm_sub_ps(a.v, b.v) }; }
+static inline vfloat operator*(vfloat a, vfloat b) { return { _mm_mul_ps(a.v, b.v) }; }
+static inline vfloat operator/(vfloat a, vfloat b) { return { _mm_div_ps(a.v, b.v) }; }
+static inline vfloat min(vfloat a, vfloat b) { return { _mm_min_ps(a.v, b.v) }; }
+static inline vfloat max(vfloat a, vfloat b) { return { _mm_max_ps(a.v, b.v) }; }
+static inline vfloat sqrt(vfloat a) { return { _mm_sqrt_ps(a.v) }; }
+static inline vmask operator<(vfloat a, vfloat b) { return { _mm_cmplt_ps(a.v, b.v) }; }
+static inline vmask operator<=(vfloat a, vfloat b) { return { _mm_cmple_ps(a.v, b.v) }; }
+static inline vmask operator>(vfloat a, vfloat b) { return { _mm_cmpgt_ps(a.v, b.v) }; }
+static inline vmask operator>=(vfloat a, vfloat b) { return { _mm_cmpge_ps(a.v, b.v) }; }
+static inline vmask operator==(vfloat a, vfloat b) { return { _mm_cmpeq_ps(a.v, b.v) }; }
+static inline vmask operator&(vmask a, vmask b) { return { _mm_and_ps(a.m, b.m) }; }
+static inline vmask operator|(vmask a, vmask b) { return { _mm_or_ps(a.m, b.m) }; }
+static inline vmask operator~(vmask a) { return { _mm_xor_ps(a.m, _mm_castsi128_ps(_mm_set1_epi32(-1))) }; }
+static inline vmask allLanes(bool b) { return { _mm_castsi128_ps(_mm_set1_epi32(b ? -1 : 0)) }; }
+// a where mask is set, else b. SSE2 has no blend instruction.
+static inline vfloat select(vmask mask, vfloat a, vfloat b)
+{
+	return { _mm_or_ps(_mm_and_ps(mask.m, a.v), _mm_andnot_ps(mask.m, b.v)) };
+}
+static inline vint bits(vfloat a) { return { _mm_castps_si128(a.v) }; }
+static inline vfloat fromBits(vint a) { return { _mm_castsi128_ps(a.v) }; }
+static inline vint splatInt(int x) { return { _mm_set1_epi32(x) }; }
+static inline vint operator&(vint a, vint b) { return { _mm_and_si128(a.v, b.v) }; }
+static inline vint operator|(vint a, vint b) { return { _mm_or_si128(a.v, b.v) }; }
+static inline vint operator+(vint a, vint b) { return { _mm_add_epi32(a.v, b.v) }; }
+static inline vint shiftRight(vint a, int n) { return { _mm_srli_epi32(a.v, n) }; }
+static inline vint shiftLeft(vint a, int n) { return { _mm_slli_epi32(a.v, n) }; }
+static inline vfloat toFloat(vint a) { return { _mm_cvtepi32_ps(a.v) }; }
+static inline vint toInt(vfloat a) { return { _mm_cvttps_epi32(a.v) }; }
+// SSE2 has no rounding instruction either. Truncate, and step down where
+// that rounded a negative number up. Exact for |a| < 2^31.
+static inline vfloat floor(vfloat a)
+{
+	const vfloat t = toFloat(toInt(a));
+	return t - select(t > a, splat(1.0f), splat(0.0f));
+}
+
+#endif
+
+///////////////////////////////////////////////////////////////////////////
+// Helpers on top of the instruction set, in the same order and form as
+// the scalar code in fastmath.h and material.cpp
+///////////////////////////////////////////////////////////////////////////
+static inline vfloat abs(vfloat a)
+{
+	return fromBits(bits(a) & splatInt(0x7fffffff));
+}
+
+static inline vfloat pow5(vfloat x)
+{
+	const vfloat x2 = x * x;
+	return x2 * x2 * x;
+}
+
+// fastLog2(), for x > 0
+static inline vfloat log2(vfloat x)
+{
+	const vint b = bits(x);
+	vfloat exponent = toFloat(shiftRight(b, 23) & splatInt(0xff)) - splat(127.0f);
+	vfloat m = fromBits((b & splatInt(0x007fffff)) | splatInt(0x3f800000));
+	const vmask high = m > splat(1.41421356f);
+	m = select(high, splat(0.5f) * m, m);
+	exponent = select(high, exponent + splat(1.0f), exponent);
+	const vfloat t = (m - splat(1.0f)) / (m + splat(1.0f));
+	const vfloat t2 = t * t;
+	const vfloat ln_m =
+	    splat(2.0f) * t
+	    * (splat(1.0f) + t2 * (splat(1.0f / 3.0f) + t2 * (splat(1.0f / 5.0f) + t2 * splat(1.0f / 7.0f))));
+	return select(x > splat(1.17549435e-38f), exponent + splat(1.44269504f) * ln_m, splat(-126.0f));
+}
+
+// fastExp2()
+static inline vfloat exp2(vfloat x)
+{
+	x = min(max(x, splat(-127.0f)), splat(127.0f));
+	const vfloat i = floor(x + splat(0.5f));
+	const vfloat f = (x - i) * splat(0.69314718f);
+	const vfloat p =
+	    splat(1.0f)
+	    + f
+	          * (splat(1.0f)
+	             + f
+	                   * (splat(1.0f / 2.0f)
+	                      + f
+	                            * (splat(1.0f / 6.0f)
+	                               + f * (splat(1.0f / 24.0f) + f * (splat(1.0f / 120.0f) + f * splat(1.0f / 720.0f))))));
+	const vfloat scale = fromBits(shiftLeft(toInt(i) + splatInt(127), 23));
+	return select(x > splat(-126.0f), p * scale, splat(0.0f));
+}
+
+// fastPow(), for x >= 0
+static inline vfloat pow(vfloat x, float y)
+{
+	return select(x > splat(0.0f), exp2(splat(y) * log2(x)), splat(y == 0.0f ? 1.0f : 0.0f));
+}
+
+// fastSinCos()
+static inline void sincos(vfloat x, vfloat& s, vfloat& c)
+{
+	const vfloat q = floor(x * splat(0.63661977f) + splat(0.5f));
+	const vfloat r = (x - q * splat(1.5703125f)) - q * splat(4.83826794e-4f);
+	const vfloat r2 = r * r;
+	const vfloat sin_r =
+	    r * (splat(1.0f) + r2 * (splat(-1.0f / 6.0f) + r2 * (splat(1.0f / 120.0f) + r2 * splat(-1.0f / 5040.0f))));
+	const vfloat cos_r =
+	    splat(1.0f)
+	    + r2
+	          * (splat(-1.0f / 2.0f)
+	             + r2 * (splat(1.0f / 24.0f) + r2 * (splat(-1.0f / 720.0f) + r2 * splat(1.0f / 40320.0f))));
+	// q mod 4, in floats
+	const vfloat quadrant = q - splat(4.0f) * floor(q * splat(0.25f));
+	const vmask odd = (quadrant == splat(1.0f)) | (quadrant == splat(3.0f));
+	const vfloat sin_x = select(odd, cos_r, sin_r);
+	const vfloat cos_x = select(odd, sin_r, cos_r);
+	s = select(quadrant >= splat(2.0f), splat(0.0f) - sin_x, sin_x);
+	c = select((quadrant == splat(1.0f)) | (quadrant == splat(2.0f)), splat(0.0f) - cos_x, cos_x);
+}
+
+struct vvec3
+{
+	vfloat x, y, z;
+};
+static inline vvec3 operator+(const vvec3& a, const vvec3& b) { return { a.x + b.x, a.y + b.y, a.z + b.z }; }
+static inline vvec3 operator-(const vvec3& a, const vvec3& b) { return { a.x - b.x, a.y - b.y, a.z - b.z }; }
+static inline vvec3 operator*(vfloat s, const vvec3& a) { return { s * a.x, s * a.y, s * a.z }; }
+static inline vfloat dot(const vvec3& a, const vvec3& b) { return a.x * b.x + a.y * b.y + a.z * b.z; }
+static inline vvec3 normalize(const vvec3& a) { return (splat(1.0f) / sqrt(dot(a, a))) * a; }
+static inline vvec3 load(float* const p[3], size_t i) { return { load(p[0] + i), load(p[1] + i), load(p[2] + i) }; }
+static inline void store(float* const p[3], size_t i, const vvec3& a)
+{
+	store(p[0] + i, a.x);
+	store(p[1] + i, a.y);
+	store(p[2] + i, a.z);
+}
+
+///////////////////////////////////////////////////////////////////////////
+// MaterialClosure::f() and pdf() for one vector of hits
+///////////////////////////////////////////////////////////////////////////
+static inline void evaluateLanes(const MaterialClosure& closure, const vvec3& wi, const vvec3& wo, const vvec3& n,
+                                 vfloat f[3], vfloat& pdf)
+{
+	const vfloat zero = splat(0.0f), one = splat(1.0f);
+	const vfloat NWi = dot(n, wi);
+	const vfloat NWo = dot(n, wo);
+	const vmask valid = (NWi > zero) & (NWo > zero);
+	const vvec3 wh = normalize(wi + wo);
+	const vfloat WhWi = abs(dot(wh, wi));
+	const vfloat NWh = dot(n, wh);
+	const vfloat WoWh = dot(wo, wh);
+	const vfloat R0 = splat(closure.R0);
+	const vfloat F = R0 + (one - R0) * pow5(one - WhWi);
+
+	f[0] = f[1] = f[2] = pdf = zero;
+	float previous_cdf = 0.0f;
+	for(int i = 0; i < closure.number_of_lobes; i++)
+	{
+		const Lobe& lobe = closure.lobes[i];
+		const vfloat probability = splat(lobe.cdf - previous_cdf);
+		previous_cdf = lobe.cdf;
+		vfloat value;
+		switch(lobe.type)
+		{
+		case LOBE_DIFFUSE:
+			value = one;
+			pdf = pdf + probability * NWi * splat(1.0f / float(M_PI));
+			break;
+		case LOBE_COATED_DIFFUSE:
+			value = one - F;
+			pdf = pdf + probability * NWi * splat(1.0f / float(M_PI));
+			break;
+		case LOBE_BLINN_PHONG:
+		default:
+		{
+			const float shininess = closure.shininess;
+			const vfloat s = pow(NWh, shininess);
+			const vfloat D = splat((shininess + 2) / (2.0f * float(M_PI))) * s;
+			const vfloat m1 = splat(2.0f) * (NWh * NWo / WoWh);
+			const vfloat m2 = splat(2.0f) * (NWh * NWi / WoWh);
+			const vfloat G = min(one, min(m1, m2));
+			value = F * D * G / (splat(4.0f) * NWo * NWi);
+			const vfloat p_wh = splat((shininess + 1) / (2.0f * float(M_PI))) * s;
+			pdf = pdf
+			      + probability
+			            * select((WoWh > zero) & (NWh > zero), p_wh / (splat(4.0f) * WoWh), zero);
+			break;
+		}
+		}
+		f[0] = f[0] + splat(lobe.weight.x) * value;
+		f[1] = f[1] + splat(lobe.weight.y) * value;
+		f[2] = f[2] + splat(lobe.weight.z) * value;
+	}
+	f[0] = select(valid, f[0], zero);
+	f[1] = select(valid, f[1], zero);
+	f[2] = select(valid, f[2], zero);
+	pdf = select(valid, pdf, zero);
+}
+
+static void evaluate(const MaterialClosure& closure, BRDFBatch& batch)
+{
+	for(size_t i = 0; i < batch.size(); i += WIDTH)
+	{
+		vfloat f[3], pdf;
+		evaluateLanes(closure, load(batch.wi, i), load(batch.wo, i), load(batch.normal, i), f, pdf);
+		store(batch.f, i, { f[0], f[1], f[2] });
+		store(batch.pdf + i, pdf);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////
+// MaterialClosure::sample_wi() for one vector of hits. Both the Blinn
+// Phong and the cosine weighted direction are computed for all lanes, and
+// each lane keeps the one of the lobe its u[0] picked.
+///////////////////////////////////////////////////////////////////////////
+static void sample(const MaterialClosure& closure, BRDFBatch& batch)
+{
+	const vfloat zero = splat(0.0f), one = splat(1.0f);
+	for(size_t i = 0; i < batch.size(); i += WIDTH)
+	{
+		const vvec3 wo = load(batch.wo, i);
+		const vvec3 n = load(batch.normal, i);
+		const vvec3 tangent = load(batch.tangent, i);
+		const vvec3 bitangent = load(batch.bitangent, i);
+		const vfloat u0 = load(batch.u[0] + i);
+		const vfloat u1 = load(batch.u[1] + i);
+		const vfloat u2 = load(batch.u[2] + i);
+
+		// The lanes that pick the Blinn Phong lobe: the first lobe whose cdf
+		// is above u0, or the last one
+		vmask blinn_phong = allLanes(false);
+		for(int l = 0; l < closure.number_of_lobes; l++)
+		{
+			if(closure.lobes[l].type != LOBE_BLINN_PHONG)
+				continue;
+			vmask picked = allLanes(true);
+			if(l > 0)
+				picked = picked & (u0 >= splat(closure.lobes[l - 1].cdf));
+			if(l < closure.number_of_lobes - 1)
+				picked = picked & (u0 < splat(closure.lobes[l].cdf));
+			blinn_phong = blinn_phong | picked;
+		}
+
+		// Reflect wo around a half vector from the Blinn Phong distribution
+		const vfloat phi = splat(2.0f * float(M_PI)) * u1;
+		const vfloat cos_theta = pow(u2, 1.0f / (closure.shininess + 1));
+		const vfloat sin_theta = sqrt(max(zero, one - cos_theta * cos_theta));
+		vfloat sin_phi, cos_phi;
+		sincos(phi, sin_phi, cos_phi);
+		const vvec3 wh =
+		    normalize((sin_theta * cos_phi) * tangent + (sin_theta * sin_phi) * bitangent + cos_theta * n);
+		const vvec3 reflected = normalize((splat(2.0f) * dot(wh, wo)) * wh - wo);
+
+		// concentricSampleDisk() and cosineSampleHemisphere()
+		const vfloat sx = splat(2.0f) * u1 - one;
+		const vfloat sy = splat(2.0f) * u2 - one;
+		const vmask right = sx >= zero - sy;
+		const vmask first = right & (sx > sy);
+		const vmask second = right & ~(sx > sy);
+		const vmask third = ~right & (sx <= sy);
+		vfloat r = select(first, sx, select(second, sy, select(third, zero - sx, zero - sy)));
+		vfloat theta = select(first, select(sy > zero, sy / r, splat(8.0f) + sy / r),
+		                      select(second, splat(2.0f) - sx / r,
+		                             select(third, splat(4.0f) - sy / r, splat(6.0f) + sx / r)));
+		const vmask origin = (sx == zero) & (sy == zero);
+		r = select(origin, zero, r);
+		theta = select(origin, zero, theta) * splat(float(M_PI) / 4.0f);
+		vfloat sin_disk, cos_disk;
+		sincos(theta, sin_disk, cos_disk);
+		const vfloat dx = r * cos_disk, dy = r * sin_disk;
+		const vfloat dz = sqrt(max(zero, one - dx * dx - dy * dy));
+		const vvec3 diffuse = normalize(dx * tangent + dy * bitangent + dz * n);
+
+		const vvec3 wi = { select(blinn_phong, reflected.x, diffuse.x), select(blinn_phong, reflected.y, diffuse.y),
+			               select(blinn_phong, reflected.z, diffuse.z) };
+		vfloat f[3], pdf;
+		evaluateLanes(closure, wi, wo, n, f, pdf);
+		store(batch.wi, i, wi);
+		store(batch.f, i, { f[0], f[1], f[2] });
+		store(batch.pdf + i, pdf);
+	}
+}
+} // namespace
+} // namespace pathtracer
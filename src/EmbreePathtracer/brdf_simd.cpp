@@ -0,0 +1,111 @@
+#include "brdf_simd.h"
+#include <xmmintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+namespace pathtracer
+{
+///////////////////////////////////////////////////////////////////////////
+// Batches
+///////////////////////////////////////////////////////////////////////////
+BRDFBatch::~BRDFBatch()
+{
+	_mm_free(m_storage);
+}
+
+void BRDFBatch::resize(size_t count)
+{
+	m_size = count;
+	const size_t padded = (count + BRDF_BATCH_WIDTH - 1) / BRDF_BATCH_WIDTH * BRDF_BATCH_WIDTH;
+	if(padded <= m_capacity)
+		return;
+	_mm_free(m_storage);
+	m_capacity = padded;
+	float** const arrays[] = {
+		&wo[0], &wo[1], &wo[2],
+		&normal[0], &normal[1], &normal[2],
+		&tangent[0], &tangent[1], &tangent[2],
+		&bitangent[0], &bitangent[1], &bitangent[2],
+		&u[0], &u[1], &u[2],
+		&wi[0], &wi[1], &wi[2],
+		&f[0], &f[1], &f[2],
+		&pdf,
+	};
+	const size_t number_of_arrays = sizeof(arrays) / sizeof(arrays[0]);
+	m_storage = static_cast<float*>(_mm_malloc(number_of_arrays * m_capacity * sizeof(float), 64));
+	for(size_t a = 0; a < number_of_arrays; a++)
+	{
+		*arrays[a] = m_storage + a * m_capacity;
+	}
+	// The padding lanes are computed on too. Keep them finite.
+	for(size_t i = 0; i < number_of_arrays * m_capacity; i++)
+	{
+		m_storage[i] = 0.0f;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Runtime dispatch. AVX needs both the CPU to support it and the OS to
+// save the wider registers on context switches, which is what XGETBV
+// reports.
+///////////////////////////////////////////////////////////////////////////
+static bool cpuSupports(BRDFKernelISA isa)
+{
+#if defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 0);
+	if(info[0] < 7)
+		return isa == BRDF_KERNELS_SSE;
+	__cpuid(info, 1);
+	const bool osxsave = (info[2] & (1 << 27)) != 0;
+	const unsigned long long xcr0 = osxsave ? _xgetbv(0) : 0;
+	__cpuidex(info, 7, 0);
+	switch(isa)
+	{
+	case BRDF_KERNELS_SSE:
+		return true;
+	case BRDF_KERNELS_AVX2:
+		return (xcr0 & 0x6) == 0x6 && (info[1] & (1 << 5)) != 0;
+	case BRDF_KERNELS_AVX512:
+		return (xcr0 & 0xe6) == 0xe6 && (info[1] & (1 << 16)) != 0;
+	default:
+		return false;
+	}
+#else
+	// GCC and Clang check the OS support too
+	__builtin_cpu_init();
+	switch(isa)
+	{
+	case BRDF_KERNELS_SSE:
+		return true;
+	case BRDF_KERNELS_AVX2:
+		return __builtin_cpu_supports("avx2");
+	case BRDF_KERNELS_AVX512:
+		return __builtin_cpu_supports("avx512f");
+	default:
+		return false;
+	}
+#endif
+}
+
+const BRDFKernels* brdfKernels(BRDFKernelISA isa)
+{
+	const BRDFKernels* const kernels[BRDF_KERNELS_NUMBER_OF_ISAS] = { &brdf_kernels_sse, &brdf_kernels_avx2,
+		                                                               &brdf_kernels_avx512 };
+	if(isa < 0 || isa >= BRDF_KERNELS_NUMBER_OF_ISAS || kernels[isa]->evaluate == nullptr || !cpuSupports(isa))
+		return nullptr;
+	return kernels[isa];
+}
+
+const BRDFKernels& bestBRDFKernels()
+{
+	static const BRDFKernels* best = []() {
+		int isa = BRDF_KERNELS_NUMBER_OF_ISAS - 1;
+		while(brdfKernels(BRDFKernelISA(isa)) == nullptr)
+			isa--;
+		return brdfKernels(BRDFKernelISA(isa));
+	}();
+	return *best;
+}
+} // namespace pathtracer
@@ -0,0 +1,95 @@
+#pragma once
+#include <cstddef>
+#include "material.h"
+
+namespace pathtracer
+{
+///////////////////////////////////////////////////////////////////////////
+// SIMD versions of MaterialClosure::f(), pdf() and sample_wi(), which
+// shade a whole batch of hits on the same material at once. The batch is
+// stored in SoA form, one array per component, and each kernel runs the
+// lobes of the closure over 4, 8 or 16 hits per instruction. The kernels
+// are compiled once per instruction set in their own translation units
+// (brdf_sse.cpp, brdf_avx2.cpp and brdf_avx512.cpp) and the widest one
+// the CPU supports is picked at runtime.
+///////////////////////////////////////////////////////////////////////////
+enum BRDFKernelISA
+{
+	BRDF_KERNELS_SSE = 0,    // 4 wide, always available
+	BRDF_KERNELS_AVX2 = 1,   // 8 wide
+	BRDF_KERNELS_AVX512 = 2, // 16 wide
+	BRDF_KERNELS_NUMBER_OF_ISAS
+};
+const char* const BRDF_KERNEL_ISA_NAMES[] = { "sse", "avx2", "avx512" };
+
+// The widest SIMD width of the kernels. Batches are padded to a multiple
+// of it, so that kernels never need a scalar tail loop.
+const size_t BRDF_BATCH_WIDTH = 16;
+
+///////////////////////////////////////////////////////////////////////////
+// The hits of a batch. Every array holds capacity() floats, aligned for
+// the widest kernels; lanes past size() are padding that the kernels
+// compute garbage for.
+///////////////////////////////////////////////////////////////////////////
+class BRDFBatch
+{
+public:
+	BRDFBatch() = default;
+	BRDFBatch(const BRDFBatch&) = delete;
+	BRDFBatch& operator=(const BRDFBatch&) = delete;
+	~BRDFBatch();
+
+	// Make room for count hits. Invalidates the arrays.
+	void resize(size_t count);
+	size_t size() const
+	{
+		return m_size;
+	}
+	size_t capacity() const
+	{
+		return m_capacity;
+	}
+
+	// Inputs
+	float* wo[3] = {};
+	float* normal[3] = {};
+	float* tangent[3] = {};   // Only read by sample()
+	float* bitangent[3] = {}; // Only read by sample()
+	float* u[3] = {};         // Random numbers for sample(): the lobe, then the direction
+	// Input to evaluate(), output of sample()
+	float* wi[3] = {};
+	// Outputs
+	float* f[3] = {};
+	float* pdf = nullptr;
+
+private:
+	float* m_storage = nullptr;
+	size_t m_size = 0;
+	size_t m_capacity = 0;
+};
+
+///////////////////////////////////////////////////////////////////////////
+// The kernels for one instruction set
+///////////////////////////////////////////////////////////////////////////
+struct BRDFKernels
+{
+	BRDFKernelISA isa;
+	int width; // Hits per instruction
+	// f and pdf of the closure for the directions wi
+	void (*evaluate)(const MaterialClosure& closure, BRDFBatch& batch);
+	// Sample wi like sample_wi() does, from the random numbers u, and
+	// write the f and pdf for it
+	void (*sample)(const MaterialClosure& closure, BRDFBatch& batch);
+};
+
+// The kernels for an instruction set, or nullptr if the CPU or the
+// compiler doesn't support it
+const BRDFKernels* brdfKernels(BRDFKernelISA isa);
+// The widest kernels the CPU supports, chosen the first time this is called
+const BRDFKernels& bestBRDFKernels();
+
+// Defined in the per instruction set translation units
+extern const BRDFKernels brdf_kernels_sse;
+extern const BRDFKernels brdf_kernels_avx2;
+extern const BRDFKernels brdf_kernels_avx512;
+} // namespace pathtracer
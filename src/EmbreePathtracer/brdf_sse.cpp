@@ -0,0 +1,7 @@
+#include "brdf_kernels.h"
+
+namespace pathtracer
+{
+// SSE2 is part of x86-64, so these need no flags and run everywhere
+const BRDFKernels brdf_kernels_sse = { BRDF_KERNELS_SSE, WIDTH, &evaluate, &sample };
+} // namespace pathtracer
@@ -0,0 +1,907 @@
+#include "bvh8.h"
+#include <algorithm>
+#include <iostream>
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+
+#include "accelerator.h"
+
+using namespace std;
+using namespace glm;
+
+namespace pathtracer
+{
+///////////////////////////////////////////////////////////////////////////
+// Nodes
+///////////////////////////////////////////////////////////////////////////
+void BVH8Node::setChild(int slot, const AABB& b, uint32_t c)
+{
+	lower_x[slot] = b.lower.x;
+	lower_y[slot] = b.lower.y;
+	lower_z[slot] = b.lower.z;
+	upper_x[slot] = b.upper.x;
+	upper_y[slot] = b.upper.y;
+	upper_z[slot] = b.upper.z;
+	child[slot] = c;
+}
+
+AABB BVH8Node::bounds() const
+{
+	AABB b;
+	for(int slot = 0; slot < BVH8_WIDTH; slot++)
+	{
+		if(child[slot] == BVH8_EMPTY)
+			continue;
+		b.grow(vec3(lower_x[slot], lower_y[slot], lower_z[slot]));
+		b.grow(vec3(upper_x[slot], upper_y[slot], upper_z[slot]));
+	}
+	return b;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Builder
+///////////////////////////////////////////////////////////////////////////
+// Subtrees with fewer primitives than this are built by the task that
+// created them
+const uint32_t PARALLEL_BUILD_THRESHOLD = 4096;
+// Below this depth splits fall back to the object median, which bounds
+// the depth of the tree and so the traversal stack.
+const int MAX_SAH_DEPTH = 48;
+
+uint32_t BVH8::allocateNode()
+{
+	uint32_t index;
+	#pragma omp atomic capture
+	index = m_node_count++;
+	return index;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Split a range of primitives in two with a binned SAH, reordering
+// primitives so that the left half comes first. Returns false if the
+// range is better off as a leaf.
+///////////////////////////////////////////////////////////////////////////
+bool BVH8::split(const Range& range, int depth, Range& left, Range& right)
+{
+	const uint32_t count = range.count();
+	if(count <= 1)
+		return false;
+	const vector<AABB>& primitive_bounds = *m_primitive_bounds;
+	const int bins = m_settings.bins;
+	const vec3 extent = range.centroid_bounds.upper - range.centroid_bounds.lower;
+
+	int best_axis = -1, best_split = 0;
+	float best_cost = FLT_MAX;
+	if(depth < MAX_SAH_DEPTH)
+	{
+		for(int axis = 0; axis < 3; axis++)
+		{
+			if(extent[axis] <= 0.0f)
+				continue;
+			AABB bin_bounds[BVH8_MAX_BINS];
+			uint32_t bin_count[BVH8_MAX_BINS] = {};
+			const float scale = float(bins) * (1.0f - 1e-6f) / extent[axis];
+			for(uint32_t i = range.begin; i < range.end; i++)
+			{
+				const uint32_t p = primitives[i];
+				const int bin = std::min(bins - 1, int((m_centroids[p][axis] - range.centroid_bounds.lower[axis]) * scale));
+				bin_bounds[bin].grow(primitive_bounds[p]);
+				bin_count[bin]++;
+			}
+			// Sweep from the right to get the cost of everything right of
+			// each split, then from the left to find the best split
+			float right_area[BVH8_MAX_BINS];
+			uint32_t right_count[BVH8_MAX_BINS];
+			AABB accumulated;
+			uint32_t accumulated_count = 0;
+			for(int b = bins - 1; b > 0; b--)
+			{
+				accumulated.grow(bin_bounds[b]);
+				accumulated_count += bin_count[b];
+				right_area[b] = accumulated.halfArea();
+				right_count[b] = accumulated_count;
+			}
+			accumulated = AABB();
+			accumulated_count = 0;
+			for(int b = 1; b < bins; b++)
+			{
+				accumulated.grow(bin_bounds[b - 1]);
+				accumulated_count += bin_count[b - 1];
+				const float cost = accumulated.halfArea() * accumulated_count + right_area[b] * right_count[b];
+				if(accumulated_count > 0 && right_count[b] > 0 && cost < best_cost)
+				{
+					best_cost = cost;
+					best_axis = axis;
+					best_split = b;
+				}
+			}
+		}
+	}
+
+	uint32_t middle;
+	if(best_axis >= 0)
+	{
+		const float split_cost = m_settings.traversal_cost + best_cost / range.bounds.halfArea();
+		if(count <= uint32_t(m_settings.max_leaf_size) && split_cost >= float(count))
+			return false;
+		const float scale = float(bins) * (1.0f - 1e-6f) / extent[best_axis];
+		const float lower = range.centroid_bounds.lower[best_axis];
+		middle = uint32_t(std::partition(primitives.begin() + range.begin, primitives.begin() + range.end,
+		                                 [&](uint32_t p) {
+			                                 return int((m_centroids[p][best_axis] - lower) * scale) < best_split;
+		                                 })
+		                  - primitives.begin());
+	}
+	else
+	{
+		// All centroids coincide (or the tree is getting too deep), so
+		// split at the object median along the largest axis
+		if(count <= uint32_t(m_settings.max_leaf_size))
+			return false;
+		const int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+		middle = range.begin + count / 2;
+		std::nth_element(primitives.begin() + range.begin, primitives.begin() + middle,
+		                 primitives.begin() + range.end,
+		                 [&](uint32_t a, uint32_t b) { return m_centroids[a][axis] < m_centroids[b][axis]; });
+	}
+
+	left = { range.begin, middle, AABB(), AABB() };
+	right = { middle, range.end, AABB(), AABB() };
+	for(Range* r : { &left, &right })
+	{
+		for(uint32_t i = r->begin; i < r->end; i++)
+		{
+			r->bounds.grow(primitive_bounds[primitives[i]]);
+			r->centroid_bounds.grow(m_centroids[primitives[i]]);
+		}
+	}
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Fill in a node by splitting its range until it has eight children or
+// none of them is worth splitting, always splitting the child with the
+// largest surface area. Children that are too large to be leaves become
+// nodes of their own.
+///////////////////////////////////////////////////////////////////////////
+void BVH8::buildNode(uint32_t node_index, const Range& range, int depth)
+{
+	Range children[BVH8_WIDTH];
+	bool is_leaf[BVH8_WIDTH] = {};
+	int number_of_children = 1;
+	children[0] = range;
+	while(number_of_children < BVH8_WIDTH)
+	{
+		int best = -1;
+		float best_area = -1.0f;
+		for(int i = 0; i < number_of_children; i++)
+		{
+			if(!is_leaf[i] && children[i].bounds.halfArea() > best_area)
+			{
+				best = i;
+				best_area = children[i].bounds.halfArea();
+			}
+		}
+		if(best < 0)
+			break;
+		Range left, right;
+		if(!split(children[best], depth, left, right))
+		{
+			is_leaf[best] = true;
+			continue;
+		}
+		children[best] = left;
+		children[number_of_children++] = right;
+	}
+
+	BVH8Node& node = nodes[node_index];
+	for(int slot = 0; slot < BVH8_WIDTH; slot++)
+	{
+		if(slot >= number_of_children)
+		{
+			node.setChild(slot, AABB(), BVH8_EMPTY);
+			continue;
+		}
+		const Range& child = children[slot];
+		if(child.count() <= uint32_t(m_settings.max_leaf_size))
+		{
+			node.setChild(slot, child.bounds, makeLeaf(child.begin, child.count()));
+			continue;
+		}
+		const uint32_t child_index = allocateNode();
+		node.setChild(slot, child.bounds, child_index);
+		if(child.count() > PARALLEL_BUILD_THRESHOLD)
+		{
+			const Range task_range = child;
+			#pragma omp task firstprivate(child_index, task_range, depth)
+			buildNode(child_index, task_range, depth + 1);
+		}
+		else
+		{
+			buildNode(child_index, child, depth + 1);
+		}
+	}
+}
+
+void BVH8::build(const vector<AABB>& primitive_bounds, const BuildSettings& settings)
+{
+	m_settings = settings;
+	m_settings.max_leaf_size = std::max(1, std::min(m_settings.max_leaf_size, BVH8_MAX_LEAF_SIZE));
+	m_settings.bins = std::max(2, std::min(m_settings.bins, BVH8_MAX_BINS));
+	m_primitive_bounds = &primitive_bounds;
+	const uint32_t count = uint32_t(primitive_bounds.size());
+	bounds = AABB();
+	nodes.clear();
+	primitives.resize(count);
+	if(count == 0)
+		return;
+
+	Range root = { 0, count, AABB(), AABB() };
+	m_centroids.resize(count);
+	for(uint32_t i = 0; i < count; i++)
+	{
+		primitives[i] = i;
+		m_centroids[i] = primitive_bounds[i].center();
+		root.bounds.grow(primitive_bounds[i]);
+		root.centroid_bounds.grow(m_centroids[i]);
+	}
+	bounds = root.bounds;
+
+	// Every node but the root has at least two children, so there can't
+	// be more nodes than primitives
+	nodes.resize(count + 1);
+	m_node_count = 1;
+	#pragma omp parallel
+	{
+		#pragma omp single
+		buildNode(0, root, 0);
+	}
+	nodes.resize(m_node_count);
+	nodes.shrink_to_fit();
+	vector<vec3>().swap(m_centroids);
+	m_primitive_bounds = nullptr;
+}
+
+void BVH8::refit(const vector<AABB>& leaf_bounds)
+{
+	// Children always come after their parent, so walking the nodes
+	// backwards visits every child before its parent
+	for(int n = int(nodes.size()) - 1; n >= 0; n--)
+	{
+		BVH8Node& node = nodes[n];
+		for(int slot = 0; slot < BVH8_WIDTH; slot++)
+		{
+			const uint32_t child = node.child[slot];
+			if(child == BVH8_EMPTY)
+				continue;
+			AABB b;
+			if(isLeaf(child))
+			{
+				for(uint32_t i = leafFirst(child); i < leafFirst(child) + leafCount(child); i++)
+					b.grow(leaf_bounds[i]);
+			}
+			else
+			{
+				b = nodes[child].bounds();
+			}
+			node.setChild(slot, b, child);
+		}
+	}
+	bounds = nodes.empty() ? AABB() : nodes[0].bounds();
+}
+
+size_t BVH8::memoryBytes() const
+{
+	return nodes.capacity() * sizeof(BVH8Node) + primitives.capacity() * sizeof(uint32_t);
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Traversal
+///////////////////////////////////////////////////////////////////////////
+// Enough for MAX_SAH_DEPTH levels of SAH splits and then median splits
+const int TRAVERSAL_STACK_SIZE = 512;
+// Widen the far distance of box hits by a few ulps so that rounding can't
+// make a ray slip between two boxes that share a face (Ize 2013).
+const float BOX_FAR_SCALE = 1.0f + 2.0f * 3.0f * FLT_EPSILON;
+
+///////////////////////////////////////////////////////////////////////////
+// A ray prepared for slab tests. The near and far planes of a box are
+// picked by the sign of the direction up front, which also makes the
+// inverted bounds of empty slots miss.
+///////////////////////////////////////////////////////////////////////////
+struct TraversalRay
+{
+	vec3 origin;
+	vec3 inv_dir;
+	float tnear;
+	int near_x, near_y, near_z; // 0 to test against lower bounds first, 1 for upper
+
+	TraversalRay(const vec3& o, const vec3& d, float t)
+	    : origin(o), tnear(t)
+	{
+		for(int axis = 0; axis < 3; axis++)
+		{
+			const float di = std::abs(d[axis]) > 1e-20f ? d[axis] : (d[axis] < 0.0f ? -1e-20f : 1e-20f);
+			inv_dir[axis] = 1.0f / di;
+		}
+		near_x = inv_dir.x < 0.0f ? 1 : 0;
+		near_y = inv_dir.y < 0.0f ? 1 : 0;
+		near_z = inv_dir.z < 0.0f ? 1 : 0;
+	}
+};
+
+///////////////////////////////////////////////////////////////////////////
+// Test a ray against all eight children of a node at once. Returns a
+// bitmask of the children that were hit and their entry distances.
+///////////////////////////////////////////////////////////////////////////
+static inline int intersectNode(const BVH8Node& node, const TraversalRay& ray, float tfar, float* distances)
+{
+	const float* near_x = ray.near_x ? node.upper_x : node.lower_x;
+	const float* far_x = ray.near_x ? node.lower_x : node.upper_x;
+	const float* near_y = ray.near_y ? node.upper_y : node.lower_y;
+	const float* far_y = ray.near_y ? node.lower_y : node.upper_y;
+	const float* near_z = ray.near_z ? node.upper_z : node.lower_z;
+	const float* far_z = ray.near_z ? node.lower_z : node.upper_z;
+#if defined(__AVX__)
+	const __m256 ox = _mm256_set1_ps(ray.origin.x), oy = _mm256_set1_ps(ray.origin.y),
+	             oz = _mm256_set1_ps(ray.origin.z);
+	const __m256 ix = _mm256_set1_ps(ray.inv_dir.x), iy = _mm256_set1_ps(ray.inv_dir.y),
+	             iz = _mm256_set1_ps(ray.inv_dir.z);
+	const __m256 t0x = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(near_x), ox), ix);
+	const __m256 t0y = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(near_y), oy), iy);
+	const __m256 t0z = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(near_z), oz), iz);
+	const __m256 t1x = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(far_x), ox), ix);
+	const __m256 t1y = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(far_y), oy), iy);
+	const __m256 t1z = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(far_z), oz), iz);
+	const __m256 tmin = _mm256_max_ps(_mm256_max_ps(t0x, t0y), _mm256_max_ps(t0z, _mm256_set1_ps(ray.tnear)));
+	const __m256 tmax = _mm256_min_ps(_mm256_mul_ps(_mm256_min_ps(_mm256_min_ps(t1x, t1y), t1z),
+	                                                _mm256_set1_ps(BOX_FAR_SCALE)),
+	                                  _mm256_set1_ps(tfar));
+	_mm256_storeu_ps(distances, tmin);
+	return _mm256_movemask_ps(_mm256_cmp_ps(tmin, tmax, _CMP_LE_OQ));
+#elif defined(__SSE2__) || defined(_M_X64)
+	// Two 4-wide halves
+	int mask = 0;
+	for(int half = 0; half < BVH8_WIDTH; half += 4)
+	{
+		const __m128 ox = _mm_set1_ps(ray.origin.x), oy = _mm_set1_ps(ray.origin.y), oz = _mm_set1_ps(ray.origin.z);
+		const __m128 ix = _mm_set1_ps(ray.inv_dir.x), iy = _mm_set1_ps(ray.inv_dir.y), iz = _mm_set1_ps(ray.inv_dir.z);
+		const __m128 t0x = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(near_x + half), ox), ix);
+		const __m128 t0y = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(near_y + half), oy), iy);
+		const __m128 t0z = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(near_z + half), oz), iz);
+		const __m128 t1x = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(far_x + half), ox), ix);
+		const __m128 t1y = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(far_y + half), oy), iy);
+		const __m128 t1z = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(far_z + half), oz), iz);
+		const __m128 tmin = _mm_max_ps(_mm_max_ps(t0x, t0y), _mm_max_ps(t0z, _mm_set1_ps(ray.tnear)));
+		const __m128 tmax = _mm_min_ps(
+		    _mm_mul_ps(_mm_min_ps(_mm_min_ps(t1x, t1y), t1z), _mm_set1_ps(BOX_FAR_SCALE)), _mm_set1_ps(tfar));
+		_mm_storeu_ps(distances + half, tmin);
+		mask |= _mm_movemask_ps(_mm_cmple_ps(tmin, tmax)) << half;
+	}
+	return mask;
+#else
+	int mask = 0;
+	for(int slot = 0; slot < BVH8_WIDTH; slot++)
+	{
+		const float tmin = std::max(std::max((near_x[slot] - ray.origin.x) * ray.inv_dir.x,
+		                                     (near_y[slot] - ray.origin.y) * ray.inv_dir.y),
+		                            std::max((near_z[slot] - ray.origin.z) * ray.inv_dir.z, ray.tnear));
+		const float tmax = std::min(std::min(std::min((far_x[slot] - ray.origin.x) * ray.inv_dir.x,
+		                                              (far_y[slot] - ray.origin.y) * ray.inv_dir.y),
+		                                     (far_z[slot] - ray.origin.z) * ray.inv_dir.z)
+		                                * BOX_FAR_SCALE,
+		                            tfar);
+		distances[slot] = tmin;
+		mask |= (tmin <= tmax ? 1 : 0) << slot;
+	}
+	return mask;
+#endif
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Walk a BVH front to back, calling leaf(first, count, tfar) for every
+// leaf the ray enters. The leaf function shortens tfar when it finds a
+// hit and returns whether it did. With any_hit, traversal stops at the
+// first hit.
+///////////////////////////////////////////////////////////////////////////
+template <bool any_hit, typename LeafFunction>
+static bool traverse(const BVH8& bvh, const vec3& origin, const vec3& direction, float tnear, float& tfar,
+                     LeafFunction leaf)
+{
+	if(bvh.nodes.empty())
+		return false;
+	const TraversalRay ray(origin, direction, tnear);
+	uint32_t stack[TRAVERSAL_STACK_SIZE];
+	float stack_distance[TRAVERSAL_STACK_SIZE];
+	int stack_size = 0;
+	stack[stack_size] = 0;
+	stack_distance[stack_size++] = tnear;
+	bool hit = false;
+	while(stack_size > 0)
+	{
+		stack_size--;
+		const uint32_t child = stack[stack_size];
+		if(stack_distance[stack_size] > tfar)
+			continue;
+		if(isLeaf(child))
+		{
+			if(leaf(leafFirst(child), leafCount(child), tfar))
+			{
+				hit = true;
+				if(any_hit)
+					return true;
+			}
+			continue;
+		}
+		float distances[BVH8_WIDTH];
+		int mask = intersectNode(bvh.nodes[child], ray, tfar, distances);
+		// Push the children that were hit farthest first, so that the
+		// nearest one is popped next
+		const int first = stack_size;
+		while(mask != 0)
+		{
+			int slot = 0;
+			while(((mask >> slot) & 1) == 0)
+				slot++;
+			mask &= mask - 1;
+			int i = stack_size++;
+			while(i > first && stack_distance[i - 1] < distances[slot])
+			{
+				stack[i] = stack[i - 1];
+				stack_distance[i] = stack_distance[i - 1];
+				i--;
+			}
+			stack[i] = bvh.nodes[child].child[slot];
+			stack_distance[i] = distances[slot];
+		}
+	}
+	return hit;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// A triangle prepared for the Möller-Trumbore test, with the IDs that
+// are reported for a hit.
+///////////////////////////////////////////////////////////////////////////
+struct BVH8Triangle
+{
+	vec3 v0;
+	uint32_t geomID;
+	vec3 e1; // v1 - v0
+	uint32_t primID;
+	vec3 e2; // v2 - v0
+	uint32_t pad;
+
+	AABB bounds() const
+	{
+		AABB b;
+		b.grow(v0);
+		b.grow(v0 + e1);
+		b.grow(v0 + e2);
+		return b;
+	}
+};
+
+static inline BVH8Triangle makeTriangle(const MeshBuffers& mesh, uint32_t geomID, uint32_t primID)
+{
+	const uint32_t* idx = mesh.indices + primID * 3;
+	const vec3 v0 = vec3(mesh.vertices[idx[0] * 4], mesh.vertices[idx[0] * 4 + 1], mesh.vertices[idx[0] * 4 + 2]);
+	const vec3 v1 = vec3(mesh.vertices[idx[1] * 4], mesh.vertices[idx[1] * 4 + 1], mesh.vertices[idx[1] * 4 + 2]);
+	const vec3 v2 = vec3(mesh.vertices[idx[2] * 4], mesh.vertices[idx[2] * 4 + 1], mesh.vertices[idx[2] * 4 + 2]);
+	BVH8Triangle t;
+	t.v0 = v0;
+	t.e1 = v1 - v0;
+	t.e2 = v2 - v0;
+	t.geomID = geomID;
+	t.primID = primID;
+	t.pad = 0;
+	return t;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// With geometry_settings.compress_geometry the vertices of static models
+// are stored quantized to 21 bits per axis within the bounds of the model,
+// which is a third smaller than a BVH8Triangle. Vertices shared between
+// triangles quantize to the same point, so meshes stay watertight.
+///////////////////////////////////////////////////////////////////////////
+const int QUANTIZATION_BITS = 21;
+const uint32_t QUANTIZATION_MAX = (1u << QUANTIZATION_BITS) - 1;
+
+struct BVH8QuantizedTriangle
+{
+	uint64_t v[3];
+	uint32_t geomID;
+	uint32_t primID;
+};
+
+struct Quantization
+{
+	vec3 origin;
+	vec3 scale; // Size of one quantization step along each axis
+
+	explicit Quantization(const AABB& bounds)
+	{
+		origin = bounds.lower;
+		scale = max(bounds.upper - bounds.lower, vec3(FLT_MIN)) / float(QUANTIZATION_MAX);
+	}
+	Quantization() : origin(0.0f), scale(1.0f)
+	{
+	}
+	uint64_t encode(const vec3& p) const
+	{
+		const vec3 q = clamp(round((p - origin) / scale), 0.0f, float(QUANTIZATION_MAX));
+		return uint64_t(q.x) | (uint64_t(q.y) << QUANTIZATION_BITS) | (uint64_t(q.z) << (2 * QUANTIZATION_BITS));
+	}
+	vec3 decode(uint64_t e) const
+	{
+		return origin
+		       + scale * vec3(float(e & QUANTIZATION_MAX), float((e >> QUANTIZATION_BITS) & QUANTIZATION_MAX),
+		                      float(e >> (2 * QUANTIZATION_BITS)));
+	}
+	BVH8QuantizedTriangle quantize(const BVH8Triangle& t) const
+	{
+		return { { encode(t.v0), encode(t.v0 + t.e1), encode(t.v0 + t.e2) }, t.geomID, t.primID };
+	}
+	BVH8Triangle dequantize(const BVH8QuantizedTriangle& q) const
+	{
+		BVH8Triangle t;
+		t.v0 = decode(q.v[0]);
+		t.e1 = decode(q.v[1]) - t.v0;
+		t.e2 = decode(q.v[2]) - t.v0;
+		t.geomID = q.geomID;
+		t.primID = q.primID;
+		t.pad = 0;
+		return t;
+	}
+};
+
+static inline bool intersectTriangle(const BVH8Triangle& t, const vec3& o, const vec3& d, float tnear, float tfar,
+                                     float& t_hit, float& u, float& v)
+{
+	const vec3 p = cross(d, t.e2);
+	const float det = dot(t.e1, p);
+	if(det == 0.0f)
+		return false;
+	const float inv_det = 1.0f / det;
+	const vec3 s = o - t.v0;
+	u = dot(s, p) * inv_det;
+	if(u < 0.0f || u > 1.0f)
+		return false;
+	const vec3 q = cross(s, t.e1);
+	v = dot(d, q) * inv_det;
+	if(v < 0.0f || u + v > 1.0f)
+		return false;
+	t_hit = dot(t.e2, q) * inv_det;
+	return t_hit >= tnear && t_hit <= tfar;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// The in-tree accelerator: one BVH8 over the triangles of each model,
+// and one over the world space bounds of the instances.
+///////////////////////////////////////////////////////////////////////////
+class BVH8Accelerator : public Accelerator
+{
+public:
+	const char* name() const override
+	{
+		return "BVH8";
+	}
+	uint32_t newModel(bool deformable) override;
+	uint32_t addMesh(uint32_t model, const MeshBuffers& mesh) override;
+	uint32_t addInstance(uint32_t model, const mat4& model_matrix) override;
+	void setInstanceTransform(uint32_t instance, const mat4& model_matrix) override;
+	void updateVertices(uint32_t model, uint32_t mesh, const MeshBuffers& buffers) override;
+	void commit() override;
+	size_t memoryBytes() const override;
+
+	bool intersect(Ray& r) override;
+	bool occluded(Ray& r) override;
+	void intersect(Ray* rays, size_t count, bool coherent) override;
+	void occluded(Ray* rays, size_t count, bool coherent) override;
+	using Accelerator::intersect;
+
+private:
+	struct Model
+	{
+		BVH8 bvh;
+		BVH8::BuildSettings build_settings;
+		vector<BVH8Triangle> triangles; // In leaf order once built
+		// If quantized, the triangles are moved here when the model is built
+		vector<BVH8QuantizedTriangle> quantized_triangles;
+		Quantization quantization;
+		bool quantized = false;
+		uint32_t number_of_meshes = 0;
+		bool needs_build = true;
+		bool needs_refit = false;
+	};
+	struct Instance
+	{
+		uint32_t model;
+		mat4 world_to_model;
+		mat4 model_to_world;
+	};
+	template <bool any_hit>
+	bool trace(Ray& r);
+	void quantize(Model& m);
+	void dequantize(Model& m);
+
+	vector<Model> m_models;
+	vector<Instance> m_instances;
+	BVH8 m_top;
+	bool m_top_needs_build = true;
+};
+
+///////////////////////////////////////////////////////////////////////////
+// How the bvh_quality setting maps onto the builder. There are no spatial
+// splits, so high quality means finer binning and smaller leaves.
+///////////////////////////////////////////////////////////////////////////
+static BVH8::BuildSettings buildSettings()
+{
+	BVH8::BuildSettings s;
+	switch(geometry_settings.bvh_quality)
+	{
+	case BVH_FAST:
+		s.bins = 8;
+		s.max_leaf_size = 8;
+		break;
+	case BVH_HIGH_QUALITY:
+		s.bins = 32;
+		s.max_leaf_size = 2;
+		break;
+	case BVH_COMPACT:
+		s.max_leaf_size = 16;
+		s.traversal_cost = 4.0f;
+		break;
+	default:
+		break;
+	}
+	return s;
+}
+
+uint32_t BVH8Accelerator::newModel(bool deformable)
+{
+	m_models.emplace_back();
+	m_models.back().build_settings = buildSettings();
+	// Deformable models are refit every frame, so they are kept in floats
+	m_models.back().quantized = geometry_settings.compress_geometry && !deformable;
+	return uint32_t(m_models.size() - 1);
+}
+
+uint32_t BVH8Accelerator::addMesh(uint32_t model, const MeshBuffers& mesh)
+{
+	Model& m = m_models[model];
+	// The quantization depends on the bounds of all meshes
+	dequantize(m);
+	const uint32_t geomID = m.number_of_meshes++;
+	for(uint32_t primID = 0; primID < mesh.number_of_triangles; primID++)
+	{
+		m.triangles.push_back(makeTriangle(mesh, geomID, primID));
+	}
+	m.needs_build = true;
+	return geomID;
+}
+
+uint32_t BVH8Accelerator::addInstance(uint32_t model, const mat4& model_matrix)
+{
+	m_instances.push_back({ model, inverse(model_matrix), model_matrix });
+	m_top_needs_build = true;
+	return uint32_t(m_instances.size() - 1);
+}
+
+void BVH8Accelerator::setInstanceTransform(uint32_t instance, const mat4& model_matrix)
+{
+	m_instances[instance].model_to_world = model_matrix;
+	m_instances[instance].world_to_model = inverse(model_matrix);
+	m_top_needs_build = true;
+}
+
+void BVH8Accelerator::updateVertices(uint32_t model, uint32_t mesh, const MeshBuffers& buffers)
+{
+	Model& m = m_models[model];
+	// A model that deforms is refit from then on, which needs floats
+	dequantize(m);
+	m.quantized = false;
+	#pragma omp parallel for
+	for(int i = 0; i < int(m.triangles.size()); i++)
+	{
+		if(m.triangles[i].geomID == mesh)
+			m.triangles[i] = makeTriangle(buffers, mesh, m.triangles[i].primID);
+	}
+	m.needs_refit = true;
+	m_top_needs_build = true;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Move the float triangles of a quantized model into quantized_triangles
+// and back. The float triangles are replaced by their quantized version,
+// so that the BVH is built around the triangles that are actually traced.
+///////////////////////////////////////////////////////////////////////////
+void BVH8Accelerator::quantize(Model& m)
+{
+	AABB bounds;
+	for(const BVH8Triangle& t : m.triangles)
+	{
+		bounds.grow(t.bounds());
+	}
+	m.quantization = Quantization(bounds);
+	m.quantized_triangles.resize(m.triangles.size());
+	#pragma omp parallel for
+	for(int i = 0; i < int(m.triangles.size()); i++)
+	{
+		m.quantized_triangles[i] = m.quantization.quantize(m.triangles[i]);
+		m.triangles[i] = m.quantization.dequantize(m.quantized_triangles[i]);
+	}
+}
+
+void BVH8Accelerator::dequantize(Model& m)
+{
+	if(m.quantized_triangles.empty())
+		return;
+	m.triangles.resize(m.quantized_triangles.size());
+	for(size_t i = 0; i < m.triangles.size(); i++)
+	{
+		m.triangles[i] = m.quantization.dequantize(m.quantized_triangles[i]);
+	}
+	vector<BVH8QuantizedTriangle>().swap(m.quantized_triangles);
+}
+
+void BVH8Accelerator::commit()
+{
+	for(Model& m : m_models)
+	{
+		if(!m.needs_build && !m.needs_refit)
+			continue;
+		if(m.needs_build && m.quantized)
+			quantize(m);
+		vector<AABB> bounds(m.triangles.size());
+		#pragma omp parallel for
+		for(int i = 0; i < int(m.triangles.size()); i++)
+		{
+			bounds[i] = m.triangles[i].bounds();
+		}
+		if(m.needs_build)
+		{
+			m.bvh.build(bounds, m.build_settings);
+			// Store the triangles in leaf order, so that leaves are
+			// contiguous runs of triangles
+			vector<BVH8Triangle> ordered(m.triangles.size());
+			for(size_t i = 0; i < ordered.size(); i++)
+			{
+				ordered[i] = m.triangles[m.bvh.primitives[i]];
+			}
+			m.triangles.swap(ordered);
+			if(m.quantized)
+			{
+				for(size_t i = 0; i < ordered.size(); i++)
+				{
+					m.quantized_triangles[i] = m.quantization.quantize(m.triangles[i]);
+				}
+				vector<BVH8Triangle>().swap(m.triangles);
+			}
+		}
+		else
+		{
+			m.bvh.refit(bounds);
+		}
+		m.needs_build = false;
+		m.needs_refit = false;
+	}
+	if(m_top_needs_build)
+	{
+		// Instances are few, so the top level is rebuilt from scratch
+		vector<AABB> instance_bounds(m_instances.size());
+		for(size_t i = 0; i < m_instances.size(); i++)
+		{
+			const AABB& b = m_models[m_instances[i].model].bvh.bounds;
+			if(b.empty())
+				continue;
+			for(int corner = 0; corner < 8; corner++)
+			{
+				const vec3 p = vec3(corner & 1 ? b.upper.x : b.lower.x, corner & 2 ? b.upper.y : b.lower.y,
+				                    corner & 4 ? b.upper.z : b.lower.z);
+				instance_bounds[i].grow(vec3(m_instances[i].model_to_world * vec4(p, 1.0f)));
+			}
+		}
+		BVH8::BuildSettings top_settings;
+		top_settings.max_leaf_size = 1;
+		m_top.build(instance_bounds, top_settings);
+		m_top_needs_build = false;
+	}
+}
+
+size_t BVH8Accelerator::memoryBytes() const
+{
+	size_t bytes = m_top.memoryBytes() + m_instances.capacity() * sizeof(Instance);
+	for(const Model& m : m_models)
+	{
+		bytes += m.bvh.memoryBytes() + m.triangles.capacity() * sizeof(BVH8Triangle)
+		         + m.quantized_triangles.capacity() * sizeof(BVH8QuantizedTriangle);
+	}
+	return bytes;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Trace a ray through the instances into the triangles of their models.
+// The ray is moved into model space unnormalized, so distances along it
+// are the same in both spaces.
+///////////////////////////////////////////////////////////////////////////
+template <bool any_hit>
+bool BVH8Accelerator::trace(Ray& r)
+{
+	float tfar = r.tfar;
+	const bool hit = traverse<any_hit>(m_top, r.o, r.d, r.tnear, tfar,
+	                                   [&](uint32_t first, uint32_t count, float& top_tfar) {
+		bool hit_instance = false;
+		for(uint32_t k = first; k < first + count; k++)
+		{
+			const uint32_t inst_ID = m_top.primitives[k];
+			const Instance& instance = m_instances[inst_ID];
+			const Model& model = m_models[instance.model];
+			const vec3 o = vec3(instance.world_to_model * vec4(r.o, 1.0f));
+			const vec3 d = mat3(instance.world_to_model) * r.d;
+			hit_instance |= traverse<any_hit>(model.bvh, o, d, r.tnear, top_tfar,
+			                                  [&](uint32_t tri_first, uint32_t tri_count, float& model_tfar) {
+				bool hit_triangle = false;
+				for(uint32_t t = tri_first; t < tri_first + tri_count; t++)
+				{
+					const BVH8Triangle triangle = model.quantized
+					                                  ? model.quantization.dequantize(model.quantized_triangles[t])
+					                                  : model.triangles[t];
+					float t_hit, u, v;
+					if(!intersectTriangle(triangle, o, d, r.tnear, model_tfar, t_hit, u, v))
+						continue;
+					model_tfar = t_hit;
+					hit_triangle = true;
+					if(any_hit)
+					{
+						r.geomID = 0;
+						return true;
+					}
+					r.u = u;
+					r.v = v;
+					r.n = cross(triangle.e2, triangle.e1);
+					r.geomID = triangle.geomID;
+					r.primID = triangle.primID;
+					r.instID = inst_ID;
+				}
+				return hit_triangle;
+			});
+			if(any_hit && hit_instance)
+				return true;
+		}
+		return hit_instance;
+	});
+	if(hit && !any_hit)
+		r.tfar = tfar;
+	return hit;
+}
+
+bool BVH8Accelerator::intersect(Ray& r)
+{
+	return trace<false>(r);
+}
+
+bool BVH8Accelerator::occluded(Ray& r)
+{
+	return trace<true>(r);
+}
+
+void BVH8Accelerator::intersect(Ray* rays, size_t count, bool /*coherent*/)
+{
+	for(size_t i = 0; i < count; i++)
+		trace<false>(rays[i]);
+}
+
+void BVH8Accelerator::occluded(Ray* rays, size_t count, bool /*coherent*/)
+{
+	for(size_t i = 0; i < count; i++)
+		trace<true>(rays[i]);
+}
+
+Accelerator* createBVH8Accelerator()
+{
+	return new BVH8Accelerator();
+}
+} // namespace pathtracer
@@ -0,0 +1,133 @@
+#pragma once
+#include <cfloat>
+#include <cstdint>
+#include <vector>
+#include <glm/glm.hpp>
+#include <embree2/rtcore.h>
+
+namespace pathtracer
+{
+///////////////////////////////////////////////////////////////////////////
+// An axis aligned bounding box. The default box is empty, so growing it
+// by anything gives that thing's bounds.
+///////////////////////////////////////////////////////////////////////////
+struct AABB
+{
+	glm::vec3 lower = glm::vec3(FLT_MAX);
+	glm::vec3 upper = glm::vec3(-FLT_MAX);
+
+	void grow(const glm::vec3& p)
+	{
+		lower = glm::min(lower, p);
+		upper = glm::max(upper, p);
+	}
+	void grow(const AABB& b)
+	{
+		lower = glm::min(lower, b.lower);
+		upper = glm::max(upper, b.upper);
+	}
+	glm::vec3 center() const
+	{
+		return 0.5f * (lower + upper);
+	}
+	bool empty() const
+	{
+		return lower.x > upper.x || lower.y > upper.y || lower.z > upper.z;
+	}
+	float halfArea() const
+	{
+		if(empty())
+			return 0.0f;
+		const glm::vec3 d = upper - lower;
+		return d.x * d.y + d.y * d.z + d.z * d.x;
+	}
+};
+
+///////////////////////////////////////////////////////////////////////////
+// A node with up to eight children, with their bounds stored per axis so
+// that a ray can be tested against all of them with one 8-wide SIMD
+// operation per plane. A child is either another node (its index in
+// BVH8::nodes) or a leaf, a run of consecutive primitives in leaf order.
+// Unused slots have empty (inverted) bounds, which no ray hits.
+///////////////////////////////////////////////////////////////////////////
+const int BVH8_WIDTH = 8;
+const uint32_t BVH8_LEAF = 0x80000000u;
+const uint32_t BVH8_EMPTY = 0xFFFFFFFFu;
+const int BVH8_MAX_LEAF_SIZE = 16;
+const int BVH8_MAX_BINS = 32;
+
+struct RTCORE_ALIGN(32) BVH8Node
+{
+	float lower_x[BVH8_WIDTH], upper_x[BVH8_WIDTH];
+	float lower_y[BVH8_WIDTH], upper_y[BVH8_WIDTH];
+	float lower_z[BVH8_WIDTH], upper_z[BVH8_WIDTH];
+	uint32_t child[BVH8_WIDTH];
+
+	void setChild(int slot, const AABB& bounds, uint32_t c);
+	AABB bounds() const;
+};
+
+// Leaves hold the index of their first primitive and how many there are
+inline uint32_t makeLeaf(uint32_t first, uint32_t count)
+{
+	return BVH8_LEAF | (first << 4) | (count - 1);
+}
+inline bool isLeaf(uint32_t child)
+{
+	return (child & BVH8_LEAF) != 0;
+}
+inline uint32_t leafFirst(uint32_t child)
+{
+	return (child & ~BVH8_LEAF) >> 4;
+}
+inline uint32_t leafCount(uint32_t child)
+{
+	return (child & 0xF) + 1;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// An 8-wide BVH over any kind of primitive, built from the bounds of the
+// primitives with a binned SAH builder. Large subtrees are built in
+// parallel with OpenMP tasks.
+///////////////////////////////////////////////////////////////////////////
+class BVH8
+{
+public:
+	struct BuildSettings
+	{
+		int max_leaf_size = 4;        // At most BVH8_MAX_LEAF_SIZE
+		int bins = 16;                // At most BVH8_MAX_BINS
+		float traversal_cost = 1.0f;  // Relative to intersecting one primitive
+	};
+
+	void build(const std::vector<AABB>& primitive_bounds, const BuildSettings& settings);
+	// Update all node bounds after the primitives have moved, keeping the
+	// tree topology. The bounds are given in leaf order.
+	void refit(const std::vector<AABB>& leaf_bounds);
+	size_t memoryBytes() const;
+
+	std::vector<BVH8Node> nodes; // nodes[0] is the root, children come after their parent
+	std::vector<uint32_t> primitives; // The original index of each primitive, in leaf order
+	AABB bounds;
+
+private:
+	struct Range
+	{
+		uint32_t begin, end;
+		AABB bounds;
+		AABB centroid_bounds;
+		uint32_t count() const
+		{
+			return end - begin;
+		}
+	};
+	bool split(const Range& range, int depth, Range& left, Range& right);
+	void buildNode(uint32_t node_index, const Range& range, int depth);
+	uint32_t allocateNode();
+
+	BuildSettings m_settings;
+	const std::vector<AABB>* m_primitive_bounds = nullptr;
+	std::vector<glm::vec3> m_centroids;
+	uint32_t m_node_count = 0;
+};
+} // namespace pathtracer
@@ -1,7 +1,15 @@
 #include "embree.h"
+#include <chrono>
+#include <cstring>
+#include <deque>
 #include <iostream>
-#include <map>
+#include <unordered_map>
+#include <vector>
+#include <xmmintrin.h>
 
+#include "accelerator.h"
+#include "material.h"
+#include "sampling.h"
 
 using namespace std;
 using namespace glm;
@@ -11,81 +19,776 @@ namespace pathtracer
 ///////////////////////////////////////////////////////////////////////////
 // Global variables
 ///////////////////////////////////////////////////////////////////////////
-RTCDevice embree_device;
-RTCScene embree_scene;
+GeometrySettings geometry_settings;
+BVHStats bvh_stats;
+Accelerator* accelerator = nullptr;
+
+///////////////////////////////////////////////////////////////////////////
+// A mesh whose identical vertices (same position and normal) have been
+// merged, so that its triangles index shared vertices. The positions are
+// released once they have been handed to the accelerator.
+///////////////////////////////////////////////////////////////////////////
+struct WeldedMesh
+{
+	vector<vec3> positions;
+	vector<uint32_t> indices;
+	// For deformable models, the mesh vertex each welded vertex came from
+	vector<uint32_t> first_vertex;
+};
+deque<WeldedMesh> welded_meshes;
+
+///////////////////////////////////////////////////////////////////////////
+// Vertex and index buffers that we own. The accelerator reads them
+// directly when geometry_settings.share_buffers is set. Embree wants 16
+// byte aligned vertices, the fourth component is unused.
+///////////////////////////////////////////////////////////////////////////
+struct RTCORE_ALIGN(16) EmbreeVertex
+{
+	float x, y, z, w;
+};
+struct SharedBuffers
+{
+	vector<EmbreeVertex> vertices;
+	vector<uint32_t> indices;
+};
+deque<SharedBuffers> shared_buffers;
+
+///////////////////////////////////////////////////////////////////////////
+// What is needed to upload the vertices of a geometry again after the
+// model has been deformed.
+///////////////////////////////////////////////////////////////////////////
+struct GeometrySource
+{
+	const labhelper::Mesh* mesh;
+	WeldedMesh* welded;            // nullptr unless the mesh was welded
+	EmbreeVertex* shared_vertices; // nullptr unless the accelerator reads our buffer
+	const uint32_t* indices;
+};
+
+///////////////////////////////////////////////////////////////////////////
+// Allocator for vectors of cache line aligned records
+///////////////////////////////////////////////////////////////////////////
+template <typename T>
+struct CacheLineAllocator
+{
+	typedef T value_type;
+	CacheLineAllocator()
+	{
+	}
+	template <typename U>
+	CacheLineAllocator(const CacheLineAllocator<U>&)
+	{
+	}
+	T* allocate(size_t n)
+	{
+		return (T*)_mm_malloc(n * sizeof(T), 64);
+	}
+	void deallocate(T* p, size_t)
+	{
+		_mm_free(p);
+	}
+	template <typename U>
+	bool operator==(const CacheLineAllocator<U>&) const
+	{
+		return true;
+	}
+	template <typename U>
+	bool operator!=(const CacheLineAllocator<U>&) const
+	{
+		return false;
+	}
+};
+
+///////////////////////////////////////////////////////////////////////////
+// Everything getIntersection() needs to know about a triangle, in one
+// cache line, so that a hit only touches a single record.
+///////////////////////////////////////////////////////////////////////////
+struct RTCORE_ALIGN(64) TriangleRecord
+{
+	vec3 normals[3];   // Vertex normals in model space
+	vec3 tangent;      // An edge of the triangle, i.e. a direction in its plane
+	uint32_t material; // Index into material_table
+	uint32_t pad[3];
+};
+static_assert(sizeof(TriangleRecord) == 64, "A TriangleRecord should fill one cache line");
+typedef vector<TriangleRecord, CacheLineAllocator<TriangleRecord>> TriangleTable;
+
+///////////////////////////////////////////////////////////////////////////
+// A TriangleRecord compressed to a quarter, when
+// geometry_settings.compress_geometry is set. Only the tangent's
+// direction matters, so eight bits per component are plenty for it.
+///////////////////////////////////////////////////////////////////////////
+struct CompactTriangleRecord
+{
+	uint32_t normals[3]; // Octahedral, 16 bits per component
+	uint16_t tangent;    // Octahedral, 8 bits per component
+	uint16_t material;   // Index into material_table
+};
+static_assert(sizeof(CompactTriangleRecord) == 16, "Four CompactTriangleRecords should fill one cache line");
+typedef vector<CompactTriangleRecord, CacheLineAllocator<CompactTriangleRecord>> CompactTriangleTable;
+
+///////////////////////////////////////////////////////////////////////////
+// The materials of all models, so that a triangle can refer to its
+// material with a 32 bit index, and the closures they are compiled to
+///////////////////////////////////////////////////////////////////////////
+vector<const labhelper::Material*> material_table;
+vector<MaterialClosure> closure_table;
+
+///////////////////////////////////////////////////////////////////////////
+// The triangles of a geometry, in a flat table indexed by geometry ID and
+// then by primitive ID. The tables are only written between frames, so
+// reading them from many threads while tracing is safe.
+///////////////////////////////////////////////////////////////////////////
+struct GeometryRecord
+{
+	const TriangleRecord* triangles;
+	const CompactTriangleRecord* compact_triangles; // Used instead, if not nullptr
+};
+
+///////////////////////////////////////////////////////////////////////////
+// Every distinct model is added to the accelerator once, in model space,
+// and shared by all instances of the model.
+///////////////////////////////////////////////////////////////////////////
+struct ModelRecord
+{
+	const labhelper::Model* model;
+	uint32_t handle;                   // The model in the accelerator
+	vector<GeometryRecord> geometries; // Indexed by geomID
+	vector<TriangleTable> triangles;   // What geometries point to
+	vector<CompactTriangleTable> compact_triangles;
+	vector<GeometrySource> sources;    // Where each geometry's data came from
+	uint32_t first_material;           // Of the model's materials in material_table
+	bool deformable;
+	bool compact;
+};
+deque<ModelRecord> model_records;
+unordered_map<const labhelper::Model*, ModelRecord*> model_to_record;
+
+///////////////////////////////////////////////////////////////////////////
+// There is one instance per addModel() call. Indexed by instID.
+///////////////////////////////////////////////////////////////////////////
+struct InstanceRecord
+{
+	const GeometryRecord* geometries;
+	mat3 normal_matrix;
+	mat3 tangent_matrix;
+	const ModelRecord* model;
+};
+vector<InstanceRecord> instance_records;
+vector<mat4> instance_transforms;
+bool top_level_needs_commit = false;
+
+///////////////////////////////////////////////////////////////////////////
+// Collect the emissive triangles of every instance. Their positions are
+// read from where they are kept after addModel(): our shared buffers if
+// the accelerator reads those, and otherwise the model.
+///////////////////////////////////////////////////////////////////////////
+EmissiveLights emissive_lights;
+
+static void collectEmissiveTriangles()
+{
+	emissive_lights.triangles.clear();
+	vector<float> power;
+	for(size_t inst_ID = 0; inst_ID < instance_records.size(); inst_ID++)
+	{
+		const ModelRecord* record = instance_records[inst_ID].model;
+		if(record == nullptr)
+			continue;
+		const mat4& transform = instance_transforms[inst_ID];
+		for(const GeometrySource& source : record->sources)
+		{
+			if(source.mesh == nullptr)
+				continue;
+			const vec3 emission = closure_table[record->first_material + source.mesh->m_material_idx].emission;
+			if(emission == vec3(0.0f))
+				continue;
+			for(uint32_t t = 0; t < source.mesh->m_number_of_vertices / 3; t++)
+			{
+				vec3 p[3];
+				for(uint32_t k = 0; k < 3; k++)
+				{
+					vec3 position;
+					if(source.shared_vertices != nullptr)
+					{
+						const EmbreeVertex& v = source.shared_vertices[source.indices[3 * t + k]];
+						position = vec3(v.x, v.y, v.z);
+					}
+					else
+					{
+						position = record->model->m_positions[source.mesh->m_start_index + 3 * t + k];
+					}
+					p[k] = vec3(transform * vec4(position, 1.0f));
+				}
+				EmissiveTriangle triangle;
+				triangle.p0 = p[0];
+				triangle.edge1 = p[1] - p[0];
+				triangle.edge2 = p[2] - p[0];
+				const vec3 n = cross(triangle.edge1, triangle.edge2);
+				const float double_area = length(n);
+				if(!(double_area > 0.0f))
+					continue;
+				triangle.normal = n / double_area;
+				triangle.area = 0.5f * double_area;
+				triangle.emission = emission;
+				emissive_lights.triangles.push_back(triangle);
+				power.push_back(luminance(emission) * triangle.area);
+			}
+		}
+	}
+	emissive_lights.power.build(power.data(), power.size());
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Create the accelerator selected in geometry_settings
+///////////////////////////////////////////////////////////////////////////
+static Accelerator* createAccelerator()
+{
+	switch(geometry_settings.accelerator)
+	{
+	case ACCELERATOR_BVH8:
+		return createBVH8Accelerator();
+	default:
+		return createEmbreeAccelerator();
+	}
+}
 
 ///////////////////////////////////////////////////////////////////////////
 // Build an acceleration structure for the scene
 ///////////////////////////////////////////////////////////////////////////
 void buildBVH()
 {
-	cout << "Embree building BVH..." << flush;
-	rtcCommit(embree_scene);
-	cout << "done.\n";
+	cout << accelerator->name() << " building BVH..." << flush;
+	auto start_time = chrono::high_resolution_clock::now();
+	accelerator->commit();
+	top_level_needs_commit = false;
+	chrono::duration<float, milli> build_time = chrono::high_resolution_clock::now() - start_time;
+	bvh_stats.build_time_ms = build_time.count();
+	collectEmissiveTriangles();
+	bvh_stats.memory_bytes = accelerator->memoryBytes();
+	bvh_stats.shading_bytes = 0;
+	for(const ModelRecord& record : model_records)
+	{
+		for(const TriangleTable& table : record.triangles)
+			bvh_stats.shading_bytes += table.capacity() * sizeof(TriangleRecord);
+		for(const CompactTriangleTable& table : record.compact_triangles)
+			bvh_stats.shading_bytes += table.capacity() * sizeof(CompactTriangleRecord);
+	}
+	cout << "done (" << bvh_stats.build_time_ms << " ms, " << bvh_stats.memory_bytes / (1024 * 1024)
+	     << " MiB, shading records " << bvh_stats.shading_bytes / (1024 * 1024) << " MiB).\n";
 }
 
 ///////////////////////////////////////////////////////////////////////////
-// Called when there is an embree error
+// Build the acceleration structure again, e.g. with another bvh_quality
+// or accelerator. Embree can't change the flags of an existing scene, so
+// the accelerator is recreated from the models and instances that were
+// added.
 ///////////////////////////////////////////////////////////////////////////
-void embreeErrorHandler(const RTCError code, const char* str)
+void rebuildBVH()
+{
+	vector<const labhelper::Model*> instance_models;
+	vector<bool> instance_deformable;
+	for(auto& instance : instance_records)
+	{
+		instance_models.push_back(instance.model->model);
+		instance_deformable.push_back(instance.model->deformable);
+	}
+	vector<mat4> transforms = instance_transforms;
+
+	delete accelerator;
+	accelerator = createAccelerator();
+	model_records.clear();
+	model_to_record.clear();
+	material_table.clear();
+	closure_table.clear();
+	instance_records.clear();
+	instance_transforms.clear();
+	welded_meshes.clear();
+	shared_buffers.clear();
+
+	// Instance IDs are handed out in order, so re-adding the instances in
+	// the same order keeps their IDs.
+	const bool deformable = geometry_settings.deformable;
+	for(size_t i = 0; i < instance_models.size(); i++)
+	{
+		geometry_settings.deformable = instance_deformable[i];
+		addModel(instance_models[i], transforms[i]);
+	}
+	geometry_settings.deformable = deformable;
+	buildBVH();
+}
+
+static void copyVertices(const vec3* positions, size_t count, vector<EmbreeVertex>& vertices)
 {
-	cout << "Embree ERROR: " << str << endl;
-	exit(1);
+	vertices.resize(count);
+	#pragma omp parallel for
+	for(int i = 0; i < int(count); i++)
+	{
+		vertices[i] = { positions[i].x, positions[i].y, positions[i].z, 0.0f };
+	}
 }
 
 ///////////////////////////////////////////////////////////////////////////
-// Used to map an Embree geometry ID to our scene Meshes and Materials
+// Vertices are only merged if they are bitwise identical, so that the
+// welded mesh renders exactly like the triangle soup it came from.
 ///////////////////////////////////////////////////////////////////////////
-map<uint32_t, const labhelper::Model*> map_geom_ID_to_model;
-map<uint32_t, const labhelper::Mesh*> map_geom_ID_to_mesh;
+struct WeldKey
+{
+	vec3 position;
+	vec3 normal;
+	bool operator==(const WeldKey& other) const
+	{
+		return memcmp(this, &other, sizeof(WeldKey)) == 0;
+	}
+};
+
+struct WeldKeyHash
+{
+	size_t operator()(const WeldKey& key) const
+	{
+		uint32_t words[6];
+		memcpy(words, &key, sizeof(words));
+		size_t h = 0;
+		for(uint32_t w : words)
+		{
+			h ^= w + 0x9e3779b9 + (h << 6) + (h >> 2);
+		}
+		return h;
+	}
+};
+
+static void weldMesh(const labhelper::Model* model, const labhelper::Mesh& mesh, WeldedMesh& welded)
+{
+	unordered_map<WeldKey, uint32_t, WeldKeyHash> vertex_index;
+	vertex_index.reserve(mesh.m_number_of_vertices);
+	welded.indices.resize(mesh.m_number_of_vertices);
+	for(uint32_t i = 0; i < mesh.m_number_of_vertices; i++)
+	{
+		WeldKey key = { model->m_positions[mesh.m_start_index + i], model->m_normals[mesh.m_start_index + i] };
+		auto inserted = vertex_index.insert(make_pair(key, uint32_t(welded.positions.size())));
+		if(inserted.second)
+		{
+			welded.positions.push_back(key.position);
+			welded.first_vertex.push_back(i);
+		}
+		welded.indices[i] = inserted.first->second;
+	}
+}
 
 ///////////////////////////////////////////////////////////////////////////
-// Add a model to the embree scene
+// Octahedral encoding of unit vectors (Meyer et al. 2010): the vector is
+// projected onto the octahedron |x| + |y| + |z| = 1, whose lower half is
+// folded over the upper half so that it maps onto the square [-1, 1]^2.
 ///////////////////////////////////////////////////////////////////////////
-void addModel(const labhelper::Model* model, const mat4& model_matrix)
+static inline float signNotZero(float v)
 {
-	///////////////////////////////////////////////////////////////////////
-	// Lazy initialize embree on first use
-	///////////////////////////////////////////////////////////////////////
-	cout << "Initializing embree..." << flush;
-	static bool embree_is_initialized = false;
-	if(!embree_is_initialized)
+	return v >= 0.0f ? 1.0f : -1.0f;
+}
+
+template <int bits>
+static inline uint32_t encodeOctahedral(const vec3& v)
+{
+	const float max_value = float((1 << (bits - 1)) - 1);
+	const float inv_l1 = 1.0f / (std::abs(v.x) + std::abs(v.y) + std::abs(v.z));
+	float x = v.x * inv_l1, y = v.y * inv_l1;
+	if(v.z < 0.0f)
 	{
-		embree_is_initialized = true;
-		embree_device = rtcNewDevice();
-		rtcDeviceSetErrorFunction(embree_device, embreeErrorHandler);
-		embree_scene = rtcDeviceNewScene(embree_device, RTC_SCENE_STATIC, RTC_INTERSECT1);
+		const float folded_x = (1.0f - std::abs(y)) * signNotZero(x);
+		y = (1.0f - std::abs(x)) * signNotZero(y);
+		x = folded_x;
 	}
-	cout << "done.\n";
+	const uint32_t mask = (1u << bits) - 1;
+	const uint32_t qx = uint32_t(int32_t(std::round(clamp(x, -1.0f, 1.0f) * max_value))) & mask;
+	const uint32_t qy = uint32_t(int32_t(std::round(clamp(y, -1.0f, 1.0f) * max_value))) & mask;
+	return qx | (qy << bits);
+}
+
+template <int bits>
+static inline vec3 decodeOctahedral(uint32_t e)
+{
+	const float inv_max_value = 1.0f / float((1 << (bits - 1)) - 1);
+	// Sign extend the two components
+	const int shift = 32 - bits;
+	const float x = float(int32_t(e << shift) >> shift) * inv_max_value;
+	const float y = float(int32_t((e >> bits) << shift) >> shift) * inv_max_value;
+	vec3 v = vec3(x, y, 1.0f - std::abs(x) - std::abs(y));
+	if(v.z < 0.0f)
+	{
+		v.x = (1.0f - std::abs(y)) * signNotZero(x);
+		v.y = (1.0f - std::abs(x)) * signNotZero(y);
+	}
+	return normalize(v);
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Fill in the shading records of the triangles of a mesh from the model
+///////////////////////////////////////////////////////////////////////////
+static void fillCompactTriangleRecords(const labhelper::Model* model, const labhelper::Mesh& mesh,
+                                       uint32_t material, CompactTriangleTable& triangles)
+{
+	triangles.resize(mesh.m_number_of_vertices / 3);
+	#pragma omp parallel for
+	for(int t = 0; t < int(triangles.size()); t++)
+	{
+		const uint32_t v = mesh.m_start_index + 3 * t;
+		CompactTriangleRecord& triangle = triangles[t];
+		triangle.normals[0] = encodeOctahedral<16>(model->m_normals[v]);
+		triangle.normals[1] = encodeOctahedral<16>(model->m_normals[v + 1]);
+		triangle.normals[2] = encodeOctahedral<16>(model->m_normals[v + 2]);
+		const vec3 edge = model->m_positions[v + 1] - model->m_positions[v];
+		triangle.tangent = dot(edge, edge) > 0.0f ? uint16_t(encodeOctahedral<8>(edge)) : 0;
+		triangle.material = uint16_t(material);
+	}
+}
+
+static void fillTriangleRecords(const labhelper::Model* model, const labhelper::Mesh& mesh, uint32_t material,
+                                TriangleTable& triangles)
+{
+	triangles.resize(mesh.m_number_of_vertices / 3);
+	#pragma omp parallel for
+	for(int t = 0; t < int(triangles.size()); t++)
+	{
+		const uint32_t v = mesh.m_start_index + 3 * t;
+		TriangleRecord& triangle = triangles[t];
+		triangle.normals[0] = model->m_normals[v];
+		triangle.normals[1] = model->m_normals[v + 1];
+		triangle.normals[2] = model->m_normals[v + 2];
+		triangle.tangent = model->m_positions[v + 1] - model->m_positions[v];
+		triangle.material = material;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Add a model to the accelerator, with each mesh as a geometry, and
+// create the shading records of its triangles.
+///////////////////////////////////////////////////////////////////////////
+static ModelRecord* addModelScene(const labhelper::Model* model)
+{
+	model_records.emplace_back();
+	ModelRecord* record = &model_records.back();
+	record->model = model;
+	record->deformable = geometry_settings.deformable;
+	record->handle = accelerator->newModel(record->deformable);
+	record->first_material = uint32_t(material_table.size());
+	for(auto& material : model->m_materials)
+	{
+		material_table.push_back(&material);
+		closure_table.push_back(compileMaterial(material));
+	}
+	// Compact records only have 16 bits for the material
+	record->compact = geometry_settings.compress_geometry && material_table.size() <= 0x10000;
+	if(geometry_settings.compress_geometry && !record->compact)
+		cout << "too many materials to compress the geometry of " << model->m_name << "...";
+	model_to_record[model] = record;
 
 	///////////////////////////////////////////////////////////////////////
-	// Transform and add each mesh in the model as a geometry in embree,
-	// and create mappings so that we can connect an embree geom_ID to a
-	// Material.
+	// The unwelded meshes of a model are triangle soups, so they all share
+	// one identity index buffer. With shared buffers, their vertices are
+	// also copied once into a single buffer that their geometries point
+	// into.
 	///////////////////////////////////////////////////////////////////////
-	cout << "Adding " << model->m_name << " to embree scene..." << flush;
+	SharedBuffers* model_buffers = nullptr;
+	if(!geometry_settings.weld_vertices)
+	{
+		shared_buffers.emplace_back();
+		model_buffers = &shared_buffers.back();
+		if(geometry_settings.share_buffers)
+			copyVertices(model->m_positions.data(), model->m_positions.size(), model_buffers->vertices);
+		uint32_t max_mesh_vertices = 0;
+		for(auto& mesh : model->m_meshes)
+		{
+			max_mesh_vertices = std::max(max_mesh_vertices, mesh.m_number_of_vertices);
+		}
+		model_buffers->indices.resize(max_mesh_vertices);
+		for(uint32_t i = 0; i < max_mesh_vertices; i++)
+		{
+			model_buffers->indices[i] = i;
+		}
+	}
+
+	vector<EmbreeVertex> staging;
+	size_t soup_vertices = 0, uploaded_vertices = 0;
 	for(auto& mesh : model->m_meshes)
 	{
-		uint32_t geom_ID = rtcNewTriangleMesh(embree_scene, RTC_GEOMETRY_STATIC,
-		                                      mesh.m_number_of_vertices / 3, mesh.m_number_of_vertices);
-		map_geom_ID_to_mesh[geom_ID] = &mesh;
-		map_geom_ID_to_model[geom_ID] = model;
-		// Transform and commit vertices
-		vec4* embree_vertices = (vec4*)rtcMapBuffer(embree_scene, geom_ID, RTC_VERTEX_BUFFER);
-		for(uint32_t i = 0; i < mesh.m_number_of_vertices; i++)
+		WeldedMesh* welded = nullptr;
+		if(geometry_settings.weld_vertices)
+		{
+			welded_meshes.emplace_back();
+			welded = &welded_meshes.back();
+			weldMesh(model, mesh, *welded);
+		}
+		const vec3* positions = welded ? welded->positions.data() : &model->m_positions[mesh.m_start_index];
+		const uint32_t number_of_vertices = welded ? uint32_t(welded->positions.size()) : mesh.m_number_of_vertices;
+		soup_vertices += mesh.m_number_of_vertices;
+		uploaded_vertices += number_of_vertices;
+
+		EmbreeVertex* vertices;
+		if(!geometry_settings.share_buffers)
+		{
+			// The accelerator copies the vertices
+			copyVertices(positions, number_of_vertices, staging);
+			vertices = staging.data();
+		}
+		else if(welded)
+		{
+			shared_buffers.emplace_back();
+			copyVertices(positions, number_of_vertices, shared_buffers.back().vertices);
+			vertices = shared_buffers.back().vertices.data();
+		}
+		else
+		{
+			vertices = &model_buffers->vertices[mesh.m_start_index];
+		}
+		MeshBuffers buffers;
+		buffers.vertices = &vertices->x;
+		buffers.number_of_vertices = number_of_vertices;
+		buffers.indices = welded ? welded->indices.data() : model_buffers->indices.data();
+		buffers.number_of_triangles = mesh.m_number_of_vertices / 3;
+		buffers.shared = geometry_settings.share_buffers;
+		uint32_t geom_ID = accelerator->addMesh(record->handle, buffers);
+
+		if(geom_ID >= record->geometries.size())
+		{
+			record->geometries.resize(geom_ID + 1);
+			record->triangles.resize(geom_ID + 1);
+			record->compact_triangles.resize(geom_ID + 1);
+			record->sources.resize(geom_ID + 1);
+		}
+		GeometryRecord& geometry = record->geometries[geom_ID];
+		if(record->compact)
+		{
+			fillCompactTriangleRecords(model, mesh, record->first_material + mesh.m_material_idx,
+			                           record->compact_triangles[geom_ID]);
+			geometry.triangles = nullptr;
+			geometry.compact_triangles = record->compact_triangles[geom_ID].data();
+		}
+		else
 		{
-			embree_vertices[i] = model_matrix * vec4(model->m_positions[mesh.m_start_index + i], 1.0f);
+			fillTriangleRecords(model, mesh, record->first_material + mesh.m_material_idx, record->triangles[geom_ID]);
+			geometry.triangles = record->triangles[geom_ID].data();
+			geometry.compact_triangles = nullptr;
 		}
-		rtcUnmapBuffer(embree_scene, geom_ID, RTC_VERTEX_BUFFER);
-		// Commit triangle indices
-		int* embree_tri_idxs = (int*)rtcMapBuffer(embree_scene, geom_ID, RTC_INDEX_BUFFER);
-		for(uint32_t i = 0; i < mesh.m_number_of_vertices; i++)
+		GeometrySource& source = record->sources[geom_ID];
+		source.mesh = &mesh;
+		source.welded = welded;
+		source.shared_vertices = geometry_settings.share_buffers ? vertices : nullptr;
+		source.indices = buffers.indices;
+
+		// The welded indices are only needed again to update a deformable
+		// model, or if the accelerator reads them
+		if(welded)
 		{
-			embree_tri_idxs[i] = i;
+			vector<vec3>().swap(welded->positions);
+			if(!record->deformable)
+			{
+				vector<uint32_t>().swap(welded->first_vertex);
+				if(!geometry_settings.share_buffers)
+					vector<uint32_t>().swap(welded->indices);
+			}
 		}
-		rtcUnmapBuffer(embree_scene, geom_ID, RTC_INDEX_BUFFER);
 	}
+	// The identity indices are only needed again to update a deformable
+	// model, or if the accelerator reads them
+	if(model_buffers != nullptr && !geometry_settings.share_buffers && !record->deformable)
+	{
+		vector<uint32_t>().swap(model_buffers->indices);
+	}
+	if(record->compact)
+	{
+		cout << "compressed shading records, saving "
+		     << (soup_vertices / 3) * (sizeof(TriangleRecord) - sizeof(CompactTriangleRecord)) / 1024 << " KiB...";
+	}
+	if(geometry_settings.weld_vertices)
+	{
+		cout << "welded " << soup_vertices << " vertices into " << uploaded_vertices << ", saving "
+		     << (soup_vertices - uploaded_vertices) * sizeof(vec4) / 1024 << " KiB of vertex memory..."
+		     << flush;
+	}
+	return record;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Add a model to the scene
+///////////////////////////////////////////////////////////////////////////
+uint32_t addModel(const labhelper::Model* model, const mat4& model_matrix)
+{
+	///////////////////////////////////////////////////////////////////////
+	// Lazy initialize the accelerator on first use
+	///////////////////////////////////////////////////////////////////////
+	if(accelerator == nullptr)
+	{
+		accelerator = createAccelerator();
+		cout << "Initialized " << accelerator->name() << ".\n";
+	}
+
+	///////////////////////////////////////////////////////////////////////
+	// The geometry of a model is only added the first time the model is
+	// added. After that we just place another instance of it.
+	///////////////////////////////////////////////////////////////////////
+	cout << "Adding " << model->m_name << " to scene..." << flush;
+	auto existing = model_to_record.find(model);
+	const ModelRecord* record = existing != model_to_record.end() ? existing->second : addModelScene(model);
+
+	uint32_t inst_ID = accelerator->addInstance(record->handle, model_matrix);
+	if(inst_ID >= instance_records.size())
+	{
+		instance_records.resize(inst_ID + 1);
+	}
+	instance_records[inst_ID].geometries = record->geometries.data();
+	instance_records[inst_ID].normal_matrix = transpose(inverse(mat3(model_matrix)));
+	instance_records[inst_ID].tangent_matrix = mat3(model_matrix);
+	instance_records[inst_ID].model = record;
+	instance_transforms.resize(instance_records.size());
+	instance_transforms[inst_ID] = model_matrix;
+	top_level_needs_commit = true;
 	cout << "done.\n";
+	return inst_ID;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Gather the positions of a model back from its shared buffers. Through
+// the index buffers, this works for welded meshes too.
+///////////////////////////////////////////////////////////////////////////
+void restoreModelPositions(labhelper::Model* model)
+{
+	auto existing = model_to_record.find(model);
+	if(existing == model_to_record.end() || !model->m_positions.empty())
+		return;
+	for(const GeometrySource& source : existing->second->sources)
+	{
+		if(source.mesh == nullptr || source.shared_vertices == nullptr)
+			continue;
+		const uint32_t start = source.mesh->m_start_index;
+		model->m_positions.resize(std::max(model->m_positions.size(),
+		                                   size_t(start + source.mesh->m_number_of_vertices)));
+		for(uint32_t i = 0; i < source.mesh->m_number_of_vertices; i++)
+		{
+			const EmbreeVertex& v = source.shared_vertices[source.indices[i]];
+			model->m_positions[start + i] = vec3(v.x, v.y, v.z);
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Move an instance. Takes effect at the next commitSceneUpdates().
+///////////////////////////////////////////////////////////////////////////
+void setInstanceTransform(uint32_t instance, const mat4& model_matrix)
+{
+	accelerator->setInstanceTransform(instance, model_matrix);
+	instance_records[instance].normal_matrix = transpose(inverse(mat3(model_matrix)));
+	instance_records[instance].tangent_matrix = mat3(model_matrix);
+	instance_transforms[instance] = model_matrix;
+	top_level_needs_commit = true;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Upload the vertices of a deformable model again after its positions
+// and normals have been changed. Takes effect at the next
+// commitSceneUpdates(), which refits the model's BVH.
+///////////////////////////////////////////////////////////////////////////
+void updateModelVertices(const labhelper::Model* model)
+{
+	auto found = model_to_record.find(model);
+	if(found == model_to_record.end() || !found->second->deformable)
+	{
+		cout << "Can't update the vertices of " << model->m_name << ", it was not added as deformable.\n";
+		return;
+	}
+	ModelRecord* record = found->second;
+	vector<EmbreeVertex> staging;
+	for(uint32_t geom_ID = 0; geom_ID < record->sources.size(); geom_ID++)
+	{
+		const GeometrySource& source = record->sources[geom_ID];
+		if(source.mesh == nullptr)
+			continue;
+		const uint32_t start = source.mesh->m_start_index;
+		const uint32_t number_of_vertices =
+		    source.welded ? uint32_t(source.welded->first_vertex.size()) : source.mesh->m_number_of_vertices;
+		EmbreeVertex* vertices = source.shared_vertices;
+		if(vertices == nullptr)
+		{
+			staging.resize(number_of_vertices);
+			vertices = staging.data();
+		}
+		for(uint32_t i = 0; i < number_of_vertices; i++)
+		{
+			const uint32_t v = start + (source.welded ? source.welded->first_vertex[i] : i);
+			vertices[i] = { model->m_positions[v].x, model->m_positions[v].y, model->m_positions[v].z, 0.0f };
+		}
+		const uint32_t material = record->first_material + source.mesh->m_material_idx;
+		if(record->compact)
+			fillCompactTriangleRecords(model, *source.mesh, material, record->compact_triangles[geom_ID]);
+		else
+			fillTriangleRecords(model, *source.mesh, material, record->triangles[geom_ID]);
+		MeshBuffers buffers;
+		buffers.vertices = &vertices->x;
+		buffers.number_of_vertices = number_of_vertices;
+		buffers.indices = source.indices;
+		buffers.number_of_triangles = source.mesh->m_number_of_vertices / 3;
+		buffers.shared = source.shared_vertices != nullptr;
+		accelerator->updateVertices(record->handle, geom_ID, buffers);
+	}
+	top_level_needs_commit = true;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Commit the scenes that changed since the last call
+///////////////////////////////////////////////////////////////////////////
+bool commitSceneUpdates()
+{
+	if(!top_level_needs_commit)
+		return false;
+	auto start_time = chrono::high_resolution_clock::now();
+	accelerator->commit();
+	top_level_needs_commit = false;
+	chrono::duration<float, milli> update_time = chrono::high_resolution_clock::now() - start_time;
+	bvh_stats.update_time_ms = update_time.count();
+	collectEmissiveTriangles();
+	return true;
+}
+
+void compileMaterials()
+{
+	for(size_t i = 0; i < material_table.size(); i++)
+	{
+		closure_table[i] = compileMaterial(*material_table[i]);
+	}
+	collectEmissiveTriangles();
+}
+
+bool anyEmissiveMaterial()
+{
+	for(const MaterialClosure& closure : closure_table)
+	{
+		if(closure.emission != vec3(0.0f))
+			return true;
+	}
+	return false;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Update the material of every geometry from its mesh
+///////////////////////////////////////////////////////////////////////////
+void updateMaterials()
+{
+	for(auto& record : model_records)
+	{
+		for(size_t geom_ID = 0; geom_ID < record.geometries.size(); geom_ID++)
+		{
+			const labhelper::Mesh* mesh = record.sources[geom_ID].mesh;
+			if(mesh == nullptr)
+				continue;
+			const uint32_t material = record.first_material + mesh->m_material_idx;
+			for(TriangleRecord& triangle : record.triangles[geom_ID])
+			{
+				triangle.material = material;
+			}
+			for(CompactTriangleRecord& triangle : record.compact_triangles[geom_ID])
+			{
+				triangle.material = uint16_t(material);
+			}
+		}
+	}
+	collectEmissiveTriangles();
 }
 
 ///////////////////////////////////////////////////////////////////////////
@@ -93,16 +796,41 @@ void addModel(const labhelper::Model* model, const mat4& model_matrix)
 ///////////////////////////////////////////////////////////////////////////
 Intersection getIntersection(const Ray& r)
 {
-	const labhelper::Model* model = map_geom_ID_to_model[r.geomID];
-	const labhelper::Mesh* mesh = map_geom_ID_to_mesh[r.geomID];
+	const InstanceRecord& instance = instance_records[r.instID];
+	const GeometryRecord& geometry = instance.geometries[r.geomID];
 	Intersection i;
-	i.material = &(model->m_materials[mesh->m_material_idx]);
-	vec3 n0 = model->m_normals[((mesh->m_start_index / 3) + r.primID) * 3 + 0];
-	vec3 n1 = model->m_normals[((mesh->m_start_index / 3) + r.primID) * 3 + 1];
-	vec3 n2 = model->m_normals[((mesh->m_start_index / 3) + r.primID) * 3 + 2];
+	vec3 n0, n1, n2, triangle_tangent;
+	if(geometry.compact_triangles != nullptr)
+	{
+		const CompactTriangleRecord& triangle = geometry.compact_triangles[r.primID];
+		i.material = &closure_table[triangle.material];
+		n0 = decodeOctahedral<16>(triangle.normals[0]);
+		n1 = decodeOctahedral<16>(triangle.normals[1]);
+		n2 = decodeOctahedral<16>(triangle.normals[2]);
+		triangle_tangent = decodeOctahedral<8>(triangle.tangent);
+	}
+	else
+	{
+		const TriangleRecord& triangle = geometry.triangles[r.primID];
+		i.material = &closure_table[triangle.material];
+		n0 = triangle.normals[0];
+		n1 = triangle.normals[1];
+		n2 = triangle.normals[2];
+		triangle_tangent = triangle.tangent;
+	}
 	float w = 1.0f - (r.u + r.v);
-	i.shading_normal = normalize(w * n0 + r.u * n1 + r.v * n2);
-	i.geometry_normal = -normalize(r.n);
+	// Embree reports the geometry normal of an instance hit in object space
+	i.shading_normal = normalize(instance.normal_matrix * (w * n0 + r.u * n1 + r.v * n2));
+	i.geometry_normal = -normalize(instance.normal_matrix * r.n);
+	// The stored edge lies in the plane of the triangle, so it only has to
+	// be made orthogonal to the shading normal to complete the frame
+	const vec3 edge = instance.tangent_matrix * triangle_tangent;
+	const vec3 tangent = edge - i.shading_normal * dot(i.shading_normal, edge);
+	if(dot(tangent, tangent) > 1e-6f * dot(edge, edge))
+		i.tangent = normalize(tangent);
+	else
+		i.tangent = normalize(perpendicular(i.shading_normal));
+	i.bitangent = cross(i.shading_normal, i.tangent);
 	i.position = r.o + r.tfar * r.d;
 	i.wo = normalize(-r.d);
 	return i;
@@ -113,8 +841,7 @@ Intersection getIntersection(const Ray& r)
 ///////////////////////////////////////////////////////////////////////////
 bool intersect(Ray& r)
 {
-	rtcIntersect(embree_scene, *((RTCRay*)&r));
-	return r.geomID != RTC_INVALID_GEOMETRY_ID;
+	return accelerator->intersect(r);
 }
 
 ///////////////////////////////////////////////////////////////////////////
@@ -123,7 +850,70 @@ bool intersect(Ray& r)
 ///////////////////////////////////////////////////////////////////////////
 bool occluded(Ray& r)
 {
-	rtcOccluded(embree_scene, *((RTCRay*)&r));
-	return r.geomID != RTC_INVALID_GEOMETRY_ID;
+	return accelerator->occluded(r);
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Test a whole stream of rays against the scene in one call
+///////////////////////////////////////////////////////////////////////////
+void intersect(Ray* rays, size_t count, bool coherent)
+{
+	accelerator->intersect(rays, count, coherent);
+}
+
+void occluded(Ray* rays, size_t count, bool coherent)
+{
+	accelerator->occluded(rays, count, coherent);
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Test all valid rays of a packet against the scene and find the closest
+// intersections
+///////////////////////////////////////////////////////////////////////////
+void intersect(RayPacket& packet)
+{
+	accelerator->intersect(packet);
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Accelerators without a packet kernel trace the lanes one by one
+///////////////////////////////////////////////////////////////////////////
+void Accelerator::intersect(RayPacket& packet)
+{
+	for(int lane = 0; lane < RAY_PACKET_SIZE; lane++)
+	{
+		if(!packet.valid[lane])
+			continue;
+		Ray r = getRay(packet, lane);
+		intersect(r);
+		packet.rays.tfar[lane] = r.tfar;
+		packet.rays.Ngx[lane] = r.n.x;
+		packet.rays.Ngy[lane] = r.n.y;
+		packet.rays.Ngz[lane] = r.n.z;
+		packet.rays.u[lane] = r.u;
+		packet.rays.v[lane] = r.v;
+		packet.rays.geomID[lane] = r.geomID;
+		packet.rays.primID[lane] = r.primID;
+		packet.rays.instID[lane] = r.instID;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Extract one lane of a packet as a single Ray (including hit data)
+///////////////////////////////////////////////////////////////////////////
+Ray getRay(const RayPacket& packet, int lane)
+{
+	const RTCRay8& p = packet.rays;
+	Ray r(vec3(p.orgx[lane], p.orgy[lane], p.orgz[lane]), vec3(p.dirx[lane], p.diry[lane], p.dirz[lane]),
+	      p.tnear[lane], p.tfar[lane]);
+	r.time = p.time[lane];
+	r.mask = p.mask[lane];
+	r.n = vec3(p.Ngx[lane], p.Ngy[lane], p.Ngz[lane]);
+	r.u = p.u[lane];
+	r.v = p.v[lane];
+	r.geomID = p.geomID[lane];
+	r.primID = p.primID[lane];
+	r.instID = p.instID[lane];
+	return r;
 }
 } // namespace pathtracer
\ No newline at end of file
@@ -3,20 +3,153 @@
 #include <embree2/rtcore_ray.h>
 #include "Model.h"
 #include <glm/glm.hpp>
-#include <map>
+#include <vector>
+#include "sampling.h"
 
 namespace pathtracer
 {
+struct MaterialClosure;
+
+///////////////////////////////////////////////////////////////////////////
+// Trade-offs between BVH build time, trace time and memory
+///////////////////////////////////////////////////////////////////////////
+enum BVHQuality
+{
+	BVH_DEFAULT = 0,      // The accelerator's default build
+	BVH_FAST = 1,         // Quick build, slower traversal (interactive editing)
+	BVH_HIGH_QUALITY = 2, // Slow SAH build with spatial splits (final frames)
+	BVH_COMPACT = 3,      // Less memory, slightly slower traversal
+	BVH_ROBUST = 4,       // Avoid missed hits on edges, slower traversal
+	BVH_NUMBER_OF_QUALITIES
+};
+// Names as used on the command line and in the GUI
+const char* const BVH_QUALITY_NAMES[] = { "default", "fast", "high-quality", "compact", "robust" };
+
+///////////////////////////////////////////////////////////////////////////
+// The ray tracing kernels the functions below can run on
 ///////////////////////////////////////////////////////////////////////////
-// Add a model to the embree scene
+enum AcceleratorType
+{
+	ACCELERATOR_EMBREE = 0, // Embree's scenes and instances
+	ACCELERATOR_BVH8 = 1,   // Our own 8-wide BVH, see bvh8.h
+	ACCELERATOR_NUMBER_OF_TYPES
+};
+const char* const ACCELERATOR_NAMES[] = { "embree", "bvh8" };
+
+///////////////////////////////////////////////////////////////////////////
+// Options for how models are stored in the scene. These are read
+// by addModel(), so set them before adding models.
 ///////////////////////////////////////////////////////////////////////////
-void addModel(const labhelper::Model* model, const glm::mat4& model_matrix);
+extern struct GeometrySettings
+{
+	// Merge identical vertices into an indexed mesh instead of uploading
+	// each triangle's vertices separately
+	bool weld_vertices = false;
+	// Let the accelerator read vertices and indices straight from aligned
+	// buffers that we own, instead of copying them into buffers it
+	// allocates.
+	// The pathtracer then never reads Model::m_positions of a model that
+	// is not deformable after addModel(), so the application can release
+	// them and keep only our copy, see restoreModelPositions().
+	bool share_buffers = false;
+	// Models added while this is set can be deformed after the BVH has
+	// been built, see updateModelVertices()
+	bool deformable = false;
+	// One of BVHQuality, used for the BVHs of all models that are not
+	// deformable. Call rebuildBVH() after changing it.
+	int bvh_quality = BVH_DEFAULT;
+	// One of AcceleratorType. Call rebuildBVH() after changing it.
+	int accelerator = ACCELERATOR_EMBREE;
+	// Store shading normals octahedrally encoded in 32 bits and, with the
+	// BVH8 accelerator, vertex positions quantized to 21 bits per axis
+	// within the model's bounds. Saves memory at a small loss of accuracy.
+	// Call rebuildBVH() after changing it.
+	bool compress_geometry = false;
+} geometry_settings;
+
+///////////////////////////////////////////////////////////////////////////
+// How long building and updating the acceleration structures took
+///////////////////////////////////////////////////////////////////////////
+extern struct BVHStats
+{
+	float build_time_ms = 0.0f;  // Last buildBVH()
+	float update_time_ms = 0.0f; // Last commitSceneUpdates() that did anything
+	size_t memory_bytes = 0;     // Memory used by the accelerator after the last build
+	size_t shading_bytes = 0;    // Memory used by the per triangle shading records
+} bvh_stats;
+
+///////////////////////////////////////////////////////////////////////////
+// Add a model to the scene. The geometry of a model is only stored
+// once, however many times it is added: each call places an instance of
+// it with the given transform. Returns the id of the new instance.
+///////////////////////////////////////////////////////////////////////////
+uint32_t addModel(const labhelper::Model* model, const glm::mat4& model_matrix);
+
+///////////////////////////////////////////////////////////////////////////
+// Write the positions of a model that was added with share_buffers back
+// into Model::m_positions, from the buffers the accelerator reads. Needed
+// after the application released them, before anything reads them again
+// (saving the model, or rebuildBVH()). Does nothing if they are there.
+///////////////////////////////////////////////////////////////////////////
+void restoreModelPositions(labhelper::Model* model);
+
+///////////////////////////////////////////////////////////////////////////
+// Change the scene after the BVH has been built. Changes take effect when
+// commitSceneUpdates() is called, which only re-commits what changed.
+///////////////////////////////////////////////////////////////////////////
+// Move an instance returned by addModel()
+void setInstanceTransform(uint32_t instance, const glm::mat4& model_matrix);
+// Upload the positions and normals of a deformable model again
+void updateModelVertices(const labhelper::Model* model);
+// Refit/rebuild what changed. Returns false if nothing had changed.
+bool commitSceneUpdates();
 
 ///////////////////////////////////////////////////////////////////////////
 // Build an acceleration structure for the scene
 ///////////////////////////////////////////////////////////////////////////
 void buildBVH();
 
+///////////////////////////////////////////////////////////////////////////
+// Build the acceleration structure again from scratch, e.g. after
+// changing geometry_settings.bvh_quality or accelerator. Instance IDs
+// are kept. Reads the models again, so their positions must be there.
+///////////////////////////////////////////////////////////////////////////
+void rebuildBVH();
+
+///////////////////////////////////////////////////////////////////////////
+// Call when a mesh in the scene has been assigned another material
+///////////////////////////////////////////////////////////////////////////
+void updateMaterials();
+
+///////////////////////////////////////////////////////////////////////////
+// Materials are compiled into closures when their model is added. Call
+// this after editing the materials of a model in the scene.
+///////////////////////////////////////////////////////////////////////////
+void compileMaterials();
+// Whether any material in the scene emits light
+bool anyEmissiveMaterial();
+
+///////////////////////////////////////////////////////////////////////////
+// The triangles of all instances whose material emits light, in world
+// space, so that next event estimation can sample points on them. They
+// are drawn by their power (emitted luminance times area) from the alias
+// table. Collected again whenever what they depend on changes: by
+// buildBVH(), commitSceneUpdates(), compileMaterials() and
+// updateMaterials().
+///////////////////////////////////////////////////////////////////////////
+struct EmissiveTriangle
+{
+	glm::vec3 p0, edge1, edge2; // A vertex and the edges from it
+	glm::vec3 normal;           // Unit, by the winding
+	float area;
+	glm::vec3 emission;
+};
+extern struct EmissiveLights
+{
+	std::vector<EmissiveTriangle> triangles;
+	AliasTable power;
+} emissive_lights;
+
 ///////////////////////////////////////////////////////////////////////////
 // This struct is what an embree Ray must look like. It contains the
 // information about the ray to be shot and (after intersect() has been
@@ -59,8 +192,10 @@ struct Intersection
 	glm::vec3 position;
 	glm::vec3 geometry_normal;
 	glm::vec3 shading_normal;
+	glm::vec3 tangent;   // Together with bitangent and shading_normal an
+	glm::vec3 bitangent; // orthonormal frame to sample directions in
 	glm::vec3 wo;
-	const labhelper::Material* material;
+	const MaterialClosure* material;
 };
 Intersection getIntersection(const Ray& r);
 
@@ -74,4 +209,34 @@ bool intersect(Ray& r);
 // intersection).
 ///////////////////////////////////////////////////////////////////////////
 bool occluded(Ray& r);
+
+///////////////////////////////////////////////////////////////////////////
+// Test a whole stream of rays against the scene in one call (closest hit
+// or occlusion). Set coherent if neighbouring rays in the stream are
+// likely to traverse the same parts of the BVH, e.g. after sorting them.
+///////////////////////////////////////////////////////////////////////////
+void intersect(Ray* rays, size_t count, bool coherent);
+void occluded(Ray* rays, size_t count, bool coherent);
+
+///////////////////////////////////////////////////////////////////////////
+// A packet of eight rays in the SoA layout that rtcIntersect8 expects.
+// Lanes with valid[i] == 0 are ignored by the intersector.
+///////////////////////////////////////////////////////////////////////////
+#define RAY_PACKET_SIZE 8
+struct RTCORE_ALIGN(32) RayPacket
+{
+	RTCRay8 rays;
+	int valid[RAY_PACKET_SIZE];
+};
+
+///////////////////////////////////////////////////////////////////////////
+// Test all valid rays of a packet against the scene and find the closest
+// intersections
+///////////////////////////////////////////////////////////////////////////
+void intersect(RayPacket& packet);
+
+///////////////////////////////////////////////////////////////////////////
+// Extract one lane of a packet as a single Ray (including hit data)
+///////////////////////////////////////////////////////////////////////////
+Ray getRay(const RayPacket& packet, int lane);
 } // namespace pathtracer
\ No newline at end of file
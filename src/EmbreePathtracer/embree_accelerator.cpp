@@ -0,0 +1,266 @@
+#include "accelerator.h"
+#include <atomic>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+using namespace std;
+using namespace glm;
+
+namespace pathtracer
+{
+///////////////////////////////////////////////////////////////////////////
+// One embree device is shared by all EmbreeAccelerators, so that
+// switching accelerators doesn't restart embree.
+///////////////////////////////////////////////////////////////////////////
+RTCDevice embree_device = nullptr;
+atomic<int64_t> embree_memory_bytes(0);
+const RTCAlgorithmFlags embree_algorithms = RTC_INTERSECT1 | RTC_INTERSECT8 | RTC_INTERSECT_STREAM;
+
+///////////////////////////////////////////////////////////////////////////
+// Called when there is an embree error
+///////////////////////////////////////////////////////////////////////////
+void embreeErrorHandler(const RTCError /*code*/, const char* str)
+{
+	cout << "Embree ERROR: " << str << endl;
+	exit(1);
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Called by embree whenever it allocates (bytes > 0) or frees memory
+///////////////////////////////////////////////////////////////////////////
+bool embreeMemoryMonitor(const ssize_t bytes, const bool /*post*/)
+{
+	embree_memory_bytes += bytes;
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// The scene flags that select how embree builds the BVH of a model
+///////////////////////////////////////////////////////////////////////////
+static RTCSceneFlags modelSceneFlags(bool deformable)
+{
+	// Refitting after a deformation needs a dynamic scene
+	if(deformable)
+		return RTC_SCENE_DYNAMIC;
+	switch(geometry_settings.bvh_quality)
+	{
+	case BVH_FAST:
+		// Dynamic scenes are built with embree's fast (Morton code) builder
+		return RTC_SCENE_DYNAMIC;
+	case BVH_HIGH_QUALITY:
+		// SAH builder with spatial splits
+		return RTC_SCENE_HIGH_QUALITY;
+	case BVH_COMPACT:
+		return RTC_SCENE_COMPACT;
+	case BVH_ROBUST:
+		return RTC_SCENE_ROBUST;
+	default:
+		return RTC_SCENE_STATIC;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Every model is an embree scene, in model space, and the top level
+// scene holds an embree instance of a model scene for every instance.
+///////////////////////////////////////////////////////////////////////////
+class EmbreeAccelerator : public Accelerator
+{
+public:
+	EmbreeAccelerator();
+	~EmbreeAccelerator();
+	const char* name() const override
+	{
+		return "Embree";
+	}
+	uint32_t newModel(bool deformable) override;
+	uint32_t addMesh(uint32_t model, const MeshBuffers& mesh) override;
+	uint32_t addInstance(uint32_t model, const mat4& model_matrix) override;
+	void setInstanceTransform(uint32_t instance, const mat4& model_matrix) override;
+	void updateVertices(uint32_t model, uint32_t mesh, const MeshBuffers& buffers) override;
+	void commit() override;
+	size_t memoryBytes() const override;
+
+	bool intersect(Ray& r) override;
+	bool occluded(Ray& r) override;
+	void intersect(Ray* rays, size_t count, bool coherent) override;
+	void occluded(Ray* rays, size_t count, bool coherent) override;
+	void intersect(RayPacket& packet) override;
+
+private:
+	struct Model
+	{
+		RTCScene scene;
+		bool deformable;
+		bool needs_commit;
+	};
+	vector<Model> m_models;
+	vector<uint32_t> m_instance_models;
+	RTCScene m_scene;
+	bool m_supports_packets;
+};
+
+EmbreeAccelerator::EmbreeAccelerator()
+{
+	if(embree_device == nullptr)
+	{
+		embree_device = rtcNewDevice();
+		rtcDeviceSetErrorFunction(embree_device, embreeErrorHandler);
+		rtcDeviceSetMemoryMonitorFunction(embree_device, embreeMemoryMonitor);
+	}
+	// The top level scene only holds a few instances, so it is cheap to
+	// keep it dynamic so that instances can be moved.
+	m_scene = rtcDeviceNewScene(embree_device, RTC_SCENE_DYNAMIC, embree_algorithms);
+	m_supports_packets = rtcDeviceGetParameter1i(embree_device, RTC_CONFIG_INTERSECT8) != 0;
+}
+
+EmbreeAccelerator::~EmbreeAccelerator()
+{
+	rtcDeleteScene(m_scene);
+	for(auto& model : m_models)
+	{
+		rtcDeleteScene(model.scene);
+	}
+}
+
+uint32_t EmbreeAccelerator::newModel(bool deformable)
+{
+	m_models.push_back({ rtcDeviceNewScene(embree_device, modelSceneFlags(deformable), embree_algorithms),
+	                     deformable, true });
+	return uint32_t(m_models.size() - 1);
+}
+
+uint32_t EmbreeAccelerator::addMesh(uint32_t model, const MeshBuffers& mesh)
+{
+	Model& m = m_models[model];
+	uint32_t geom_ID = rtcNewTriangleMesh(m.scene, m.deformable ? RTC_GEOMETRY_DEFORMABLE : RTC_GEOMETRY_STATIC,
+	                                      mesh.number_of_triangles, mesh.number_of_vertices);
+	if(mesh.shared)
+	{
+		// Hand embree our own buffers instead of copying into its own
+		rtcSetBuffer2(m.scene, geom_ID, RTC_VERTEX_BUFFER, mesh.vertices, 0, 4 * sizeof(float),
+		              mesh.number_of_vertices);
+		rtcSetBuffer2(m.scene, geom_ID, RTC_INDEX_BUFFER, mesh.indices, 0, 3 * sizeof(uint32_t),
+		              mesh.number_of_triangles);
+	}
+	else
+	{
+		// Commit vertices
+		float* embree_vertices = (float*)rtcMapBuffer(m.scene, geom_ID, RTC_VERTEX_BUFFER);
+		memcpy(embree_vertices, mesh.vertices, mesh.number_of_vertices * 4 * sizeof(float));
+		rtcUnmapBuffer(m.scene, geom_ID, RTC_VERTEX_BUFFER);
+		// Commit triangle indices
+		uint32_t* embree_tri_idxs = (uint32_t*)rtcMapBuffer(m.scene, geom_ID, RTC_INDEX_BUFFER);
+		memcpy(embree_tri_idxs, mesh.indices, mesh.number_of_triangles * 3 * sizeof(uint32_t));
+		rtcUnmapBuffer(m.scene, geom_ID, RTC_INDEX_BUFFER);
+	}
+	m.needs_commit = true;
+	return geom_ID;
+}
+
+uint32_t EmbreeAccelerator::addInstance(uint32_t model, const mat4& model_matrix)
+{
+	uint32_t inst_ID = rtcNewInstance2(m_scene, m_models[model].scene);
+	rtcSetTransform2(m_scene, inst_ID, RTC_MATRIX_COLUMN_MAJOR_ALIGNED16, &model_matrix[0][0]);
+	if(inst_ID >= m_instance_models.size())
+	{
+		m_instance_models.resize(inst_ID + 1);
+	}
+	m_instance_models[inst_ID] = model;
+	return inst_ID;
+}
+
+void EmbreeAccelerator::setInstanceTransform(uint32_t instance, const mat4& model_matrix)
+{
+	rtcSetTransform2(m_scene, instance, RTC_MATRIX_COLUMN_MAJOR_ALIGNED16, &model_matrix[0][0]);
+	rtcUpdate(m_scene, instance);
+}
+
+void EmbreeAccelerator::updateVertices(uint32_t model, uint32_t mesh, const MeshBuffers& buffers)
+{
+	Model& m = m_models[model];
+	if(buffers.shared)
+	{
+		rtcUpdateBuffer(m.scene, mesh, RTC_VERTEX_BUFFER);
+	}
+	else
+	{
+		float* embree_vertices = (float*)rtcMapBuffer(m.scene, mesh, RTC_VERTEX_BUFFER);
+		memcpy(embree_vertices, buffers.vertices, buffers.number_of_vertices * 4 * sizeof(float));
+		rtcUnmapBuffer(m.scene, mesh, RTC_VERTEX_BUFFER);
+	}
+	m.needs_commit = true;
+	// The instances of the model have to be refit in the top level scene
+	for(uint32_t inst_ID = 0; inst_ID < m_instance_models.size(); inst_ID++)
+	{
+		if(m_instance_models[inst_ID] == model)
+			rtcUpdate(m_scene, inst_ID);
+	}
+}
+
+void EmbreeAccelerator::commit()
+{
+	// The instanced scenes have to be committed before the top level scene
+	for(auto& model : m_models)
+	{
+		if(model.needs_commit)
+		{
+			rtcCommit(model.scene);
+			model.needs_commit = false;
+		}
+	}
+	rtcCommit(m_scene);
+}
+
+size_t EmbreeAccelerator::memoryBytes() const
+{
+	return size_t(embree_memory_bytes.load());
+}
+
+bool EmbreeAccelerator::intersect(Ray& r)
+{
+	rtcIntersect(m_scene, *((RTCRay*)&r));
+	return r.geomID != RTC_INVALID_GEOMETRY_ID;
+}
+
+bool EmbreeAccelerator::occluded(Ray& r)
+{
+	rtcOccluded(m_scene, *((RTCRay*)&r));
+	return r.geomID != RTC_INVALID_GEOMETRY_ID;
+}
+
+void EmbreeAccelerator::intersect(Ray* rays, size_t count, bool coherent)
+{
+	RTCIntersectContext context;
+	context.flags = coherent ? RTC_INTERSECT_COHERENT : RTC_INTERSECT_INCOHERENT;
+	context.userRayExt = nullptr;
+	rtcIntersect1M(m_scene, &context, (RTCRay*)rays, count, sizeof(Ray));
+}
+
+void EmbreeAccelerator::occluded(Ray* rays, size_t count, bool coherent)
+{
+	RTCIntersectContext context;
+	context.flags = coherent ? RTC_INTERSECT_COHERENT : RTC_INTERSECT_INCOHERENT;
+	context.userRayExt = nullptr;
+	rtcOccluded1M(m_scene, &context, (RTCRay*)rays, count, sizeof(Ray));
+}
+
+///////////////////////////////////////////////////////////////////////////
+// If this build of embree can't trace 8-wide packets we trace the lanes
+// one by one instead.
+///////////////////////////////////////////////////////////////////////////
+void EmbreeAccelerator::intersect(RayPacket& packet)
+{
+	if(!m_supports_packets)
+	{
+		Accelerator::intersect(packet);
+		return;
+	}
+	rtcIntersect8(packet.valid, m_scene, packet.rays);
+}
+
+Accelerator* createEmbreeAccelerator()
+{
+	return new EmbreeAccelerator();
+}
+} // namespace pathtracer
@@ -0,0 +1,372 @@
+#include "envcache.h"
+#include "envmap.h"
+#include "sampling.h"
+#include <stb_image.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <vector>
+#include <sys/stat.h>
+#if defined(_WIN32)
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <process.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace pathtracer
+{
+///////////////////////////////////////////////////////////////////////////
+// A whole file mapped read only into memory
+///////////////////////////////////////////////////////////////////////////
+class MappedFile
+{
+public:
+	~MappedFile();
+	bool open(const std::string& filename);
+	const uint8_t* data() const
+	{
+		return m_data;
+	}
+	size_t size() const
+	{
+		return m_size;
+	}
+
+private:
+	const uint8_t* m_data = nullptr;
+	size_t m_size = 0;
+#if defined(_WIN32)
+	HANDLE m_mapping = nullptr;
+#endif
+};
+
+#if defined(_WIN32)
+bool MappedFile::open(const std::string& filename)
+{
+	HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr,
+	                          OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if(file == INVALID_HANDLE_VALUE)
+		return false;
+	LARGE_INTEGER size;
+	if(GetFileSizeEx(file, &size) && size.QuadPart > 0)
+		m_mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	// The mapping keeps the file open
+	CloseHandle(file);
+	if(m_mapping == nullptr)
+		return false;
+	m_data = static_cast<const uint8_t*>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0));
+	m_size = size_t(size.QuadPart);
+	return m_data != nullptr;
+}
+
+MappedFile::~MappedFile()
+{
+	if(m_data != nullptr)
+		UnmapViewOfFile(m_data);
+	if(m_mapping != nullptr)
+		CloseHandle(m_mapping);
+}
+#else
+bool MappedFile::open(const std::string& filename)
+{
+	const int file = ::open(filename.c_str(), O_RDONLY);
+	if(file < 0)
+		return false;
+	struct stat info;
+	if(fstat(file, &info) == 0 && info.st_size > 0)
+	{
+		void* data = mmap(nullptr, size_t(info.st_size), PROT_READ, MAP_SHARED, file, 0);
+		if(data != MAP_FAILED)
+		{
+			m_data = static_cast<const uint8_t*>(data);
+			m_size = size_t(info.st_size);
+		}
+	}
+	// The mapping keeps the file open
+	close(file);
+	return m_data != nullptr;
+}
+
+MappedFile::~MappedFile()
+{
+	if(m_data != nullptr)
+		munmap(const_cast<uint8_t*>(m_data), m_size);
+}
+#endif
+
+///////////////////////////////////////////////////////////////////////////
+// The file: a header, followed by the arrays at offsets aligned to cache
+// lines. The version must be bumped whenever the layout, or how anything
+// in it is computed, changes.
+///////////////////////////////////////////////////////////////////////////
+const char CACHE_MAGIC[8] = { 'E', 'N', 'V', 'C', 'A', 'C', 'H', 'E' };
+const uint32_t CACHE_VERSION = 1;
+
+enum CacheSection
+{
+	CACHE_PIXELS,
+	CACHE_ROW_PROBABILITY,
+	CACHE_ROW_ALIAS,
+	CACHE_ROW_PDF,
+	CACHE_COLUMN_PROBABILITY,
+	CACHE_COLUMN_ALIAS,
+	CACHE_COLUMN_PDF,
+	CACHE_OCTAHEDRAL,
+	CACHE_NUMBER_OF_SECTIONS
+};
+
+struct CacheHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t header_bytes;
+	uint64_t source_bytes; // Of the .hdr that was converted
+	int64_t source_time;   // Its modification time
+	int32_t width, height;
+	float scale;
+	int32_t octahedral_size;
+	uint64_t offsets[CACHE_NUMBER_OF_SECTIONS];
+	uint64_t file_bytes;
+};
+
+// Fills in the offsets and size of the file from the rest of the header
+static void layout(CacheHeader& header)
+{
+	const uint64_t pixels = uint64_t(header.width) * uint64_t(header.height);
+	const uint64_t bytes[CACHE_NUMBER_OF_SECTIONS] = {
+		pixels * 3 * sizeof(uint16_t),
+		uint64_t(header.height) * sizeof(float),
+		uint64_t(header.height) * sizeof(uint32_t),
+		uint64_t(header.height) * sizeof(float),
+		pixels * sizeof(float),
+		pixels * sizeof(uint32_t),
+		pixels * sizeof(float),
+		OctahedralMap::halvesFor(header.octahedral_size) * sizeof(uint16_t),
+	};
+	auto align = [](uint64_t offset) { return (offset + 63) / 64 * 64; };
+	uint64_t offset = align(sizeof(CacheHeader));
+	for(int section = 0; section < CACHE_NUMBER_OF_SECTIONS; section++)
+	{
+		header.offsets[section] = offset;
+		offset = align(offset + bytes[section]);
+	}
+	header.file_bytes = offset;
+}
+
+static bool sourceStamp(const std::string& filename, uint64_t& bytes, int64_t& time)
+{
+#if defined(_WIN32)
+	struct _stat64 info;
+	if(_stat64(filename.c_str(), &info) != 0)
+		return false;
+#else
+	struct stat info;
+	if(stat(filename.c_str(), &info) != 0)
+		return false;
+#endif
+	bytes = uint64_t(info.st_size);
+	time = int64_t(info.st_mtime);
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Conversion
+///////////////////////////////////////////////////////////////////////////
+static std::unique_ptr<uint8_t[]> convert(const std::string& filename, CacheHeader& header)
+{
+	int width, height, components;
+	stbi_set_flip_vertically_on_load(false);
+	float* data = stbi_loadf(filename.c_str(), &width, &height, &components, 3);
+	stbi_set_flip_vertically_on_load(true);
+	if(data == nullptr)
+		return nullptr;
+
+	// A power of two, so dividing by it loses no precision
+	float brightest = 0.0f;
+	for(size_t i = 0; i < size_t(width) * height * 3; i++)
+	{
+		brightest = std::max(brightest, data[i]);
+	}
+	float scale = 1.0f;
+	while(brightest / scale > HALF_MAX)
+		scale *= 2.0f;
+
+	header.width = width;
+	header.height = height;
+	header.scale = scale;
+	header.octahedral_size = OctahedralMap::sizeFor(width);
+	layout(header);
+	std::unique_ptr<uint8_t[]> file(new uint8_t[header.file_bytes]());
+	memcpy(file.get(), &header, sizeof(header));
+	auto section = [&file, &header](CacheSection s) { return file.get() + header.offsets[s]; };
+	uint16_t* pixels = reinterpret_cast<uint16_t*>(section(CACHE_PIXELS));
+	float* column_probability = reinterpret_cast<float*>(section(CACHE_COLUMN_PROBABILITY));
+	uint32_t* column_alias = reinterpret_cast<uint32_t*>(section(CACHE_COLUMN_ALIAS));
+	float* column_pdf = reinterpret_cast<float*>(section(CACHE_COLUMN_PDF));
+
+	// The distribution is of the pixels as stored, so that its pdf is
+	// proportional to what lookups return
+	const float pi = 3.14159265f;
+	std::vector<float> row_weights(height);
+	#pragma omp parallel for
+	for(int y = 0; y < height; y++)
+	{
+		const float sin_theta = std::sin(pi * (float(y) + 0.5f) / float(height));
+		std::vector<float> weights(width);
+		for(int x = 0; x < width; x++)
+		{
+			const size_t i = (size_t(y) * width + x) * 3;
+			float rgb[3];
+			for(int c = 0; c < 3; c++)
+			{
+				pixels[i + c] = floatToHalf(data[i + c] / scale);
+				rgb[c] = scale * halfToFloat(pixels[i + c]);
+			}
+			weights[x] = (0.2126f * rgb[0] + 0.7152f * rgb[1] + 0.0722f * rgb[2]) * sin_theta;
+		}
+		const size_t row = size_t(y) * width;
+		row_weights[y] = buildAliasTable(weights.data(), width, column_probability + row, column_alias + row,
+		                                 column_pdf + row);
+	}
+	buildAliasTable(row_weights.data(), height, reinterpret_cast<float*>(section(CACHE_ROW_PROBABILITY)),
+	                reinterpret_cast<uint32_t*>(section(CACHE_ROW_ALIAS)),
+	                reinterpret_cast<float*>(section(CACHE_ROW_PDF)));
+
+	OctahedralMap::resample(data, width, height, scale, header.octahedral_size,
+	                        reinterpret_cast<uint16_t*>(section(CACHE_OCTAHEDRAL)));
+	stbi_image_free(data);
+	return file;
+}
+
+// Written under a name of its own and then renamed, so that another
+// process converting the same map at the same time never maps a partly
+// written file
+static bool writeCache(const std::string& filename, const uint8_t* data, size_t size)
+{
+#if defined(_WIN32)
+	const std::string temporary = filename + "." + std::to_string(_getpid()) + ".tmp";
+#else
+	const std::string temporary = filename + "." + std::to_string(getpid()) + ".tmp";
+#endif
+	FILE* file = fopen(temporary.c_str(), "wb");
+	if(file == nullptr)
+		return false;
+	const bool written = fwrite(data, 1, size, file) == size;
+	if(fclose(file) != 0 || !written)
+	{
+		remove(temporary.c_str());
+		return false;
+	}
+#if defined(_WIN32)
+	const bool renamed = MoveFileExA(temporary.c_str(), filename.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+	const bool renamed = rename(temporary.c_str(), filename.c_str()) == 0;
+#endif
+	if(!renamed)
+		remove(temporary.c_str());
+	return renamed;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Loading
+///////////////////////////////////////////////////////////////////////////
+EnvironmentCache::~EnvironmentCache()
+{
+}
+
+bool EnvironmentCache::attach(const uint8_t* data, size_t size, uint64_t source_bytes, int64_t source_time)
+{
+	if(size < sizeof(CacheHeader))
+		return false;
+	CacheHeader header;
+	memcpy(&header, data, sizeof(header));
+	if(memcmp(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0 || header.version != CACHE_VERSION
+	   || header.header_bytes != sizeof(CacheHeader) || header.source_bytes != source_bytes
+	   || header.source_time != source_time || header.width <= 0 || header.height <= 0)
+		return false;
+	// The offsets must be those of the layout, within the file
+	CacheHeader expected = header;
+	layout(expected);
+	if(memcmp(expected.offsets, header.offsets, sizeof(header.offsets)) != 0 || expected.file_bytes != header.file_bytes
+	   || header.file_bytes != size)
+		return false;
+
+	width = header.width;
+	height = header.height;
+	scale = header.scale;
+	pixels = reinterpret_cast<const uint16_t*>(data + header.offsets[CACHE_PIXELS]);
+	row_probability = reinterpret_cast<const float*>(data + header.offsets[CACHE_ROW_PROBABILITY]);
+	row_alias = reinterpret_cast<const uint32_t*>(data + header.offsets[CACHE_ROW_ALIAS]);
+	row_pdf = reinterpret_cast<const float*>(data + header.offsets[CACHE_ROW_PDF]);
+	column_probability = reinterpret_cast<const float*>(data + header.offsets[CACHE_COLUMN_PROBABILITY]);
+	column_alias = reinterpret_cast<const uint32_t*>(data + header.offsets[CACHE_COLUMN_ALIAS]);
+	column_pdf = reinterpret_cast<const float*>(data + header.offsets[CACHE_COLUMN_PDF]);
+	octahedral_size = header.octahedral_size;
+	octahedral_texels = reinterpret_cast<const uint16_t*>(data + header.offsets[CACHE_OCTAHEDRAL]);
+	bytes = size;
+	return true;
+}
+
+std::shared_ptr<const EnvironmentCache> EnvironmentCache::load(const std::string& filename)
+{
+	// Held while converting too, so that consumers loading the same map at
+	// the same time wait for one conversion rather than doing their own
+	static std::mutex mutex;
+	static std::map<std::string, std::weak_ptr<const EnvironmentCache>> loaded;
+	std::lock_guard<std::mutex> lock(mutex);
+	std::shared_ptr<const EnvironmentCache> shared = loaded[filename].lock();
+	if(shared)
+		return shared;
+
+	uint64_t source_bytes;
+	int64_t source_time;
+	if(!sourceStamp(filename, source_bytes, source_time))
+		return nullptr;
+	const std::string cache_filename = filename + ".envcache";
+	std::shared_ptr<EnvironmentCache> cache(new EnvironmentCache());
+	auto map = [&]() {
+		cache->m_file.reset(new MappedFile());
+		cache->mapped = cache->m_file->open(cache_filename)
+		                && cache->attach(cache->m_file->data(), cache->m_file->size(), source_bytes, source_time);
+		if(!cache->mapped)
+			cache->m_file.reset();
+		return cache->mapped;
+	};
+	if(!map())
+	{
+		const auto start = std::chrono::steady_clock::now();
+		CacheHeader header = {};
+		memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+		header.version = CACHE_VERSION;
+		header.header_bytes = sizeof(CacheHeader);
+		header.source_bytes = source_bytes;
+		header.source_time = source_time;
+		std::unique_ptr<uint8_t[]> converted = convert(filename, header);
+		if(converted == nullptr)
+			return nullptr;
+		const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		std::cout << "Converted " << filename << " (" << header.width << "x" << header.height << ") in " << seconds
+		          << " s\n";
+		if(!writeCache(cache_filename, converted.get(), size_t(header.file_bytes)) || !map())
+		{
+			std::cout << "Could not write " << cache_filename << ", keeping the environment cache in memory\n";
+			cache->m_memory = std::move(converted);
+			cache->attach(cache->m_memory.get(), size_t(header.file_bytes), source_bytes, source_time);
+		}
+	}
+	std::cout << "Environment cache: " << cache_filename << ", " << cache->bytes / (1024 * 1024) << " MiB"
+	          << (cache->mapped ? ", mapped" : "") << "\n";
+	loaded[filename] = cache;
+	return cache;
+}
+} // namespace pathtracer
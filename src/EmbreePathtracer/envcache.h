@@ -0,0 +1,72 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <glm/glm.hpp>
+#include "halffloat.h"
+
+namespace pathtracer
+{
+class MappedFile;
+
+///////////////////////////////////////////////////////////////////////////
+// A Radiance .hdr environment map, converted once into a binary cache
+// file next to it (<name>.hdr.envcache) which later runs map into memory
+// instead of decoding the .hdr again. The cache holds everything that is
+// derived from the map:
+//
+//  - the pixels as RGB half floats, divided by scale so that the brightest
+//    (usually the sun) fits in a half,
+//  - the alias tables that importance sample it (see HDRImage), and
+//  - its resampling into an octahedral map, as RGBA half floats in the
+//    tiled layout of OctahedralMap.
+//
+// Mapped pages are read from disk on first touch and shared with every
+// other process that maps the same file. Within a process, loading the
+// same file again returns the cache that is already loaded, so that every
+// consumer shares one copy.
+//
+// The cache is rebuilt when its version, or the size or modification time
+// of the .hdr it was converted from, differ. Byte order is the native
+// one, so the cache is not meant to be moved between architectures.
+///////////////////////////////////////////////////////////////////////////
+class EnvironmentCache
+{
+public:
+	// Returns null if the .hdr can't be read. If the cache can't be written
+	// it is built in memory instead.
+	static std::shared_ptr<const EnvironmentCache> load(const std::string& filename);
+	~EnvironmentCache();
+
+	int width = 0, height = 0;
+	float scale = 1.0f;
+	const uint16_t* pixels = nullptr; // RGB, the top row first
+
+	// The marginal distribution over rows, and one over the pixels of each
+	// row, width entries per row. See AliasTable.
+	const float* row_probability = nullptr;
+	const uint32_t* row_alias = nullptr;
+	const float* row_pdf = nullptr;
+	const float* column_probability = nullptr;
+	const uint32_t* column_alias = nullptr;
+	const float* column_pdf = nullptr;
+
+	int octahedral_size = 0;
+	const uint16_t* octahedral_texels = nullptr;
+
+	size_t bytes = 0; // Of all of the above
+	bool mapped = false;
+
+	glm::vec3 pixel(int x, int y) const
+	{
+		const uint16_t* p = &pixels[(size_t(y) * width + x) * 3];
+		return scale * glm::vec3(halfToFloat(p[0]), halfToFloat(p[1]), halfToFloat(p[2]));
+	}
+
+private:
+	bool attach(const uint8_t* data, size_t size, uint64_t source_bytes, int64_t source_time);
+	std::unique_ptr<MappedFile> m_file;
+	std::unique_ptr<uint8_t[]> m_memory; // When not mapped
+};
+} // namespace pathtracer
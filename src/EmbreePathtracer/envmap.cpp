@@ -0,0 +1,204 @@
+#include "envmap.h"
+#include "halffloat.h"
+#include <algorithm>
+#include <cmath>
+#include <emmintrin.h>
+
+using namespace glm;
+
+namespace pathtracer
+{
+///////////////////////////////////////////////////////////////////////////
+// The octahedral mapping, with y up. Folds the lower hemisphere out over
+// the corners of the square. Both take and return coordinates in [-1, 1].
+///////////////////////////////////////////////////////////////////////////
+static float signNotZero(float x)
+{
+	return x >= 0.0f ? 1.0f : -1.0f;
+}
+
+static vec3 octahedralDecode(float u, float v)
+{
+	const float y = 1.0f - std::abs(u) - std::abs(v);
+	if(y < 0.0f)
+	{
+		const float folded_u = (1.0f - std::abs(v)) * signNotZero(u);
+		v = (1.0f - std::abs(u)) * signNotZero(v);
+		u = folded_u;
+	}
+	return normalize(vec3(u, y, v));
+}
+
+int OctahedralMap::sizeFor(int lat_long_width)
+{
+	// About as many texels along the equator as the latitude-longitude map
+	// has, so the sharpest features of it (usually the sun) keep their size,
+	// up to 4096^2 texels (128 MB), which is finer than the lookups of
+	// anything but the camera rays need
+	return std::max(8, std::min(4096, (lat_long_width / 2 + 7) / 8 * 8));
+}
+
+size_t OctahedralMap::halvesFor(int size)
+{
+	const size_t tiles_x = size_t(size + 2 + 7) / 8;
+	return tiles_x * tiles_x * 64 * 4;
+}
+
+void OctahedralMap::resample(const float* lat_long, int width, int height, float scale, int size, uint16_t* texels)
+{
+	const float pi = 3.14159265f;
+	const int tiles_x = (size + 2 + 7) / 8;
+	std::fill(texels, texels + halvesFor(size), uint16_t(0));
+	auto texel = [texels, tiles_x](int x, int y) { return texels + texelIndex(tiles_x, x, y) * 4; };
+
+	#pragma omp parallel for
+	for(int y = 0; y < size; y++)
+	{
+		for(int x = 0; x < size; x++)
+		{
+			vec3 sum(0.0f);
+			for(int sample = 0; sample < 4; sample++)
+			{
+				const float u = (float(x) + 0.25f + 0.5f * float(sample & 1)) / float(size) * 2.0f - 1.0f;
+				const float v = (float(y) + 0.25f + 0.5f * float(sample >> 1)) / float(size) * 2.0f - 1.0f;
+				const vec3 d = octahedralDecode(u, v);
+				float phi = std::atan2(d.z, d.x);
+				if(phi < 0.0f)
+					phi += 2.0f * pi;
+				const float theta = std::acos(std::max(-1.0f, std::min(1.0f, d.y)));
+				const int px = int(phi / (2.0f * pi) * width) % width;
+				const int py = int(theta / pi * height) % height;
+				const float* pixel = &lat_long[(size_t(py) * width + px) * 3];
+				sum += vec3(pixel[0], pixel[1], pixel[2]);
+			}
+			uint16_t* t = texel(x, y);
+			t[0] = floatToHalf(0.25f * sum.x / scale);
+			t[1] = floatToHalf(0.25f * sum.y / scale);
+			t[2] = floatToHalf(0.25f * sum.z / scale);
+		}
+	}
+
+	// The border. Across each edge of the square the map continues
+	// mirrored around the middle of the edge, and the corners all meet at
+	// the bottom pole.
+	const int last = size - 1;
+	auto copy = [&texel](int x, int y, int from_x, int from_y) {
+		std::copy(texel(from_x, from_y), texel(from_x, from_y) + 4, texel(x, y));
+	};
+	for(int i = 0; i < size; i++)
+	{
+		copy(i, -1, last - i, 0);
+		copy(i, size, last - i, last);
+		copy(-1, i, 0, last - i);
+		copy(size, i, last, last - i);
+	}
+	copy(-1, -1, last, last);
+	copy(size, -1, 0, last);
+	copy(-1, size, last, 0);
+	copy(size, size, 0, 0);
+}
+
+void OctahedralMap::attach(int size, float scale, const uint16_t* texels)
+{
+	m_size = size;
+	m_tiles_x = (size + 2 + 7) / 8;
+	m_scale = scale;
+	m_texels = texels;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Lookups
+///////////////////////////////////////////////////////////////////////////
+void OctahedralMap::texelPosition(const vec3& d, float& s, float& t) const
+{
+	const float inv_l1 = 1.0f / (std::abs(d.x) + std::abs(d.y) + std::abs(d.z));
+	float u = d.x * inv_l1, v = d.z * inv_l1;
+	if(d.y < 0.0f)
+	{
+		const float folded_u = (1.0f - std::abs(v)) * signNotZero(u);
+		v = (1.0f - std::abs(u)) * signNotZero(v);
+		u = folded_u;
+	}
+	s = (u * 0.5f + 0.5f) * float(m_size) - 0.5f;
+	t = (v * 0.5f + 0.5f) * float(m_size) - 0.5f;
+}
+
+vec3 OctahedralMap::fetch(float s, float t, bool bilinear) const
+{
+	auto load = [this](int x, int y) {
+		return halfToFloat4(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(texel(x, y))));
+	};
+	__m128 color;
+	if(bilinear)
+	{
+		// s and t are within [-0.5, size - 0.5], so the four texels are
+		// within the border
+		const float fs = std::floor(s), ft = std::floor(t);
+		const int x = int(fs), y = int(ft);
+		const __m128 ws = _mm_set1_ps(s - fs), wt = _mm_set1_ps(t - ft);
+		const __m128 t00 = load(x, y), t10 = load(x + 1, y);
+		const __m128 t01 = load(x, y + 1), t11 = load(x + 1, y + 1);
+		const __m128 top = _mm_add_ps(t00, _mm_mul_ps(ws, _mm_sub_ps(t10, t00)));
+		const __m128 bottom = _mm_add_ps(t01, _mm_mul_ps(ws, _mm_sub_ps(t11, t01)));
+		color = _mm_add_ps(top, _mm_mul_ps(wt, _mm_sub_ps(bottom, top)));
+	}
+	else
+	{
+		const int x = std::min(int(s + 0.5f), m_size - 1);
+		const int y = std::min(int(t + 0.5f), m_size - 1);
+		color = load(x, y);
+	}
+	float rgba[4];
+	_mm_storeu_ps(rgba, _mm_mul_ps(color, _mm_set1_ps(m_scale)));
+	return vec3(rgba[0], rgba[1], rgba[2]);
+}
+
+vec3 OctahedralMap::lookup(const vec3& d, bool bilinear) const
+{
+	float s, t;
+	texelPosition(d, s, t);
+	return fetch(s, t, bilinear);
+}
+
+void OctahedralMap::lookup(const float* const d[3], size_t count, float* const radiance[3], bool bilinear) const
+{
+	const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f);
+	const __m128 sign_bit = _mm_set1_ps(-0.0f);
+	const __m128 scale = _mm_set1_ps(0.5f * float(m_size));
+	const __m128 offset = _mm_set1_ps(0.5f * float(m_size) - 0.5f);
+	size_t i = 0;
+	for(; i + 4 <= count; i += 4)
+	{
+		const __m128 x = _mm_loadu_ps(d[0] + i), y = _mm_loadu_ps(d[1] + i), z = _mm_loadu_ps(d[2] + i);
+		const __m128 abs_x = _mm_andnot_ps(sign_bit, x), abs_z = _mm_andnot_ps(sign_bit, z);
+		const __m128 inv_l1 = _mm_div_ps(one, _mm_add_ps(_mm_add_ps(abs_x, _mm_andnot_ps(sign_bit, y)), abs_z));
+		const __m128 u = _mm_mul_ps(x, inv_l1), v = _mm_mul_ps(z, inv_l1);
+		// The fold: (1 - |v|, 1 - |u|) with the sign bits of (u, v). Unlike
+		// signNotZero() that makes -0 negative, but on the fold line both
+		// sides are the same direction.
+		const __m128 abs_u = _mm_andnot_ps(sign_bit, u), abs_v = _mm_andnot_ps(sign_bit, v);
+		const __m128 folded_u = _mm_or_ps(_mm_sub_ps(one, abs_v), _mm_and_ps(sign_bit, u));
+		const __m128 folded_v = _mm_or_ps(_mm_sub_ps(one, abs_u), _mm_and_ps(sign_bit, v));
+		const __m128 lower = _mm_cmplt_ps(y, zero);
+		const __m128 final_u = _mm_or_ps(_mm_and_ps(lower, folded_u), _mm_andnot_ps(lower, u));
+		const __m128 final_v = _mm_or_ps(_mm_and_ps(lower, folded_v), _mm_andnot_ps(lower, v));
+		float s[4], t[4];
+		_mm_storeu_ps(s, _mm_add_ps(_mm_mul_ps(final_u, scale), offset));
+		_mm_storeu_ps(t, _mm_add_ps(_mm_mul_ps(final_v, scale), offset));
+		for(int lane = 0; lane < 4; lane++)
+		{
+			const vec3 color = fetch(s[lane], t[lane], bilinear);
+			radiance[0][i + lane] = color.x;
+			radiance[1][i + lane] = color.y;
+			radiance[2][i + lane] = color.z;
+		}
+	}
+	for(; i < count; i++)
+	{
+		const vec3 color = lookup(vec3(d[0][i], d[1][i], d[2][i]), bilinear);
+		radiance[0][i] = color.x;
+		radiance[1][i] = color.y;
+		radiance[2][i] = color.z;
+	}
+}
+} // namespace pathtracer
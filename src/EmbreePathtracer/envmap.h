@@ -0,0 +1,73 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <glm/glm.hpp>
+
+namespace pathtracer
+{
+///////////////////////////////////////////////////////////////////////////
+// The environment map resampled into an octahedral layout: the sphere is
+// projected onto an octahedron, whose lower half is folded out over the
+// upper, giving a square. Finding the texel of a direction then takes
+// absolute values, one divide and a fold, instead of the acos and atan2
+// of the latitude-longitude layout.
+//
+// Texels are stored as RGBA half floats, so one 64 bit load reads a
+// texel, in tiles of 8x8 texels, so that the four texels of a bilinear
+// lookup (and lookups of nearby directions) mostly share cache lines. A
+// one texel border holds the texels across each edge of the square,
+// which meet mirrored, so that bilinear filtering needs no wrapping.
+//
+// The texels are resampled once, into the environment cache (see
+// envcache.h), and the map only looks them up from there.
+///////////////////////////////////////////////////////////////////////////
+class OctahedralMap
+{
+public:
+	// The size to resample a latitude-longitude map of a width to, and the
+	// number of halves that the texels of a map of a size take
+	static int sizeFor(int lat_long_width);
+	static size_t halvesFor(int size);
+	// Resample a latitude-longitude map of RGB floats, with 2x2 samples
+	// per texel, into texels holding the radiance divided by scale
+	static void resample(const float* lat_long, int width, int height, float scale, int size, uint16_t* texels);
+
+	// Look up in texels resampled as above, which must outlive the map
+	void attach(int size, float scale, const uint16_t* texels);
+	bool empty() const
+	{
+		return m_texels == nullptr;
+	}
+	size_t memoryBytes() const
+	{
+		return halvesFor(m_size) * sizeof(uint16_t);
+	}
+
+	// The radiance in direction d, which needn't be normalized
+	glm::vec3 lookup(const glm::vec3& d, bool bilinear) const;
+	// The same for count directions at once, in SoA form. The directions
+	// are mapped to texels four at a time with SSE.
+	void lookup(const float* const d[3], size_t count, float* const radiance[3], bool bilinear) const;
+
+private:
+	// Texel coordinates of a direction, with texel centers at integers
+	void texelPosition(const glm::vec3& d, float& s, float& t) const;
+	glm::vec3 fetch(float s, float t, bool bilinear) const;
+	static size_t texelIndex(int tiles_x, int x, int y)
+	{
+		// Shift past the border
+		x += 1;
+		y += 1;
+		return size_t((y >> 3) * tiles_x + (x >> 3)) * 64 + (y & 7) * 8 + (x & 7);
+	}
+	const uint16_t* texel(int x, int y) const
+	{
+		return m_texels + texelIndex(m_tiles_x, x, y) * 4;
+	}
+
+	int m_size = 0;    // Texels along each side, without the border
+	int m_tiles_x = 0; // Tiles along each side, with the border
+	float m_scale = 1.0f;
+	const uint16_t* m_texels = nullptr;
+};
+} // namespace pathtracer
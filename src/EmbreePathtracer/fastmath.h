@@ -0,0 +1,173 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+///////////////////////////////////////////////////////////////////////////
+// The transcendental functions used while shading. When built with
+// PATHTRACER_FAST_MATH (the PATHTRACER_FAST_MATH option in CMake) they are
+// branch free polynomial approximations, which the compiler can inline
+// and vectorize instead of calling libm. Otherwise they call the float
+// versions in libm. The largest errors of the approximations, measured
+// against double precision over their whole domain, are:
+//   fastLog2     2e-7 absolute, plus the rounding of the exponent part
+//   fastExp2     3e-7 relative
+//   fastPow      3e-7 * |y * log2(x)| relative, e.g. 0.03% for a result
+//                of 2^-1000 (which is 0 as a float anyway)
+//   fastSinCos   4e-7 absolute for |x| <= 1000
+//   fastAcos     7e-5 radians
+//   fastAtan2    2e-6 radians
+///////////////////////////////////////////////////////////////////////////
+namespace pathtracer
+{
+// x^5 by multiplication, in both modes
+inline float pow5(float x)
+{
+	const float x2 = x * x;
+	return x2 * x2 * x;
+}
+
+#ifdef PATHTRACER_FAST_MATH
+
+inline float floatFromBits(uint32_t i)
+{
+	float f;
+	memcpy(&f, &i, sizeof(f));
+	return f;
+}
+
+inline uint32_t bitsFromFloat(float f)
+{
+	uint32_t i;
+	memcpy(&i, &f, sizeof(i));
+	return i;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// log2(x) for x > 0. The mantissa m is taken into [sqrt(1/2), sqrt(2)),
+// where ln(m) = 2 atanh((m - 1) / (m + 1)) converges fast and stays
+// accurate for x close to 1. Returns -126 for x <= 0 and denormals.
+///////////////////////////////////////////////////////////////////////////
+inline float fastLog2(float x)
+{
+	const uint32_t bits = bitsFromFloat(x);
+	int exponent = int((bits >> 23) & 0xff) - 127;
+	float m = floatFromBits((bits & 0x007fffffu) | 0x3f800000u);
+	const bool high = m > 1.41421356f;
+	m = high ? 0.5f * m : m;
+	exponent += high ? 1 : 0;
+	const float t = (m - 1.0f) / (m + 1.0f);
+	const float t2 = t * t;
+	const float ln_m = 2.0f * t * (1.0f + t2 * (1.0f / 3.0f + t2 * (1.0f / 5.0f + t2 * (1.0f / 7.0f))));
+	return x > 1.17549435e-38f ? float(exponent) + 1.44269504f * ln_m : -126.0f;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// 2^x, by splitting x into an integer, which goes straight into the
+// exponent bits, and a fraction in [-1/2, 1/2] for a Taylor polynomial.
+// Flushes to 0 below 2^-126 and saturates at 2^127.
+///////////////////////////////////////////////////////////////////////////
+inline float fastExp2(float x)
+{
+	x = std::min(std::max(x, -127.0f), 127.0f);
+	const float i = std::floor(x + 0.5f);
+	const float f = (x - i) * 0.69314718f;
+	const float p =
+	    1.0f
+	    + f * (1.0f + f * (1.0f / 2.0f + f * (1.0f / 6.0f + f * (1.0f / 24.0f + f * (1.0f / 120.0f + f * (1.0f / 720.0f))))));
+	const float scale = floatFromBits(uint32_t(int(i) + 127) << 23);
+	return x > -126.0f ? p * scale : 0.0f;
+}
+
+// x^y for x >= 0
+inline float fastPow(float x, float y)
+{
+	return x > 0.0f ? fastExp2(y * fastLog2(x)) : (y == 0.0f ? 1.0f : 0.0f);
+}
+
+///////////////////////////////////////////////////////////////////////////
+// sin and cos of x. x is reduced to [-pi/4, pi/4] around the nearest
+// multiple q of pi/2, where Taylor polynomials are good to a float ulp or
+// so, and the quadrant q picks which of them is which. The reduction
+// loses accuracy as q grows: 1e-6 at |x| = 2^16, and 0.03 at 2^20.
+///////////////////////////////////////////////////////////////////////////
+inline void fastSinCos(float x, float& s, float& c)
+{
+	const float q = std::floor(x * 0.63661977f + 0.5f);
+	// pi/2 in two parts, so that x - q pi/2 is exact for moderate q
+	const float r = (x - q * 1.5703125f) - q * 4.83826794e-4f;
+	const float r2 = r * r;
+	const float sin_r = r * (1.0f + r2 * (-1.0f / 6.0f + r2 * (1.0f / 120.0f + r2 * (-1.0f / 5040.0f))));
+	const float cos_r =
+	    1.0f + r2 * (-1.0f / 2.0f + r2 * (1.0f / 24.0f + r2 * (-1.0f / 720.0f + r2 * (1.0f / 40320.0f))));
+	const int quadrant = int(q) & 3;
+	const float sin_x = (quadrant & 1) ? cos_r : sin_r;
+	const float cos_x = (quadrant & 1) ? sin_r : cos_r;
+	s = (quadrant & 2) ? -sin_x : sin_x;
+	c = ((quadrant + 1) & 2) ? -cos_x : cos_x;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// acos(x) for x in [-1, 1], Abramowitz and Stegun 4.4.45
+///////////////////////////////////////////////////////////////////////////
+inline float fastAcos(float x)
+{
+	const float a = std::min(std::abs(x), 1.0f);
+	const float r = std::sqrt(1.0f - a) * (1.5707288f + a * (-0.2121144f + a * (0.0742610f + a * -0.0187293f)));
+	return x < 0.0f ? 3.14159265f - r : r;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// atan2(y, x) in [-pi, pi]. An odd minimax polynomial gives atan on
+// [0, 1], and the octant of (x, y) unfolds it.
+///////////////////////////////////////////////////////////////////////////
+inline float fastAtan2(float y, float x)
+{
+	const float ax = std::abs(x), ay = std::abs(y);
+	const float big = std::max(ax, ay);
+	const float t = big > 0.0f ? std::min(ax, ay) / big : 0.0f;
+	const float t2 = t * t;
+	float a = t
+	          * (0.99997726f
+	             + t2 * (-0.33262347f + t2 * (0.19354346f + t2 * (-0.11643287f + t2 * (0.05265332f + t2 * -0.01172120f)))));
+	a = ay > ax ? 1.57079633f - a : a;
+	a = x < 0.0f ? 3.14159265f - a : a;
+	return y < 0.0f ? -a : a;
+}
+
+#else
+
+inline float fastLog2(float x)
+{
+	return std::log2(x);
+}
+
+inline float fastExp2(float x)
+{
+	return std::exp2(x);
+}
+
+inline float fastPow(float x, float y)
+{
+	return std::pow(x, y);
+}
+
+inline void fastSinCos(float x, float& s, float& c)
+{
+	s = std::sin(x);
+	c = std::cos(x);
+}
+
+inline float fastAcos(float x)
+{
+	return std::acos(x);
+}
+
+inline float fastAtan2(float y, float x)
+{
+	return std::atan2(y, x);
+}
+
+#endif
+} // namespace pathtracer
@@ -0,0 +1,71 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <emmintrin.h>
+
+namespace pathtracer
+{
+///////////////////////////////////////////////////////////////////////////
+// IEEE 754 half precision floats: 1 sign, 5 exponent and 10 mantissa
+// bits, so about three significant digits up to 65504. Plenty for
+// radiance, at half the memory and bandwidth of floats.
+///////////////////////////////////////////////////////////////////////////
+const float HALF_MAX = 65504.0f;
+
+// Rounds to nearest even. Values beyond HALF_MAX saturate to it rather
+// than turning into infinity.
+inline uint16_t floatToHalf(float f)
+{
+	uint32_t x;
+	memcpy(&x, &f, sizeof(x));
+	const uint16_t sign = uint16_t((x >> 16) & 0x8000);
+	x &= 0x7fffffff;
+	if(x > 0x7f800000)
+		return sign | 0x7e00; // NaN
+	if(x >= 0x477ff000)
+		return sign | 0x7bff; // Rounds to beyond HALF_MAX
+	if(x < 0x38800000)
+	{
+		// Denormal or zero as a half. Adding 0.5 lines the mantissa up
+		// with that of the half, and rounds it.
+		float a;
+		memcpy(&a, &x, sizeof(a));
+		a += 0.5f;
+		memcpy(&x, &a, sizeof(x));
+		return sign | uint16_t(x - 0x3f000000);
+	}
+	// Rebias the exponent and round away the lower 13 mantissa bits
+	x += (uint32_t(15 - 127) << 23) + 0xfff + ((x >> 13) & 1);
+	return sign | uint16_t(x >> 13);
+}
+
+// Shifting the exponent and mantissa into place gives the value scaled by
+// 2^-112, the difference of the exponent biases, denormals included
+inline float halfToFloat(uint16_t h)
+{
+	const uint32_t exponent_mantissa = uint32_t(h & 0x7fff) << 13;
+	float f;
+	memcpy(&f, &exponent_mantissa, sizeof(f));
+	f *= 5.192296858534828e33f; // 2^112
+	uint32_t x;
+	memcpy(&x, &f, sizeof(x));
+	if(exponent_mantissa >= (0x7c00u << 13))
+		x |= 0x7f800000; // Infinity or NaN
+	x |= uint32_t(h & 0x8000) << 16;
+	memcpy(&f, &x, sizeof(f));
+	return f;
+}
+
+// Four at a time, from the lower 64 bits of h, with SSE2 only (F16C has an
+// instruction for it, but isn't available everywhere)
+inline __m128 halfToFloat4(__m128i h)
+{
+	const __m128i x = _mm_unpacklo_epi16(h, _mm_setzero_si128());
+	const __m128i exponent_mantissa = _mm_slli_epi32(_mm_and_si128(x, _mm_set1_epi32(0x7fff)), 13);
+	__m128 f = _mm_mul_ps(_mm_castsi128_ps(exponent_mantissa), _mm_set1_ps(5.192296858534828e33f));
+	const __m128i special = _mm_cmpgt_epi32(exponent_mantissa, _mm_set1_epi32((0x7c00 << 13) - 1));
+	f = _mm_or_ps(f, _mm_castsi128_ps(_mm_and_si128(special, _mm_set1_epi32(0x7f800000))));
+	const __m128i sign = _mm_slli_epi32(_mm_and_si128(x, _mm_set1_epi32(0x8000)), 16);
+	return _mm_or_ps(f, _mm_castsi128_ps(sign));
+}
+} // namespace pathtracer
@@ -12,6 +12,8 @@
 #include <string>
 #include "Pathtracer.h"
 #include "embree.h"
+#include "sampling.h"
+#include "brdf_simd.h"
 
 using namespace glm;
 using namespace std;
@@ -50,6 +52,30 @@ vec3 worldUp(0.0f, 1.0f, 0.0f);
 // Models
 ///////////////////////////////////////////////////////////////////////////////
 vector<pair<labhelper::Model*, mat4>> models;
+vector<uint32_t> model_instances; // The pathtracer instance of each model
+
+///////////////////////////////////////////////////////////////////////////////
+// The pathtracer keeps the vertices of the models in buffers it shares
+// with the accelerator, so we drop our copy of the positions and only get
+// them back while something needs them. None of the models are deformable.
+///////////////////////////////////////////////////////////////////////////////
+void releaseModelPositions()
+{
+	if(!pathtracer::geometry_settings.share_buffers)
+		return;
+	for(auto& m : models)
+	{
+		vector<vec3>().swap(m.first->m_positions);
+	}
+}
+
+void restoreModelPositions()
+{
+	for(auto& m : models)
+	{
+		pathtracer::restoreModelPositions(m.first);
+	}
+}
 
 ///////////////////////////////////////////////////////////////////////////////
 // Load shaders, environment maps, models and so on
@@ -67,6 +93,15 @@ void initialize()
 	///////////////////////////////////////////////////////////////////////////
 	pathtracer::settings.max_bounces = 8;
 	pathtracer::settings.max_paths_per_pixel = 0; // 0 = Infinite
+	pathtracer::settings.integrator = pathtracer::INTEGRATOR_DEPTH_FIRST;
+	pathtracer::settings.ray_streams = true;
+	pathtracer::settings.reorder_rays = true;
+	pathtracer::settings.specialize_integrator = true;
+	pathtracer::settings.simd_shading = true;
+	pathtracer::settings.russian_roulette = true;
+	pathtracer::settings.roulette_start_bounce = 3;
+	pathtracer::settings.roulette_min_survival = 0.05f;
+	pathtracer::settings.emissive_light_sampling = true;
 #ifdef _DEBUG
 	pathtracer::settings.subsampling = 16;
 #else
@@ -83,7 +118,7 @@ void initialize()
 	///////////////////////////////////////////////////////////////////////////
 	// Load environment map
 	///////////////////////////////////////////////////////////////////////////
-	pathtracer::environment.map.load("../../../scenes/envmaps/001.hdr");
+	pathtracer::loadEnvironment("../../../scenes/envmaps/001.hdr");
 	pathtracer::environment.multiplier = 1.0f;
 
 	///////////////////////////////////////////////////////////////////////////
@@ -97,11 +132,14 @@ void initialize()
 	///////////////////////////////////////////////////////////////////////////
 	// Add models to pathtracer scene
 	///////////////////////////////////////////////////////////////////////////
+	pathtracer::geometry_settings.weld_vertices = true;
+	pathtracer::geometry_settings.share_buffers = true;
 	for(auto m : models)
 	{
-		pathtracer::addModel(m.first, m.second);
+		model_instances.push_back(pathtracer::addModel(m.first, m.second));
 	}
 	pathtracer::buildBVH();
+	releaseModelPositions();
 
 	///////////////////////////////////////////////////////////////////////////
 	// Generate result texture
@@ -139,6 +177,14 @@ void display(void)
 		}
 	}
 
+	///////////////////////////////////////////////////////////////////////////
+	// Update the BVH if any model has been moved
+	///////////////////////////////////////////////////////////////////////////
+	if(pathtracer::commitSceneUpdates())
+	{
+		pathtracer::restart();
+	}
+
 	///////////////////////////////////////////////////////////////////////////
 	// Trace one path per pixel
 	///////////////////////////////////////////////////////////////////////////
@@ -312,10 +358,91 @@ void gui()
 		ImGui::SliderInt("Subsampling", &pathtracer::settings.subsampling, 1, 16);
 		ImGui::SliderInt("Max Bounces", &pathtracer::settings.max_bounces, 0, 16);
 		ImGui::SliderInt("Max Paths Per Pixel", &pathtracer::settings.max_paths_per_pixel, 0, 1024);
+		bool roulette_changed = ImGui::Checkbox("Russian roulette", &pathtracer::settings.russian_roulette);
+		if(pathtracer::settings.russian_roulette)
+		{
+			roulette_changed |=
+			    ImGui::SliderInt("Roulette start bounce", &pathtracer::settings.roulette_start_bounce, 1, 16);
+			roulette_changed |= ImGui::SliderFloat("Roulette min survival", &pathtracer::settings.roulette_min_survival,
+			                                       0.01f, 1.0f);
+		}
+		if(roulette_changed)
+		{
+			pathtracer::restart();
+		}
+		// The ### keeps the checkbox's id when the count changes
+		const std::string emissive_label = "Sample emissive triangles ("
+		                                   + std::to_string(pathtracer::emissive_lights.triangles.size())
+		                                   + ")###emissive";
+		if(ImGui::Checkbox(emissive_label.c_str(), &pathtracer::settings.emissive_light_sampling))
+		{
+			pathtracer::restart();
+		}
+		ImGui::Combo("Integrator", &pathtracer::settings.integrator, "Depth first\0Wavefront\0");
+		if(ImGui::Combo("Sampler", &pathtracer::sampling_settings.sampler, pathtracer::SAMPLER_NAMES,
+		                pathtracer::SAMPLER_NUMBER_OF_TYPES))
+		{
+			pathtracer::restart();
+		}
+		bool rebuild = ImGui::Combo("Accelerator", &pathtracer::geometry_settings.accelerator,
+		                            pathtracer::ACCELERATOR_NAMES, pathtracer::ACCELERATOR_NUMBER_OF_TYPES);
+		rebuild |= ImGui::Combo("BVH quality", &pathtracer::geometry_settings.bvh_quality,
+		                        pathtracer::BVH_QUALITY_NAMES, pathtracer::BVH_NUMBER_OF_QUALITIES);
+		rebuild |= ImGui::Checkbox("Compress geometry", &pathtracer::geometry_settings.compress_geometry);
+		if(rebuild)
+		{
+			restoreModelPositions();
+			pathtracer::rebuildBVH();
+			releaseModelPositions();
+			pathtracer::restart();
+		}
+		ImGui::Text("BVH build %.1f ms, %.1f MiB", pathtracer::bvh_stats.build_time_ms,
+		            pathtracer::bvh_stats.memory_bytes / (1024.0f * 1024.0f));
+		ImGui::Text("Shading records %.1f MiB", pathtracer::bvh_stats.shading_bytes / (1024.0f * 1024.0f));
+		ImGui::Checkbox("Trace ray streams", &pathtracer::settings.ray_streams);
+		ImGui::Checkbox("Reorder ray streams", &pathtracer::settings.reorder_rays);
+		ImGui::Checkbox("Specialize integrator", &pathtracer::settings.specialize_integrator);
+		if(pathtracer::settings.integrator == pathtracer::INTEGRATOR_WAVEFRONT)
+		{
+			const std::string label = std::string("SIMD shading (")
+			                          + pathtracer::BRDF_KERNEL_ISA_NAMES[pathtracer::bestBRDFKernels().isa] + ")";
+			ImGui::Checkbox(label.c_str(), &pathtracer::settings.simd_shading);
+		}
+		const pathtracer::IntegratorFeatures& features = pathtracer::integrator_stats.features;
+		ImGui::Text("%.1f ms per sample (light %s, environment %s, emission %s, bounces %s)",
+		            pathtracer::integrator_stats.trace_time_ms, features.direct_light ? "on" : "off",
+		            features.environment_light ? "on" : "off", features.emission ? "on" : "off",
+		            features.bounces > 0 ? "fixed" : "runtime");
 		if(ImGui::Button("Restart Pathtracing"))
 		{
 			pathtracer::restart();
 		}
+		///////////////////////////////////////////////////////////////////////
+		// Store a converged image, then change a setting (e.g. compress the
+		// geometry) and see how far the new image is from it
+		///////////////////////////////////////////////////////////////////////
+		if(ImGui::Button("Store Reference Image"))
+		{
+			pathtracer::storeReferenceImage();
+		}
+		ImGui::SameLine();
+		if(ImGui::Button("Save Reference"))
+		{
+			pathtracer::saveReferenceImage("reference.pfm");
+		}
+		ImGui::SameLine();
+		if(ImGui::Button("Load Reference"))
+		{
+			pathtracer::loadReferenceImage("reference.pfm");
+		}
+		float reference_error = pathtracer::referenceError();
+		if(reference_error >= 0.0f)
+		{
+			// Noise against time spent: higher is better
+			const float seconds = pathtracer::integrator_stats.total_time_ms / 1000.0f;
+			ImGui::Text("RMSE vs reference %.5f after %.1f s, efficiency %.1f", reference_error, seconds,
+			            1.0f / (reference_error * reference_error * seconds));
+		}
 	}
 
 	///////////////////////////////////////////////////////////////////////////
@@ -335,6 +462,24 @@ void gui()
 			material_index = model->m_meshes[mesh_index].m_material_idx;
 		}
 
+		///////////////////////////////////////////////////////////////////////////
+		// Move the selected model, or spin it around like on a turntable
+		///////////////////////////////////////////////////////////////////////////
+		static bool turntable = false;
+		mat4& model_matrix = models[model_index].second;
+		bool moved = ImGui::DragFloat3("Position", &model_matrix[3].x, 0.1f);
+		ImGui::Checkbox("Turntable", &turntable);
+		if(turntable)
+		{
+			model_matrix = model_matrix * rotate(0.5f * deltaTime, worldUp);
+			moved = true;
+		}
+		if(moved)
+		{
+			pathtracer::setInstanceTransform(model_instances[model_index], model_matrix);
+		}
+		ImGui::Text("Last BVH update %.2f ms", pathtracer::bvh_stats.update_time_ms);
+
 		///////////////////////////////////////////////////////////////////////////
 		// List all meshes in the model and show properties for the selected
 		///////////////////////////////////////////////////////////////////////////
@@ -359,6 +504,8 @@ void gui()
 			                int(model->m_materials.size())))
 			{
 				mesh.m_material_idx = material_index;
+				pathtracer::updateMaterials();
+				pathtracer::restart();
 			}
 		}
 
@@ -376,20 +523,26 @@ void gui()
 			{
 				material.m_name = name;
 			}
-			ImGui::ColorEdit3("Color", &material.m_color.x);
-			ImGui::SliderFloat("Reflectivity", &material.m_reflectivity, 0.0f, 1.0f);
-			ImGui::SliderFloat("Metalness", &material.m_metalness, 0.0f, 1.0f);
-			ImGui::SliderFloat("Fresnel", &material.m_fresnel, 0.0f, 1.0f);
-			ImGui::SliderFloat("shininess", &material.m_shininess, 0.0f, 25000.0f);
-			ImGui::SliderFloat("Emission", &material.m_emission, 0.0f, 10.0f);
-			ImGui::SliderFloat("Transparency", &material.m_transparency, 0.0f, 1.0f);
+			bool edited = ImGui::ColorEdit3("Color", &material.m_color.x);
+			edited |= ImGui::SliderFloat("Reflectivity", &material.m_reflectivity, 0.0f, 1.0f);
+			edited |= ImGui::SliderFloat("Metalness", &material.m_metalness, 0.0f, 1.0f);
+			edited |= ImGui::SliderFloat("Fresnel", &material.m_fresnel, 0.0f, 1.0f);
+			edited |= ImGui::SliderFloat("shininess", &material.m_shininess, 0.0f, 25000.0f);
+			edited |= ImGui::SliderFloat("Emission", &material.m_emission, 0.0f, 10.0f);
+			edited |= ImGui::SliderFloat("Transparency", &material.m_transparency, 0.0f, 1.0f);
+			if(edited)
+			{
+				pathtracer::compileMaterials();
+			}
 
 			///////////////////////////////////////////////////////////////////////////
 			// A button for saving your results
 			///////////////////////////////////////////////////////////////////////////
 			if(ImGui::Button("Save Materials"))
 			{
+				pathtracer::restoreModelPositions(model);
 				labhelper::saveModelToOBJ(model, model->m_filename);
+				releaseModelPositions();
 			}
 		}
 	}
@@ -400,6 +553,10 @@ void gui()
 	if(ImGui::CollapsingHeader("Light sources", "lights_ch", true, true))
 	{
 		ImGui::SliderFloat("Environment multiplier", &pathtracer::environment.multiplier, 0.0f, 10.0f);
+		if(ImGui::Checkbox("Bilinear environment", &pathtracer::environment.bilinear))
+		{
+			pathtracer::restart();
+		}
 		ImGui::ColorEdit3("Point light color", &pathtracer::point_light.color.x);
 		ImGui::SliderFloat("Point light intensity multiplier", &pathtracer::point_light.intensity_multiplier,
 		                   0.0f, 10000.0f);
@@ -411,8 +568,89 @@ void gui()
 	ImGui::Render();
 }
 
+///////////////////////////////////////////////////////////////////////////////
+// Command line options:
+//   --bvh <default|fast|high-quality|compact|robust>   BVH build quality
+//   --accelerator <embree|bvh8>                        Ray tracing kernel
+//   --compress                                         Compress the geometry
+//   --sampler <independent|stratified|sobol|blue-noise> Random number sampler
+//   --reference <file.pfm>                             Image to print the error against
+///////////////////////////////////////////////////////////////////////////////
+void parseArguments(int argc, char* argv[])
+{
+	for(int i = 1; i < argc; i++)
+	{
+		string arg = argv[i];
+		if(arg == "--bvh" && i + 1 < argc)
+		{
+			string quality = argv[++i];
+			bool found = false;
+			for(int q = 0; q < pathtracer::BVH_NUMBER_OF_QUALITIES; q++)
+			{
+				if(quality == pathtracer::BVH_QUALITY_NAMES[q])
+				{
+					pathtracer::geometry_settings.bvh_quality = q;
+					found = true;
+				}
+			}
+			if(!found)
+			{
+				cout << "Unknown BVH quality: " << quality << "\n";
+			}
+		}
+		else if(arg == "--accelerator" && i + 1 < argc)
+		{
+			string accelerator = argv[++i];
+			bool found = false;
+			for(int a = 0; a < pathtracer::ACCELERATOR_NUMBER_OF_TYPES; a++)
+			{
+				if(accelerator == pathtracer::ACCELERATOR_NAMES[a])
+				{
+					pathtracer::geometry_settings.accelerator = a;
+					found = true;
+				}
+			}
+			if(!found)
+			{
+				cout << "Unknown accelerator: " << accelerator << "\n";
+			}
+		}
+		else if(arg == "--sampler" && i + 1 < argc)
+		{
+			string sampler = argv[++i];
+			bool found = false;
+			for(int s = 0; s < pathtracer::SAMPLER_NUMBER_OF_TYPES; s++)
+			{
+				if(sampler == pathtracer::SAMPLER_NAMES[s])
+				{
+					pathtracer::sampling_settings.sampler = s;
+					found = true;
+				}
+			}
+			if(!found)
+			{
+				cout << "Unknown sampler: " << sampler << "\n";
+			}
+		}
+		else if(arg == "--reference" && i + 1 < argc)
+		{
+			pathtracer::loadReferenceImage(argv[++i]);
+		}
+		else if(arg == "--compress")
+		{
+			pathtracer::geometry_settings.compress_geometry = true;
+		}
+		else
+		{
+			cout << "Unknown argument: " << arg << "\n";
+		}
+	}
+}
+
 int main(int argc, char* argv[])
 {
+	parseArguments(argc, argv);
+
 	g_window = labhelper::init_window_SDL("Pathtracer", 1280, 720);
 
 	initialize();
@@ -1,57 +1,60 @@
 #include "material.h"
 #include "sampling.h"
+#include "fastmath.h"
 
 namespace pathtracer
 {
 	///////////////////////////////////////////////////////////////////////////
-	// A Lambertian (diffuse) material
+	// Compile a material into the lobes with non-zero weight. How likely a
+	// lobe is to be sampled follows a rough estimate of how much light it
+	// reflects; Schlick's Fresnel averaged over the hemisphere is
+	// R0 + (1 - R0) / 21.
 	///////////////////////////////////////////////////////////////////////////
-	vec3 Diffuse::f(const vec3& wi, const vec3& wo, const vec3& n)
+	MaterialClosure compileMaterial(const labhelper::Material& material)
 	{
-		if (dot(wi, n) <= 0.0f)
-			return vec3(0.0f);
-		if (!sameHemisphere(wi, wo, n))
-			return vec3(0.0f);
-		return (1.0f / M_PI) * color;
-	}
-
-	vec3 Diffuse::sample_wi(vec3& wi, const vec3& wo, const vec3& n, float& p)
-	{
-		vec3 tangent = normalize(perpendicular(n));
-		vec3 bitangent = normalize(cross(tangent, n));
-		vec3 sample = cosineSampleHemisphere();
-		wi = normalize(sample.x * tangent + sample.y * bitangent + sample.z * n);
-		if (dot(wi, n) <= 0.0f)
-			p = 0.0f;
-		else
-			p = max(0.0f, dot(n, wi)) / M_PI;
-		return f(wi, wo, n);
-	}
-
-	///////////////////////////////////////////////////////////////////////////
-	// A Blinn Phong Dielectric Microfacet BRFD
-	///////////////////////////////////////////////////////////////////////////
-	vec3 BlinnPhong::refraction_brdf(const vec3& wi, const vec3& wo, const vec3& n)
-	{
-		if (refraction_layer != NULL)
+		MaterialClosure closure;
+		closure.shininess = material.m_shininess;
+		closure.R0 = material.m_fresnel;
+		closure.emission = material.m_emission * material.m_color;
+		const float r = material.m_reflectivity;
+		const float m = material.m_metalness;
+		const float average_F = closure.R0 + (1.0f - closure.R0) / 21.0f;
+		const struct
 		{
-			vec3 wh = normalize(wi + wo);
-			float WhWi = abs(dot(wh, wi));
-			float F = R0 + ((1.0 - R0) * pow(1.0 - WhWi, 5.0));
-
-			return vec3((1.0f - F)) * refraction_layer->f(wi, wo, n);
+			LobeType type;
+			vec3 weight;
+			float albedo;
+		} candidates[MAX_LOBES] = {
+			{ LOBE_BLINN_PHONG, r * (m * material.m_color + (1.0f - m) * vec3(1.0f)), average_F },
+			{ LOBE_COATED_DIFFUSE, (r * (1.0f - m) / float(M_PI)) * material.m_color, float(M_PI) * (1.0f - average_F) },
+			{ LOBE_DIFFUSE, ((1.0f - r) / float(M_PI)) * material.m_color, float(M_PI) },
+		};
+		float total = 0.0f;
+		for (const auto& candidate : candidates)
+		{
+			if (candidate.weight == vec3(0.0f))
+				continue;
+			Lobe& lobe = closure.lobes[closure.number_of_lobes++];
+			lobe.type = candidate.type;
+			lobe.weight = candidate.weight;
+			total += candidate.albedo * (candidate.weight.x + candidate.weight.y + candidate.weight.z) + 1e-6f;
+			lobe.cdf = total;
 		}
-
-		return vec3(0.0f);
+		for (int i = 0; i < closure.number_of_lobes; i++)
+		{
+			closure.lobes[i].cdf /= total;
+		}
+		if (closure.number_of_lobes > 0)
+			closure.lobes[closure.number_of_lobes - 1].cdf = 1.0f;
+		return closure;
 	}
 
-	// TASK 3: Blinn Phong BRDF
-	vec3 BlinnPhong::reflection_brdf(const vec3& wi, const vec3& wo, const vec3& n)
+	///////////////////////////////////////////////////////////////////////////
+	// The Blinn Phong microfacet BRDF, and the pdf of sampling wi by
+	// reflecting wo around a half vector drawn from its distribution
+	///////////////////////////////////////////////////////////////////////////
+	static float blinnPhong(const vec3& wi, const vec3& wo, const vec3& n, float shininess, float R0)
 	{
-
-		if (dot(n, wi) <= 0.0f)
-			return vec3(0.0f);
-
 		vec3 wh = normalize(wi + wo);
 
 		float WhWi = abs(dot(wh, wi));
@@ -60,103 +63,107 @@ namespace pathtracer
 		float WoWh = dot(wo, wh);
 		float NWo = dot(n, wo);
 
-		float F = R0 + ((1.0 - R0) * pow(1.0 - WhWi, 5.0));
-
-		//return vec3(F);
+		if (NWo <= 0 || NWi <= 0)
+			return 0.0f;
 
-		float s = pow(NWh, shininess);
+		float F = R0 + (1.0f - R0) * pow5(1.0f - WhWi);
+		float s = fastPow(NWh, shininess);
 		float a2 = shininess + 2;
-		float D = (a2 / (2 * M_PI)) * s;
-
-		//return vec3(D);
-
+		float D = (a2 / (2.0f * float(M_PI))) * s;
 		float m1 = 2 * (NWh * NWo / WoWh);
 		float m2 = 2 * (NWh * NWi / WoWh);
 		float G = min(1.0f, min(m1, m2));
-
-		//return vec3(G);
-
-		if (NWo <= 0 || NWi <= 0)
-			return vec3(0);
-
-		float brdf = F * D * G / (4 * NWo * NWi);
-
-		return vec3(brdf);
+		return F * D * G / (4 * NWo * NWi);
 	}
 
-	vec3 BlinnPhong::f(const vec3& wi, const vec3& wo, const vec3& n)
+	static float blinnPhongPdf(const vec3& wi, const vec3& wo, const vec3& n, float shininess)
 	{
-		return reflection_brdf(wi, wo, n) + refraction_brdf(wi, wo, n);
+		const vec3 wh = normalize(wi + wo);
+		const float WoWh = dot(wo, wh);
+		const float NWh = dot(n, wh);
+		if (WoWh <= 0.0f || NWh <= 0.0f)
+			return 0.0f;
+		const float p_wh = (shininess + 1) * fastPow(NWh, shininess) / (2.0f * float(M_PI));
+		return p_wh / (4 * WoWh);
 	}
 
-	vec3 BlinnPhong::sample_wi(vec3& wi, const vec3& wo, const vec3& n, float& p)
+	vec3 MaterialClosure::f(const vec3& wi, const vec3& wo, const vec3& n) const
 	{
-		vec3 tangent = normalize(perpendicular(n));
-		vec3 bitangent = normalize(cross(tangent, n));
-		float phi = 2.0f * M_PI * randf();
-		float cos_theta = pow(randf(), 1.0f / (shininess + 1));
-		float sin_theta = sqrt(max(0.0f, 1.0f - cos_theta * cos_theta));
-		vec3 wh = normalize(sin_theta * cos(phi) * tangent +
-			sin_theta * sin(phi) * bitangent +
-			cos_theta * n);
-		if (dot(wo, n) <= 0.0f) return vec3(0.0f);
-
-		if (randf() < 0.5)
-		{
-			wi = normalize(-wo + 2 * dot(wh, wo) * wh); // reflect wo around wh
-			float p_wh = (shininess + 1) * pow(dot(n, wh), shininess) / (2 * M_PI);
-			float p_wi = p_wh / (4 * dot(wo, wh));
-			
-			p = p_wi;
-			p = p * 0.5f;
-
-			return reflection_brdf(wi, wo, n);
-		}
-		else 
+		if (dot(wi, n) <= 0.0f || dot(wo, n) <= 0.0f)
+			return vec3(0.0f);
+		vec3 result = vec3(0.0f);
+		for (int i = 0; i < number_of_lobes; i++)
 		{
-			if (refraction_layer == NULL)
-				return vec3(0.0f);
-			vec3 brdf = refraction_layer->sample_wi(wi, wo, n, p);
-			p = p * 0.5f;
-			float F = R0 + (1.0f - R0) * pow(1.0f - abs(dot(wh, wi)), 5.0f);
-			return (1 - F) * brdf;
+			const Lobe& lobe = lobes[i];
+			switch (lobe.type)
+			{
+			case LOBE_DIFFUSE:
+				result += lobe.weight;
+				break;
+			case LOBE_COATED_DIFFUSE:
+			{
+				const float WhWi = abs(dot(normalize(wi + wo), wi));
+				result += lobe.weight * (1.0f - (R0 + (1.0f - R0) * pow5(1.0f - WhWi)));
+				break;
+			}
+			case LOBE_BLINN_PHONG:
+				result += lobe.weight * blinnPhong(wi, wo, n, shininess, R0);
+				break;
+			}
 		}
+		return result;
 	}
-	///////////////////////////////////////////////////////////////////////////
-	// A Blinn Phong Metal Microfacet BRFD (extends the BlinnPhong class)
-	///////////////////////////////////////////////////////////////////////////
-	vec3 BlinnPhongMetal::refraction_brdf(const vec3& wi, const vec3& wo, const vec3& n)
-	{
-		return vec3(0.0f);
-	}
-	vec3 BlinnPhongMetal::reflection_brdf(const vec3& wi, const vec3& wo, const vec3& n)
-	{
-		return BlinnPhong::reflection_brdf(wi, wo, n) * color;
-	};
 
 	///////////////////////////////////////////////////////////////////////////
-	// A Linear Blend between two BRDFs
+	// The diffuse lobes are sampled with a cosine distribution, so the pdf
+	// of a direction is the sum over lobes of the probability of picking
+	// the lobe times the lobe's pdf.
 	///////////////////////////////////////////////////////////////////////////
-	vec3 LinearBlend::f(const vec3& wi, const vec3& wo, const vec3& n)
+	float MaterialClosure::pdf(const vec3& wi, const vec3& wo, const vec3& n) const
 	{
-		return w * bsdf0->f(wi, wo, n) + (1 - w) * bsdf1->f(wi, wo, n);
+		const float NWi = dot(n, wi);
+		if (NWi <= 0.0f || dot(wo, n) <= 0.0f)
+			return 0.0f;
+		float p = 0.0f;
+		float previous_cdf = 0.0f;
+		for (int i = 0; i < number_of_lobes; i++)
+		{
+			const Lobe& lobe = lobes[i];
+			const float probability = lobe.cdf - previous_cdf;
+			previous_cdf = lobe.cdf;
+			if (lobe.type == LOBE_BLINN_PHONG)
+				p += probability * blinnPhongPdf(wi, wo, n, shininess);
+			else
+				p += probability * NWi / float(M_PI);
+		}
+		return p;
 	}
 
-	vec3 LinearBlend::sample_wi(vec3& wi, const vec3& wo, const vec3& n, float& p)
+	vec3 MaterialClosure::sample_wi(vec3& wi, const vec3& wo, const Frame& frame, float& p) const
 	{
+		const vec3& n = frame.normal;
 		p = 0.0f;
-		if (randf() < w)
+		if (number_of_lobes == 0 || dot(wo, n) <= 0.0f)
+			return vec3(0.0f);
+		const float u = randf();
+		int chosen = 0;
+		while (chosen < number_of_lobes - 1 && u >= lobes[chosen].cdf)
+			chosen++;
+		if (lobes[chosen].type == LOBE_BLINN_PHONG)
 		{
-			return bsdf0->sample_wi(wi, wo, n, p);
+			float phi = 2.0f * float(M_PI) * randf();
+			float cos_theta = fastPow(randf(), 1.0f / (shininess + 1));
+			float sin_theta = sqrt(max(0.0f, 1.0f - cos_theta * cos_theta));
+			float sin_phi, cos_phi;
+			fastSinCos(phi, sin_phi, cos_phi);
+			vec3 wh = normalize(frame.toWorld(vec3(sin_theta * cos_phi, sin_theta * sin_phi, cos_theta)));
+			wi = normalize(-wo + 2 * dot(wh, wo) * wh); // reflect wo around wh
 		}
 		else
 		{
-			return bsdf1->sample_wi(wi, wo, n, p);
+			wi = normalize(frame.toWorld(cosineSampleHemisphere()));
 		}
-
+		p = pdf(wi, wo, n);
+		return f(wi, wo, n);
 	}
-
-	///////////////////////////////////////////////////////////////////////////
-	// A perfect specular refraction.
-	///////////////////////////////////////////////////////////////////////////
-} // namespace pathtracer
\ No newline at end of file
+} // namespace pathtracer
@@ -1,6 +1,6 @@
 #pragma once
 #include <glm/glm.hpp>
-#include "Pathtracer.h"
+#include <Model.h>
 #include "sampling.h"
 
 using namespace glm;
@@ -8,77 +8,53 @@ using namespace glm;
 namespace pathtracer
 {
 	///////////////////////////////////////////////////////////////////////////
-	// The interface for any BRDF.
+	// The lobes a material can be made of. A labhelper::Material blends a
+	// Blinn Phong metal, a Blinn Phong dielectric coat over a diffuse base
+	// and a plain diffuse layer:
+	//   reflectivity * (metalness * metal + (1 - metalness) * dielectric)
+	//   + (1 - reflectivity) * diffuse
+	// The metal and the coat are the same Blinn Phong lobe with different
+	// tints, so this flattens into at most three lobes.
 	///////////////////////////////////////////////////////////////////////////
-	class BRDF
+	enum LobeType
 	{
-	public:
-		// Return the value of the brdf for specific directions
-		virtual vec3 f(const vec3& wi, const vec3& wo, const vec3& n) = 0;
-		// Sample a suitable direction and return the brdf in that direction as
-		// well as the pdf (~probability) that the direction was chosen.
-		virtual vec3 sample_wi(vec3& wi, const vec3& wo, const vec3& n, float& p) = 0;
+		LOBE_DIFFUSE,        // weight / pi
+		LOBE_COATED_DIFFUSE, // weight / pi, times the light the coat lets through (1 - F)
+		LOBE_BLINN_PHONG,    // weight times a Blinn Phong microfacet BRDF with Schlick's Fresnel
 	};
+	const int MAX_LOBES = 3;
 
-	///////////////////////////////////////////////////////////////////////////
-	// A Lambertian (diffuse) material
-	///////////////////////////////////////////////////////////////////////////
-	class Diffuse : public BRDF
+	struct Lobe
 	{
-	public:
-		vec3 color;
-		Diffuse(vec3 c) : color(c)
-		{
-		}
-		virtual vec3 f(const vec3& wi, const vec3& wo, const vec3& n) override;
-		virtual vec3 sample_wi(vec3& wi, const vec3& wo, const vec3& n, float& p) override;
+		LobeType type;
+		vec3 weight;
+		float cdf; // Probability of sampling this lobe or one before it
 	};
 
 	///////////////////////////////////////////////////////////////////////////
-	// A Blinn Phong Dielectric Microfacet BRFD
+	// A material compiled into a flat list of the lobes that contribute to
+	// it, so that shading needs no virtual calls and skips lobes whose
+	// weight is zero. Compile materials again after editing them.
 	///////////////////////////////////////////////////////////////////////////
-	class BlinnPhong : public BRDF
+	struct MaterialClosure
 	{
-	public:
+		Lobe lobes[MAX_LOBES];
+		int number_of_lobes = 0;
 		float shininess;
 		float R0;
-		BRDF* refraction_layer;
-		BlinnPhong(float _shininess, float _R0, BRDF* _refraction_layer = NULL)
-			: shininess(_shininess), R0(_R0), refraction_layer(_refraction_layer)
-		{
-		}
-		virtual vec3 refraction_brdf(const vec3& wi, const vec3& wo, const vec3& n);
-		virtual vec3 reflection_brdf(const vec3& wi, const vec3& wo, const vec3& n);
-		virtual vec3 f(const vec3& wi, const vec3& wo, const vec3& n) override;
-		virtual vec3 sample_wi(vec3& wi, const vec3& wo, const vec3& n, float& p) override;
-	};
+		vec3 emission;
 
-	///////////////////////////////////////////////////////////////////////////
-	// A Blinn Phong Metal Microfacet BRFD (extends the BlinnPhong class)
-	///////////////////////////////////////////////////////////////////////////
-	class BlinnPhongMetal : public BlinnPhong
-	{
-	public:
-		vec3 color;
-		BlinnPhongMetal(vec3 c, float _shininess, float _R0) : color(c), BlinnPhong(_shininess, _R0)
-		{
-		}
-		virtual vec3 refraction_brdf(const vec3& wi, const vec3& wo, const vec3& n);
-		virtual vec3 reflection_brdf(const vec3& wi, const vec3& wo, const vec3& n);
+		// Return the value of the brdf for specific directions
+		vec3 f(const vec3& wi, const vec3& wo, const vec3& n) const;
+		// The probability density of sample_wi() choosing wi
+		float pdf(const vec3& wi, const vec3& wo, const vec3& n) const;
+		// Sample a suitable direction and return the brdf in that direction as
+		// well as the pdf (~probability) that the direction was chosen. The
+		// direction is sampled in the frame around the normal, from one lobe
+		// picked by how much it reflects.
+		vec3 sample_wi(vec3& wi, const vec3& wo, const Frame& frame, float& p) const;
 	};
 
-	///////////////////////////////////////////////////////////////////////////
-	// A Linear Blend between two BRDFs
-	///////////////////////////////////////////////////////////////////////////
-	class LinearBlend : public BRDF
-	{
-	public:
-		float w;
-		BRDF* bsdf0;
-		BRDF* bsdf1;
-		LinearBlend(float _w, BRDF* a, BRDF* b) : w(_w), bsdf0(a), bsdf1(b) {};
-		virtual vec3 f(const vec3& wi, const vec3& wo, const vec3& n) override;
-		virtual vec3 sample_wi(vec3& wi, const vec3& wo, const vec3& n, float& p) override;
-	};
+	MaterialClosure compileMaterial(const labhelper::Material& material);
 
-} // namespace pathtracer
\ No newline at end of file
+} // namespace pathtracer
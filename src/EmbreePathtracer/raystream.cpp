@@ -0,0 +1,110 @@
+#include "raystream.h"
+#include <algorithm>
+
+using namespace std;
+using namespace glm;
+
+namespace pathtracer
+{
+void RayStream::clear()
+{
+	m_rays.clear();
+	m_ids.clear();
+}
+
+void RayStream::add(const Ray& r, uint32_t id)
+{
+	m_rays.push_back(r);
+	m_ids.push_back(id);
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Spread the lower 10 bits of v out so that there are two zero bits
+// between each of them.
+///////////////////////////////////////////////////////////////////////////
+static uint32_t expandBits(uint32_t v)
+{
+	v = (v * 0x00010001u) & 0xFF0000FFu;
+	v = (v * 0x00000101u) & 0x0F00F00Fu;
+	v = (v * 0x00000011u) & 0xC30C30C3u;
+	v = (v * 0x00000005u) & 0x49249249u;
+	return v;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// 30 bit Morton code of a point in the unit cube
+///////////////////////////////////////////////////////////////////////////
+static uint32_t morton3D(const vec3& p)
+{
+	const uint32_t x = uint32_t(std::min(std::max(p.x * 1024.0f, 0.0f), 1023.0f));
+	const uint32_t y = uint32_t(std::min(std::max(p.y * 1024.0f, 0.0f), 1023.0f));
+	const uint32_t z = uint32_t(std::min(std::max(p.z * 1024.0f, 0.0f), 1023.0f));
+	return (expandBits(x) << 2) | (expandBits(y) << 1) | expandBits(z);
+}
+
+void RayStream::reorder()
+{
+	if(m_rays.empty())
+		return;
+	// Quantize origins relative to the bounds of this stream
+	vec3 bounds_min = m_rays[0].o, bounds_max = m_rays[0].o;
+	for(const Ray& r : m_rays)
+	{
+		bounds_min = min(bounds_min, r.o);
+		bounds_max = max(bounds_max, r.o);
+	}
+	const vec3 extent = bounds_max - bounds_min;
+	const vec3 scale = vec3(extent.x > 0.0f ? 1.0f / extent.x : 0.0f, extent.y > 0.0f ? 1.0f / extent.y : 0.0f,
+	                        extent.z > 0.0f ? 1.0f / extent.z : 0.0f);
+
+	// Key is [octant:3][morton:29] in the upper 32 bits and the ray index in
+	// the lower 32, so sorting the keys sorts the rays. The Morton code
+	// drops its lowest bit (that of z) to leave room for the octant.
+	m_keys.resize(m_rays.size());
+	for(size_t i = 0; i < m_rays.size(); i++)
+	{
+		const Ray& r = m_rays[i];
+		const uint32_t octant = (r.d.x < 0.0f ? 4 : 0) | (r.d.y < 0.0f ? 2 : 0) | (r.d.z < 0.0f ? 1 : 0);
+		const uint32_t key = (octant << 29) | (morton3D((r.o - bounds_min) * scale) >> 1);
+		m_keys[i] = (uint64_t(key) << 32) | uint64_t(i);
+	}
+	std::sort(m_keys.begin(), m_keys.end());
+
+	m_sorted_rays.resize(m_rays.size());
+	m_sorted_ids.resize(m_ids.size());
+	for(size_t i = 0; i < m_keys.size(); i++)
+	{
+		const uint32_t from = uint32_t(m_keys[i] & 0xFFFFFFFFu);
+		m_sorted_rays[i] = m_rays[from];
+		m_sorted_ids[i] = m_ids[from];
+	}
+	m_rays.swap(m_sorted_rays);
+	m_ids.swap(m_sorted_ids);
+}
+
+void RayStream::intersect(bool use_stream, bool reorder_rays)
+{
+	if(!use_stream)
+	{
+		for(Ray& r : m_rays)
+			pathtracer::intersect(r);
+		return;
+	}
+	if(reorder_rays)
+		reorder();
+	pathtracer::intersect(m_rays.data(), m_rays.size(), reorder_rays);
+}
+
+void RayStream::occluded(bool use_stream, bool reorder_rays)
+{
+	if(!use_stream)
+	{
+		for(Ray& r : m_rays)
+			pathtracer::occluded(r);
+		return;
+	}
+	if(reorder_rays)
+		reorder();
+	pathtracer::occluded(m_rays.data(), m_rays.size(), reorder_rays);
+}
+} // namespace pathtracer
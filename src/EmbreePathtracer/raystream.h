@@ -0,0 +1,54 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+#include "embree.h"
+
+namespace pathtracer
+{
+///////////////////////////////////////////////////////////////////////////
+// A buffer of independent rays that are traced together with the embree
+// stream API. Each ray carries an id (e.g. the index of the path it
+// belongs to) so that results can be matched up after the rays have been
+// reordered.
+///////////////////////////////////////////////////////////////////////////
+class RayStream
+{
+public:
+	void clear();
+	void add(const Ray& r, uint32_t id);
+	size_t size() const
+	{
+		return m_rays.size();
+	}
+	const Ray& ray(size_t i) const
+	{
+		return m_rays[i];
+	}
+	uint32_t id(size_t i) const
+	{
+		return m_ids[i];
+	}
+
+	///////////////////////////////////////////////////////////////////////
+	// Trace all rays in the stream, either in bulk (optionally reordered
+	// for coherence first) or one at a time through the scalar API.
+	///////////////////////////////////////////////////////////////////////
+	void intersect(bool use_stream, bool reorder);
+	void occluded(bool use_stream, bool reorder);
+
+	///////////////////////////////////////////////////////////////////////
+	// Sort the rays by direction octant, and within an octant by the
+	// Morton code of their origin, so that rays that are likely to visit
+	// the same BVH nodes end up next to each other.
+	///////////////////////////////////////////////////////////////////////
+	void reorder();
+
+private:
+	std::vector<Ray> m_rays;
+	std::vector<uint32_t> m_ids;
+	// Scratch space for reordering
+	std::vector<uint64_t> m_keys;
+	std::vector<Ray> m_sorted_rays;
+	std::vector<uint32_t> m_sorted_ids;
+};
+} // namespace pathtracer
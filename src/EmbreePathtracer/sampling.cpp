@@ -1,8 +1,10 @@
 #include "sampling.h"
-#include <random>
+#include "fastmath.h"
 #include "labhelper.h"
-#include <omp.h>
+#include <algorithm>
+#include <cmath>
 #include <iostream>
+#include <vector>
 #include <glm/glm.hpp>
 
 using namespace glm;
@@ -10,13 +12,359 @@ using namespace glm;
 namespace pathtracer
 {
 ///////////////////////////////////////////////////////////////////////////////
-// Get a random float. Note that we need one "generator" per thread, or we
-// would need to lock everytime someone called randf().
+// Tiny Encryption Algorithm, used to hash the pixel and sample index into a
+// seed. Sixteen rounds decorrelate neighbouring pixels and samples well.
 ///////////////////////////////////////////////////////////////////////////////
-std::mt19937 generators[24]; // Assuming no more than 24 cores
+template <unsigned rounds>
+static inline uint32_t tea(uint32_t v0, uint32_t v1)
+{
+	uint32_t s0 = 0;
+	for(unsigned n = 0; n < rounds; n++)
+	{
+		s0 += 0x9e3779b9;
+		v0 += ((v1 << 4) + 0xa341316c) ^ (v1 + s0) ^ ((v1 >> 5) + 0xc8013ea4);
+		v1 += ((v0 << 4) + 0xad90777d) ^ (v0 + s0) ^ ((v0 >> 5) + 0x7e95761e);
+	}
+	return v0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// The output permutation of PCG (RXS-M-XS), which is a good and cheap hash
+// of a 32 bit integer.
+///////////////////////////////////////////////////////////////////////////////
+static inline uint32_t pcgHash(uint32_t v)
+{
+	const uint32_t state = v * 747796405u + 2891336453u;
+	const uint32_t word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+	return (word >> 22u) ^ word;
+}
+
+// The top 24 bits of a hash as a float in [0, 1)
+static inline float toFloat(uint32_t bits)
+{
+	return float(bits >> 8) * (1.0f / 16777216.0f);
+}
+
+const float ONE_MINUS_EPSILON = 0.99999994f;
+
+///////////////////////////////////////////////////////////////////////////////
+// Independent numbers: the dimensions of a sample step through a Weyl
+// sequence, which is hashed.
+///////////////////////////////////////////////////////////////////////////////
+class IndependentSampler : public Sampler
+{
+public:
+	float get(const RandomState& s) const override
+	{
+		return toFloat(pcgHash(s.sample_seed + 0x9e3779b9u * s.dimension));
+	}
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// A pseudo random permutation of [0, n) that needs no storage, from
+// Kensler, "Correlated Multi-Jittered Sampling" (2013)
+///////////////////////////////////////////////////////////////////////////////
+static uint32_t permute(uint32_t i, uint32_t n, uint32_t p)
+{
+	uint32_t w = n - 1;
+	w |= w >> 1;
+	w |= w >> 2;
+	w |= w >> 4;
+	w |= w >> 8;
+	w |= w >> 16;
+	do
+	{
+		i ^= p;
+		i *= 0xe170893d;
+		i ^= p >> 16;
+		i ^= (i & w) >> 4;
+		i ^= p >> 8;
+		i *= 0x0929eb3f;
+		i ^= p >> 23;
+		i ^= (i & w) >> 1;
+		i *= 1 | p >> 27;
+		i *= 0x6935fa69;
+		i ^= (i & w) >> 11;
+		i *= 0x74dcb303;
+		i ^= (i & w) >> 2;
+		i *= 0x9e501cc3;
+		i ^= (i & w) >> 2;
+		i *= 0xc860a3df;
+		i &= w;
+		i ^= i >> 5;
+	} while(i >= n);
+	return (i + p) % n;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Stratified numbers. The number of samples isn't known up front, since
+// rendering goes on until it is stopped, so the samples are stratified in
+// runs of STRATA: each run visits the strata of every dimension in its own
+// random order, and jitters within them.
+///////////////////////////////////////////////////////////////////////////////
+const uint32_t STRATA = 16;
+
+class StratifiedSampler : public Sampler
+{
+public:
+	float get(const RandomState& s) const override
+	{
+		const uint32_t run = s.sample_index / STRATA;
+		const uint32_t order = pcgHash(s.pixel_seed ^ pcgHash(s.dimension + 0x9e3779b9u * run));
+		const uint32_t stratum = permute(s.sample_index % STRATA, STRATA, order);
+		const float jitter = toFloat(pcgHash(s.sample_seed + 0x9e3779b9u * s.dimension));
+		return std::min((float(stratum) + jitter) * (1.0f / float(STRATA)), ONE_MINUS_EPSILON);
+	}
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Owen scrambled Sobol numbers, following Burley, "Practical Hash-based
+// Owen Scrambling" (2020). A nested uniform scramble of the bits of x,
+// from the most significant one down, is a Laine-Karras permutation of
+// the reversed bits.
+///////////////////////////////////////////////////////////////////////////////
+static inline uint32_t reverseBits(uint32_t x)
+{
+	x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+	x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+	x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+	x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+	return (x >> 16) | (x << 16);
+}
+
+static inline uint32_t laineKarrasPermutation(uint32_t x, uint32_t seed)
+{
+	x += seed;
+	x ^= x * 0x6c50b47cu;
+	x ^= x * 0xb82f1e52u;
+	x ^= x * 0xc7afe638u;
+	x ^= x * 0x8d22f6e6u;
+	return x;
+}
+
+static inline uint32_t nestedUniformScramble(uint32_t x, uint32_t seed)
+{
+	return reverseBits(laineKarrasPermutation(reverseBits(x), seed));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// The direction numbers of the first four Sobol dimensions. The first is
+// the van der Corput sequence; the others use the primitive polynomials
+// and initial numbers of Joe and Kuo. The scrambled sample indices use all
+// 32 bits, so the direction numbers are also tabulated a byte at a time.
+///////////////////////////////////////////////////////////////////////////////
+const uint32_t SOBOL_DIMENSIONS = 4;
+
+struct SobolDirections
+{
+	uint32_t v[SOBOL_DIMENSIONS][32];
+	uint32_t bytes[SOBOL_DIMENSIONS][4][256];
+
+	SobolDirections()
+	{
+		const uint32_t degree[SOBOL_DIMENSIONS] = { 0, 1, 2, 3 };
+		const uint32_t coefficients[SOBOL_DIMENSIONS] = { 0, 0, 1, 1 };
+		const uint32_t initial[SOBOL_DIMENSIONS][3] = { { 0, 0, 0 }, { 1, 0, 0 }, { 1, 3, 0 }, { 1, 3, 1 } };
+		for(uint32_t i = 0; i < 32; i++)
+		{
+			v[0][i] = 1u << (31 - i);
+		}
+		for(uint32_t d = 1; d < SOBOL_DIMENSIONS; d++)
+		{
+			const uint32_t s = degree[d];
+			for(uint32_t i = 0; i < 32; i++)
+			{
+				if(i < s)
+				{
+					v[d][i] = initial[d][i] << (31 - i);
+					continue;
+				}
+				v[d][i] = v[d][i - s] ^ (v[d][i - s] >> s);
+				for(uint32_t k = 1; k < s; k++)
+				{
+					if((coefficients[d] >> (s - 1 - k)) & 1)
+						v[d][i] ^= v[d][i - k];
+				}
+			}
+		}
+		for(uint32_t d = 0; d < SOBOL_DIMENSIONS; d++)
+		{
+			for(uint32_t byte = 0; byte < 4; byte++)
+			{
+				for(uint32_t value = 0; value < 256; value++)
+				{
+					uint32_t x = 0;
+					for(uint32_t bit = 0; bit < 8; bit++)
+					{
+						if(value & (1u << bit))
+							x ^= v[d][byte * 8 + bit];
+					}
+					bytes[d][byte][value] = x;
+				}
+			}
+		}
+	}
+};
+static const SobolDirections sobol_directions;
+
+static inline uint32_t sobol(uint32_t index, uint32_t dimension)
+{
+	const uint32_t(&bytes)[4][256] = sobol_directions.bytes[dimension];
+	return bytes[0][index & 0xff] ^ bytes[1][(index >> 8) & 0xff] ^ bytes[2][(index >> 16) & 0xff]
+	       ^ bytes[3][index >> 24];
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Dimensions past the fourth reuse the Sobol dimensions, with the order of
+// the samples shuffled differently for every group of four so that the
+// groups are not correlated.
+///////////////////////////////////////////////////////////////////////////////
+static inline float sobolOwen(uint32_t index, uint32_t dimension, uint32_t seed)
+{
+	const uint32_t group_seed = pcgHash(seed + 0x9e3779b9u * (dimension / SOBOL_DIMENSIONS));
+	const uint32_t shuffled_index = nestedUniformScramble(index, group_seed);
+	const uint32_t component = dimension % SOBOL_DIMENSIONS;
+	const uint32_t x = sobol(shuffled_index, component);
+	return toFloat(nestedUniformScramble(x, pcgHash(group_seed + component + 1)));
+}
+
+class SobolSampler : public Sampler
+{
+public:
+	float get(const RandomState& s) const override
+	{
+		return sobolOwen(s.sample_index, s.dimension, s.pixel_seed);
+	}
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// A 64x64 blue noise mask, made with the void filling half of Ulichney's
+// void-and-cluster method: pixels are ranked one at a time, always taking
+// the one farthest from those already ranked, as measured by a Gaussian
+// energy that wraps around the edges.
+///////////////////////////////////////////////////////////////////////////////
+const int BLUE_NOISE_SIZE = 64;
+
+struct BlueNoiseMask
+{
+	float value[BLUE_NOISE_SIZE * BLUE_NOISE_SIZE]; // In [0, 1), evenly spread
+
+	BlueNoiseMask()
+	{
+		const int n = BLUE_NOISE_SIZE * BLUE_NOISE_SIZE;
+		const float sigma = 1.9f;
+		std::vector<float> kernel(n);
+		for(int y = 0; y < BLUE_NOISE_SIZE; y++)
+		{
+			for(int x = 0; x < BLUE_NOISE_SIZE; x++)
+			{
+				const int dx = std::min(x, BLUE_NOISE_SIZE - x);
+				const int dy = std::min(y, BLUE_NOISE_SIZE - y);
+				kernel[y * BLUE_NOISE_SIZE + x] = std::exp(-float(dx * dx + dy * dy) / (2.0f * sigma * sigma));
+			}
+		}
+		// A little noise in the initial energy breaks the ties that would
+		// otherwise give a regular pattern
+		std::vector<float> energy(n);
+		std::vector<bool> ranked(n, false);
+		for(int i = 0; i < n; i++)
+		{
+			energy[i] = 1e-3f * toFloat(pcgHash(uint32_t(i)));
+		}
+		for(int rank = 0; rank < n; rank++)
+		{
+			int best = -1;
+			for(int i = 0; i < n; i++)
+			{
+				if(!ranked[i] && (best < 0 || energy[i] < energy[best]))
+					best = i;
+			}
+			ranked[best] = true;
+			value[best] = (float(rank) + 0.5f) / float(n);
+			const int bx = best % BLUE_NOISE_SIZE, by = best / BLUE_NOISE_SIZE;
+			for(int y = 0; y < BLUE_NOISE_SIZE; y++)
+			{
+				const int ky = (y - by + BLUE_NOISE_SIZE) % BLUE_NOISE_SIZE;
+				for(int x = 0; x < BLUE_NOISE_SIZE; x++)
+				{
+					const int kx = (x - bx + BLUE_NOISE_SIZE) % BLUE_NOISE_SIZE;
+					energy[y * BLUE_NOISE_SIZE + x] += kernel[ky * BLUE_NOISE_SIZE + kx];
+				}
+			}
+		}
+	}
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Every pixel uses the same Sobol sequence, shifted (Cranley-Patterson
+// rotated) by the blue noise mask. Each dimension looks the mask up at its
+// own offset. The mask is only made once it is first used.
+///////////////////////////////////////////////////////////////////////////////
+class BlueNoiseSampler : public Sampler
+{
+public:
+	float get(const RandomState& s) const override
+	{
+		static const BlueNoiseMask mask;
+		const uint32_t offset = pcgHash(s.dimension);
+		const uint32_t mx = (s.x + offset) % BLUE_NOISE_SIZE;
+		const uint32_t my = (s.y + (offset >> 8)) % BLUE_NOISE_SIZE;
+		const float u = sobolOwen(s.sample_index, s.dimension, 0) + mask.value[my * BLUE_NOISE_SIZE + mx];
+		return std::min(u < 1.0f ? u : u - 1.0f, ONE_MINUS_EPSILON);
+	}
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Every thread has its own state, so randf() never touches shared memory
+///////////////////////////////////////////////////////////////////////////////
+SamplingSettings sampling_settings;
+
+static const IndependentSampler independent_sampler;
+static const StratifiedSampler stratified_sampler;
+static const SobolSampler sobol_sampler;
+static const BlueNoiseSampler blue_noise_sampler;
+static const Sampler* const samplers[SAMPLER_NUMBER_OF_TYPES] = { &independent_sampler, &stratified_sampler,
+	                                                              &sobol_sampler, &blue_noise_sampler };
+
+static thread_local RandomState random_state = { 0, 0, 0, 0, 0, 0 };
+
+static inline RandomState makeState(uint32_t x, uint32_t y, uint32_t sample_index)
+{
+	RandomState s;
+	s.x = x;
+	s.y = y;
+	s.sample_index = sample_index;
+	s.pixel_seed = tea<16>(x, y);
+	s.sample_seed = tea<16>(s.pixel_seed, sample_index);
+	s.dimension = 0;
+	return s;
+}
+
+void beginSample(uint32_t x, uint32_t y, uint32_t sample_index)
+{
+	random_state = makeState(x, y, sample_index);
+	random_state.dimension = CAMERA_DIMENSIONS;
+}
+
+RandomState& randomState()
+{
+	return random_state;
+}
+
 float randf()
 {
-	return float(generators[omp_get_thread_num()]() / double(generators[omp_get_thread_num()].max()));
+	const float u = samplers[sampling_settings.sampler]->get(random_state);
+	random_state.dimension++;
+	return u;
+}
+
+vec2 pixelSample(uint32_t x, uint32_t y, uint32_t sample_index)
+{
+	const Sampler* sampler = samplers[sampling_settings.sampler];
+	RandomState s = makeState(x, y, sample_index);
+	const float u = sampler->get(s);
+	s.dimension = 1;
+	return vec2(u, sampler->get(s));
 }
 
 ///////////////////////////////////////////////////////////////////////////
@@ -68,8 +416,10 @@ void concentricSampleDisk(float* dx, float* dy)
 		}
 	}
 	theta *= float(M_PI) / 4.0f;
-	*dx = r * cosf(theta);
-	*dy = r * sinf(theta);
+	float sin_theta, cos_theta;
+	fastSinCos(theta, sin_theta, cos_theta);
+	*dx = r * cos_theta;
+	*dy = r * sin_theta;
 }
 
 ///////////////////////////////////////////////////////////////////////////
@@ -102,4 +452,76 @@ bool sameHemisphere(const vec3& i, const vec3& o, const vec3& n)
 {
 	return sign(dot(o, n)) == sign(dot(i, n));
 }
-} // namespace pathtracer
\ No newline at end of file
+///////////////////////////////////////////////////////////////////////////
+// Alias tables
+///////////////////////////////////////////////////////////////////////////
+void AliasTable::build(const float* weights, size_t n)
+{
+	probability.resize(n);
+	alias.resize(n);
+	pdf.resize(n);
+	sum = buildAliasTable(weights, n, probability.data(), alias.data(), pdf.data());
+}
+
+uint32_t AliasTable::sample(float u, float& remapped) const
+{
+	return sampleAliasTable(probability.data(), alias.data(), probability.size(), u, remapped);
+}
+
+float buildAliasTable(const float* weights, size_t n, float* probability, uint32_t* alias, float* pdf)
+{
+	double total = 0.0;
+	for(size_t i = 0; i < n; i++)
+	{
+		total += weights[i];
+	}
+	// Each item's weight relative to the average, sorted into the slots
+	// that are underfull and those that have weight to spare
+	std::vector<double> scaled(n);
+	std::vector<uint32_t> small, large;
+	for(size_t i = 0; i < n; i++)
+	{
+		pdf[i] = total > 0.0 ? float(weights[i] / total) : 1.0f / float(n);
+		scaled[i] = total > 0.0 ? weights[i] * double(n) / total : 1.0;
+		alias[i] = uint32_t(i);
+		if(scaled[i] < 1.0)
+			small.push_back(uint32_t(i));
+		else
+			large.push_back(uint32_t(i));
+	}
+	// Fill each underfull slot with weight from one that has some to spare
+	while(!small.empty() && !large.empty())
+	{
+		const uint32_t s = small.back(), l = large.back();
+		small.pop_back();
+		probability[s] = float(scaled[s]);
+		alias[s] = l;
+		scaled[l] -= 1.0 - scaled[s];
+		if(scaled[l] < 1.0)
+		{
+			large.pop_back();
+			small.push_back(l);
+		}
+	}
+	// What is left is full up to rounding
+	for(uint32_t i : small)
+		probability[i] = 1.0f;
+	for(uint32_t i : large)
+		probability[i] = 1.0f;
+	return float(total);
+}
+
+uint32_t sampleAliasTable(const float* probability, const uint32_t* alias, size_t n, float u, float& remapped)
+{
+	const float scaled = u * float(n);
+	const uint32_t slot = std::min(uint32_t(scaled), uint32_t(n - 1));
+	const float v = scaled - float(slot);
+	if(v < probability[slot])
+	{
+		remapped = std::min(v / probability[slot], 0.99999994f);
+		return slot;
+	}
+	remapped = std::min((v - probability[slot]) / (1.0f - probability[slot]), 0.99999994f);
+	return alias[slot];
+}
+} // namespace pathtracer
@@ -1,12 +1,77 @@
 #pragma once
+#include <cstdint>
+#include <vector>
 #include <glm/glm.hpp>
 
 namespace pathtracer
 {
 ///////////////////////////////////////////////////////////////////////////
-// Random number generation
+// Random number generation. The numbers are not drawn from a generator
+// shared by the thread, but computed by a Sampler from (pixel, sample
+// index, dimension), where the dimension counts the numbers drawn so far
+// for the sample. The image is then the same no matter how the pixels
+// are spread over threads. Call beginSample() before tracing the path of
+// a pixel; randf() then gives the next dimension of that sample, in [0, 1).
 ///////////////////////////////////////////////////////////////////////////
+struct RandomState
+{
+	uint32_t x, y;
+	uint32_t sample_index;
+	uint32_t pixel_seed;  // Hash of x, y
+	uint32_t sample_seed; // Hash of x, y and sample_index
+	uint32_t dimension;
+};
+// The first dimensions of a sample place it within the pixel, and are
+// drawn with pixelSample() before the path begins
+const uint32_t CAMERA_DIMENSIONS = 2;
+void beginSample(uint32_t x, uint32_t y, uint32_t sample_index);
+// The state of the calling thread, to save and restore it when the paths
+// of several pixels are advanced in turns
+RandomState& randomState();
 float randf();
+// Where in the pixel a sample is, from its first CAMERA_DIMENSIONS
+glm::vec2 pixelSample(uint32_t x, uint32_t y, uint32_t sample_index);
+
+///////////////////////////////////////////////////////////////////////////
+// The ways the numbers of randf() can be chosen. Independent numbers are
+// plain hashes. The others spread the samples of a pixel more evenly, so
+// the image converges faster:
+//  - stratified: each run of 16 samples puts one number in every 1/16th
+//    of each dimension
+//  - sobol: a 4D Sobol sequence, Owen scrambled per pixel, and padded to
+//    more dimensions by shuffling the sample order per group of four
+//  - blue-noise: one Owen scrambled Sobol sequence for the whole image,
+//    offset per pixel by a blue noise mask, so that the remaining error
+//    is spread as high frequency noise across neighbouring pixels
+///////////////////////////////////////////////////////////////////////////
+enum SamplerType
+{
+	SAMPLER_INDEPENDENT,
+	SAMPLER_STRATIFIED,
+	SAMPLER_SOBOL,
+	SAMPLER_BLUE_NOISE,
+	SAMPLER_NUMBER_OF_TYPES
+};
+// Names as used on the command line and in the GUI
+const char* const SAMPLER_NAMES[] = { "independent", "stratified", "sobol", "blue-noise" };
+
+class Sampler
+{
+public:
+	virtual ~Sampler()
+	{
+	}
+	// The number for state.dimension of the sample state describes
+	virtual float get(const RandomState& state) const = 0;
+};
+
+///////////////////////////////////////////////////////////////////////////
+// The sampler randf() uses. Restart rendering after changing it.
+///////////////////////////////////////////////////////////////////////////
+extern struct SamplingSettings
+{
+	int sampler = SAMPLER_SOBOL;
+} sampling_settings;
 ///////////////////////////////////////////////////////////////////////////
 // Generate uniform points on a disc
 ///////////////////////////////////////////////////////////////////////////
@@ -16,10 +81,72 @@ void concentricSampleDisk(float* dx, float* dy);
 ///////////////////////////////////////////////////////////////////////////
 glm::vec3 cosineSampleHemisphere();
 ///////////////////////////////////////////////////////////////////////////
+// An orthonormal basis around a normal, for turning directions sampled
+// around the z axis into world space
+///////////////////////////////////////////////////////////////////////////
+struct Frame
+{
+	glm::vec3 tangent;
+	glm::vec3 bitangent;
+	glm::vec3 normal;
+	glm::vec3 toWorld(const glm::vec3& v) const
+	{
+		return v.x * tangent + v.y * bitangent + v.z * normal;
+	}
+};
+///////////////////////////////////////////////////////////////////////////
 // Generate a vector that is perpendicular to another
 ///////////////////////////////////////////////////////////////////////////
 glm::vec3 perpendicular(const glm::vec3& v);
 ///////////////////////////////////////////////////////////////////////////
+// A discrete distribution over n items, proportional to their weights,
+// that is sampled in constant time with Walker's alias method (built with
+// Vose's algorithm). Each item i owns an equal slot, which also holds the
+// alias item alias[i] for the part 1 - probability[i] of the slot.
+///////////////////////////////////////////////////////////////////////////
+struct AliasTable
+{
+	std::vector<float> probability;
+	std::vector<uint32_t> alias;
+	std::vector<float> pdf; // weight / sum of weights, per item
+	float sum = 0.0f;       // Of the weights
+
+	// All weights zero gives the uniform distribution
+	void build(const float* weights, size_t n);
+	size_t size() const
+	{
+		return pdf.size();
+	}
+	// Draw an item with u in [0, 1). remapped is what is left of u after
+	// choosing the item, a fresh number in [0, 1) to use for something else.
+	uint32_t sample(float u, float& remapped) const;
+};
+// The same on arrays stored elsewhere, such as in a file mapped into
+// memory. Returns the sum of the weights.
+float buildAliasTable(const float* weights, size_t n, float* probability, uint32_t* alias, float* pdf);
+uint32_t sampleAliasTable(const float* probability, const uint32_t* alias, size_t n, float u, float& remapped);
+
+///////////////////////////////////////////////////////////////////////////
+// The luminance of linear Rec. 709 RGB, which lights are importance
+// sampled by
+///////////////////////////////////////////////////////////////////////////
+inline float luminance(const glm::vec3& rgb)
+{
+	return 0.2126f * rgb.x + 0.7152f * rgb.y + 0.0722f * rgb.z;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Veach's power heuristic (beta = 2): the multiple importance sampling
+// weight of a sample drawn with pdf f, when the same direction could also
+// have been drawn by another strategy with pdf g
+///////////////////////////////////////////////////////////////////////////
+inline float powerHeuristic(float f, float g)
+{
+	const float f2 = f * f;
+	const float sum = f2 + g * g;
+	return sum > 0.0f ? f2 / sum : 0.0f;
+}
+///////////////////////////////////////////////////////////////////////////
 // Check if wi and wo are on the same side of the plane defined by n
 ///////////////////////////////////////////////////////////////////////////
 bool sameHemisphere(const glm::vec3& wi, const glm::vec3& wo, const glm::vec3& n);
@@ -0,0 +1,157 @@
+///////////////////////////////////////////////////////////////////////////
+// Checks the SIMD BRDF kernels of every instruction set the CPU supports
+// against the scalar MaterialClosure::f(), pdf() and sample_wi(), over
+// random materials, normals and directions (including ones below the
+// surface and grazing ones).
+//
+// The kernels have their own polynomial pow, so they don't match libm to
+// the last bit: f and pdf may differ from the scalar ones by MAX_ERROR,
+// measured as |simd - scalar| / (|scalar| + 1e-3), and sampled directions
+// by MAX_WI_ERROR per component. A shiny lobe changes by about its
+// exponent times that over such a small change of direction, so the f
+// and pdf of a sampled direction are compared to the scalar ones for the
+// same direction, not to those sample_wi() returns.
+///////////////////////////////////////////////////////////////////////////
+#include <cmath>
+#include <iostream>
+#include <random>
+#include <vector>
+#include "../brdf_simd.h"
+#include "../sampling.h"
+
+using namespace std;
+using namespace glm;
+using namespace pathtracer;
+
+const double MAX_ERROR = 2e-4;
+const double MAX_WI_ERROR = 1e-4;
+
+static bool passed = true;
+
+static void check(const char* isa, const char* name, double error, double bound)
+{
+	const bool ok = error <= bound;
+	cout << (ok ? "ok     " : "FAILED ") << isa << " " << name << ": largest error " << error << ", bound " << bound
+	     << "\n";
+	passed &= ok;
+}
+
+static double relativeError(float simd, float scalar)
+{
+	return std::abs(double(simd) - double(scalar)) / (std::abs(double(scalar)) + 1e-3);
+}
+
+struct Errors
+{
+	double f = 0.0, pdf = 0.0, wi = 0.0;
+
+	void add(const BRDFBatch& batch, size_t i, const vec3& f, float pdf)
+	{
+		for(int c = 0; c < 3; c++)
+		{
+			this->f = std::max(this->f, relativeError(batch.f[c][i], f[c]));
+		}
+		this->pdf = std::max(this->pdf, relativeError(batch.pdf[i], pdf));
+	}
+};
+
+int main()
+{
+	const size_t N = 1000;
+	for(int isa = 0; isa < BRDF_KERNELS_NUMBER_OF_ISAS; isa++)
+	{
+		const char* name = BRDF_KERNEL_ISA_NAMES[isa];
+		const BRDFKernels* kernels = brdfKernels(BRDFKernelISA(isa));
+		if(kernels == nullptr)
+		{
+			cout << "skipped " << name << ": not supported by this CPU or compiler\n";
+			continue;
+		}
+		mt19937 rng(1);
+		uniform_real_distribution<float> uniform(0.0f, 1.0f);
+		auto randomDirection = [&]() {
+			return normalize(vec3(2.0f * uniform(rng) - 1.0f, 2.0f * uniform(rng) - 1.0f, 2.0f * uniform(rng) - 1.0f));
+		};
+
+		Errors evaluate_errors, sample_errors;
+		for(uint32_t m = 0; m < 50; m++)
+		{
+			// Every combination of lobes, from rough to very shiny
+			labhelper::Material material;
+			material.m_color = vec3(uniform(rng), uniform(rng), uniform(rng));
+			material.m_reflectivity = m % 5 == 0 ? 0.0f : uniform(rng);
+			material.m_metalness = m % 7 == 0 ? 1.0f : uniform(rng);
+			material.m_fresnel = 0.5f * uniform(rng);
+			material.m_shininess = m % 3 == 0 ? 1.0f : 500.0f * uniform(rng);
+			material.m_emission = 0.0f;
+			material.m_transparency = 0.0f;
+			const MaterialClosure closure = compileMaterial(material);
+
+			BRDFBatch batch;
+			batch.resize(N);
+			vector<vec3> wo(N), wi(N);
+			vector<Frame> frames(N);
+			vector<RandomState> states(N);
+			for(size_t i = 0; i < N; i++)
+			{
+				// Mostly above the surface, but some below
+				Frame& frame = frames[i];
+				frame.normal = randomDirection();
+				frame.tangent = normalize(cross(frame.normal, randomDirection()));
+				frame.bitangent = cross(frame.normal, frame.tangent);
+				wo[i] = randomDirection();
+				if(dot(wo[i], frame.normal) < 0.0f && i % 4 != 0)
+					wo[i] = -wo[i];
+				wi[i] = randomDirection();
+				if(dot(wi[i], frame.normal) < 0.0f && i % 3 != 0)
+					wi[i] = -wi[i];
+				for(int c = 0; c < 3; c++)
+				{
+					batch.wo[c][i] = wo[i][c];
+					batch.wi[c][i] = wi[i][c];
+					batch.normal[c][i] = frame.normal[c];
+					batch.tangent[c][i] = frame.tangent[c];
+					batch.bitangent[c][i] = frame.bitangent[c];
+				}
+				beginSample(uint32_t(i), m, 0);
+				states[i] = randomState();
+				for(int c = 0; c < 3; c++)
+				{
+					batch.u[c][i] = randf();
+				}
+			}
+
+			kernels->evaluate(closure, batch);
+			for(size_t i = 0; i < N; i++)
+			{
+				const vec3& n = frames[i].normal;
+				evaluate_errors.add(batch, i, closure.f(wi[i], wo[i], n), closure.pdf(wi[i], wo[i], n));
+			}
+
+			// sample_wi() draws the same random numbers as were put in u
+			kernels->sample(closure, batch);
+			for(size_t i = 0; i < N; i++)
+			{
+				randomState() = states[i];
+				vec3 sampled_wi;
+				float pdf;
+				closure.sample_wi(sampled_wi, wo[i], frames[i], pdf);
+				if(pdf <= 0.0f && batch.pdf[i] <= 0.0f)
+					continue; // Both failed to sample a direction
+				const vec3 batch_wi = vec3(batch.wi[0][i], batch.wi[1][i], batch.wi[2][i]);
+				for(int c = 0; c < 3; c++)
+				{
+					sample_errors.wi = std::max(sample_errors.wi, double(std::abs(sampled_wi[c] - batch_wi[c])));
+				}
+				const vec3& n = frames[i].normal;
+				sample_errors.add(batch, i, closure.f(batch_wi, wo[i], n), closure.pdf(batch_wi, wo[i], n));
+			}
+		}
+		check(name, "evaluate f", evaluate_errors.f, MAX_ERROR);
+		check(name, "evaluate pdf", evaluate_errors.pdf, MAX_ERROR);
+		check(name, "sample wi", sample_errors.wi, MAX_WI_ERROR);
+		check(name, "sample f", sample_errors.f, MAX_ERROR);
+		check(name, "sample pdf", sample_errors.pdf, MAX_ERROR);
+	}
+	return passed ? 0 : 1;
+}
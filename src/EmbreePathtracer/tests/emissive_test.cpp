@@ -0,0 +1,136 @@
+///////////////////////////////////////////////////////////////////////////
+// Renders a diffuse floor under a square lamp, and checks the radiance of
+// the floor right under the lamp against its closed form, with and without
+// emissive light sampling, for both integrators.
+//
+// The scene is open and there is no environment map, so with two bounces
+// every path has only the lamp's direct light to find. That takes the BRDF
+// sample of the floor alone without emissive light sampling, and the light
+// sample and BRDF sample, weighted against each other, with it. With one
+// bounce, emissive light sampling still finds all of it: the BRDF sample
+// that runs out of bounces on the lamp is kept, see Lemitted(). Without
+// it, the floor is black, like it is under the point light and the
+// environment.
+//
+// Then the integrators are compared on a view that also takes in the sky,
+// with more bounces, so that camera rays and paths at every bounce escape.
+// Both draw the same random numbers, so their images differ by little more
+// than rounding.
+///////////////////////////////////////////////////////////////////////////
+#include <cmath>
+#include <iostream>
+#include "../Pathtracer.h"
+#include "testscene.h"
+
+using namespace std;
+using namespace glm;
+
+// The noise of the BRDF sample alone, at SAMPLES paths per pixel
+const double MAX_RELATIVE_ERROR = 0.01;
+const int SAMPLES = 1024;
+// The RMSE of the wavefront image against the depth first one, over the
+// mean pixel value
+const float MAX_INTEGRATOR_RELATIVE_RMSE = 1e-3f;
+
+const float ALBEDO = 0.8f;
+const float LAMP_HALF_SIZE = 1.0f;
+const float LAMP_HEIGHT = 1.0f;
+// Off the diagonals of the floor, which some rays slip through
+const vec3 LAMP_CENTER = vec3(2.0f, 0.0f, 1.0f);
+
+static bool passed = true;
+
+// The form factor from a point to a rectangle in a plane parallel to its
+// own, with one corner right above the point and the opposite one at
+// (x, z) over the distance between the planes
+static double cornerFormFactor(double x, double z)
+{
+	const double a = x / std::sqrt(1.0 + x * x);
+	const double b = z / std::sqrt(1.0 + z * z);
+	return (a * std::atan(z / std::sqrt(1.0 + x * x)) + b * std::atan(x / std::sqrt(1.0 + z * z)))
+	       / (2.0 * M_PI);
+}
+
+static labhelper::Model* createScene()
+{
+	labhelper::Model* scene = new labhelper::Model;
+	scene->m_name = "floor and lamp";
+	scene->m_filename = "floor_and_lamp.obj";
+	scene->m_materials.push_back(test::material(vec3(ALBEDO), 0.0f, 0.0f, 0.0f, 0.0f, 0.0f));
+	scene->m_materials.push_back(test::material(vec3(1.0f), 0.0f, 0.0f, 0.0f, 0.0f, 1.0f));
+	test::addQuad(scene, 0, vec3(-10, 0, 10), vec3(10, 0, 10), vec3(10, 0, -10), vec3(-10, 0, -10));
+	const float s = LAMP_HALF_SIZE, h = LAMP_HEIGHT;
+	const vec3 c = LAMP_CENTER;
+	test::addQuad(scene, 1, c + vec3(-s, h, -s), c + vec3(s, h, -s), c + vec3(s, h, s), c + vec3(-s, h, s));
+	return scene;
+}
+
+// The center pixel of a render looking down at the floor under the lamp,
+// from between the two
+static double renderFloor(pathtracer::Integrator integrator, bool emissive_light_sampling, int max_bounces)
+{
+	pathtracer::settings.integrator = integrator;
+	pathtracer::settings.emissive_light_sampling = emissive_light_sampling;
+	pathtracer::settings.max_bounces = max_bounces;
+	const int size = 9;
+	test::render(size, size, SAMPLES, LAMP_CENTER + vec3(0.0f, 0.5f * LAMP_HEIGHT, 0.01f), LAMP_CENTER);
+	const vec3 c = pathtracer::rendered_image.data[(size / 2) * size + size / 2];
+	return (c.x + c.y + c.z) / 3.0;
+}
+
+static void check(pathtracer::Integrator integrator, bool emissive_light_sampling, int max_bounces, double expected)
+{
+	const double L = renderFloor(integrator, emissive_light_sampling, max_bounces);
+	const double error = std::abs(L - expected) / std::max(expected, 1e-3);
+	const bool ok = error <= MAX_RELATIVE_ERROR;
+	cout << (ok ? "ok     " : "FAILED ") << (integrator == pathtracer::INTEGRATOR_WAVEFRONT ? "wavefront" : "depth first")
+	     << ", emissive light sampling " << (emissive_light_sampling ? "on" : "off") << ", " << max_bounces
+	     << " bounce(s): " << L << ", expected " << expected << ", relative error " << error << ", bound "
+	     << MAX_RELATIVE_ERROR << "\n";
+	passed &= ok;
+}
+
+int main()
+{
+	test::resetSettings();
+	pathtracer::addModel(createScene(), mat4(1.0f));
+	pathtracer::buildBVH();
+
+	// The lamp covers four corner rectangles, and the floor reflects
+	// albedo / pi of the irradiance pi * emission * form factor
+	const double x = LAMP_HALF_SIZE / LAMP_HEIGHT;
+	const double expected = ALBEDO * 4.0 * cornerFormFactor(x, x);
+
+	for(pathtracer::Integrator integrator : { pathtracer::INTEGRATOR_DEPTH_FIRST, pathtracer::INTEGRATOR_WAVEFRONT })
+	{
+		check(integrator, true, 1, expected);
+		check(integrator, true, 2, expected);
+		check(integrator, false, 1, 0.0);
+		check(integrator, false, 2, expected);
+	}
+
+	// Looking at the lamp from the side, with the horizon in view
+	pathtracer::settings.max_bounces = 4;
+	for(bool emissive_light_sampling : { true, false })
+	{
+		pathtracer::settings.emissive_light_sampling = emissive_light_sampling;
+		pathtracer::settings.integrator = pathtracer::INTEGRATOR_DEPTH_FIRST;
+		test::render(32, 24, 64, LAMP_CENTER + vec3(0.0f, 2.0f, 6.0f), LAMP_CENTER);
+		pathtracer::storeReferenceImage();
+		double mean = 0.0;
+		for(const vec3& c : pathtracer::rendered_image.data)
+		{
+			mean += (c.x + c.y + c.z) / 3.0f;
+		}
+		mean /= double(pathtracer::rendered_image.data.size());
+		pathtracer::settings.integrator = pathtracer::INTEGRATOR_WAVEFRONT;
+		test::render(32, 24, 64, LAMP_CENTER + vec3(0.0f, 2.0f, 6.0f), LAMP_CENTER);
+		const float relative_rmse = pathtracer::referenceError() / float(mean);
+		const bool ok = mean > 0.0 && relative_rmse >= 0.0f && relative_rmse <= MAX_INTEGRATOR_RELATIVE_RMSE;
+		cout << (ok ? "ok     " : "FAILED ") << "open view, emissive light sampling "
+		     << (emissive_light_sampling ? "on" : "off") << ": wavefront against depth first RMSE " << relative_rmse
+		     << " of the mean " << mean << ", bound " << MAX_INTEGRATOR_RELATIVE_RMSE << "\n";
+		passed &= ok;
+	}
+	return passed ? 0 : 1;
+}
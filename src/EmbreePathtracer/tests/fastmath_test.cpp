@@ -0,0 +1,126 @@
+///////////////////////////////////////////////////////////////////////////
+// Checks the approximations in fastmath.h against double precision libm
+// over the domains they are used on, and fails if any error is larger
+// than what fastmath.h documents. Built with PATHTRACER_FAST_MATH whatever
+// the CMake option is, so that the approximations are what is tested.
+///////////////////////////////////////////////////////////////////////////
+#include "../fastmath.h"
+#include <cmath>
+#include <iostream>
+#include <random>
+
+#ifndef PATHTRACER_FAST_MATH
+#error "fastmath_test checks the approximations, build it with PATHTRACER_FAST_MATH"
+#endif
+
+using namespace std;
+using namespace pathtracer;
+
+static bool passed = true;
+
+static void check(const char* name, double error, double bound)
+{
+	const bool ok = error <= bound;
+	cout << (ok ? "ok     " : "FAILED ") << name << ": largest error " << error << ", bound " << bound << "\n";
+	passed &= ok;
+}
+
+// The distance from |x| to the next float, i.e. the rounding of a result
+static double ulp(double x)
+{
+	const float f = float(std::abs(x));
+	return std::nextafter(f, INFINITY) - f;
+}
+
+int main()
+{
+	const int N = 2000000;
+	mt19937 rng(1);
+	uniform_real_distribution<float> uniform(0.0f, 1.0f);
+
+	///////////////////////////////////////////////////////////////////////
+	// fastLog2, over every 4099th normal float: 2e-7 absolute, plus the
+	// rounding of the exponent part
+	///////////////////////////////////////////////////////////////////////
+	double log2_error = 0.0;
+	for(uint32_t bits = 0x00800000u; bits < 0x7f800000u; bits += 4099)
+	{
+		const float x = floatFromBits(bits);
+		const double reference = std::log2(double(x));
+		log2_error = std::max(log2_error, std::abs(fastLog2(x) - reference) - ulp(reference));
+	}
+	check("fastLog2 - ulp", log2_error, 2e-7);
+
+	///////////////////////////////////////////////////////////////////////
+	// fastExp2, over the range where the result is a normal float: 3e-7
+	// relative
+	///////////////////////////////////////////////////////////////////////
+	double exp2_error = 0.0;
+	for(int i = 0; i < N; i++)
+	{
+		const float x = -125.99f + 252.99f * uniform(rng);
+		exp2_error = std::max(exp2_error, std::abs(fastExp2(x) / std::exp2(double(x)) - 1.0));
+	}
+	check("fastExp2 relative", exp2_error, 3e-7);
+
+	///////////////////////////////////////////////////////////////////////
+	// fastPow, for what the BRDFs use it on: x in [0, 1], mostly close to
+	// 1, to the power of a shininess up to 25000 or of 1 / (shininess + 1).
+	// 3e-7 relative, times |y * log2(x)| when that is larger than 1.
+	///////////////////////////////////////////////////////////////////////
+	double pow_error = 0.0;
+	for(int i = 0; i < N; i++)
+	{
+		const float x = (i & 1) ? uniform(rng) : 1.0f - 1e-3f * uniform(rng);
+		const float shininess = 25000.0f * uniform(rng);
+		const float y = (i & 2) ? shininess : 1.0f / (shininess + 1.0f);
+		const double reference = std::pow(double(x), double(y));
+		if(reference < 1e-37)
+			continue; // Not a normal float
+		const double exponent = std::abs(double(y) * std::log2(double(x)));
+		pow_error = std::max(pow_error, std::abs(fastPow(x, y) / reference - 1.0) / std::max(1.0, exponent));
+	}
+	check("fastPow relative / max(1, |y log2(x)|)", pow_error, 3e-7);
+	check("fastPow(0, 5)", fastPow(0.0f, 5.0f), 0.0);
+	check("fastPow(0.5, 0) - 1", std::abs(fastPow(0.5f, 0.0f) - 1.0f), 0.0);
+
+	///////////////////////////////////////////////////////////////////////
+	// fastSinCos, for |x| <= 1000: 4e-7 absolute
+	///////////////////////////////////////////////////////////////////////
+	double sincos_error = 0.0;
+	for(int i = 0; i < N; i++)
+	{
+		const float x = (i & 1) ? 6.28318531f * uniform(rng) : 2000.0f * uniform(rng) - 1000.0f;
+		float s, c;
+		fastSinCos(x, s, c);
+		sincos_error = std::max(sincos_error, std::abs(s - std::sin(double(x))));
+		sincos_error = std::max(sincos_error, std::abs(c - std::cos(double(x))));
+	}
+	check("fastSinCos", sincos_error, 4e-7);
+
+	///////////////////////////////////////////////////////////////////////
+	// fastAcos, over [-1, 1]: 7e-5 radians
+	///////////////////////////////////////////////////////////////////////
+	double acos_error = 0.0;
+	for(int i = 0; i <= N; i++)
+	{
+		const float x = std::min(-1.0f + 2.0f * float(i) / float(N), 1.0f);
+		acos_error = std::max(acos_error, std::abs(fastAcos(x) - std::acos(double(x))));
+	}
+	check("fastAcos", acos_error, 7e-5);
+
+	///////////////////////////////////////////////////////////////////////
+	// fastAtan2, over all directions, some of them very close to the x
+	// axis: 2e-6 radians
+	///////////////////////////////////////////////////////////////////////
+	double atan2_error = 0.0;
+	for(int i = 0; i < N; i++)
+	{
+		const float x = 2.0f * uniform(rng) - 1.0f;
+		const float y = (2.0f * uniform(rng) - 1.0f) * ((i & 3) == 0 ? 1e-6f : 1.0f);
+		atan2_error = std::max(atan2_error, std::abs(fastAtan2(y, x) - std::atan2(double(y), double(x))));
+	}
+	check("fastAtan2", atan2_error, 2e-6);
+
+	return passed ? 0 : 1;
+}
@@ -0,0 +1,68 @@
+///////////////////////////////////////////////////////////////////////////
+// Times the specialized integrator variants against the generic one, with
+// every feature on and a runtime bounce count, on the room of
+// test::addRoom(), for both integrators. The room has no environment map,
+// and is rendered with and without the point light, at bounce counts that
+// have a variant of their own and at one (5) that only gets the features
+// specialized.
+//
+// Not a test, since timings depend on the machine: run it by hand in a
+// release build. Each time is the fastest of REPEATS renders.
+///////////////////////////////////////////////////////////////////////////
+#include <algorithm>
+#include <cfloat>
+#include <iomanip>
+#include <iostream>
+#include "../Pathtracer.h"
+#include "testscene.h"
+
+using namespace std;
+using namespace glm;
+
+const int WIDTH = 128, HEIGHT = 96;
+const int SAMPLES = 8;
+const int REPEATS = 9;
+
+// Milliseconds per sample per pixel
+static float timeRender(bool specialize)
+{
+	pathtracer::settings.specialize_integrator = specialize;
+	test::render(WIDTH, HEIGHT, SAMPLES, test::ROOM_EYE, test::ROOM_TARGET);
+	return pathtracer::integrator_stats.total_time_ms / SAMPLES;
+}
+
+int main()
+{
+	test::resetSettings();
+	test::addRoom();
+	pathtracer::buildBVH();
+	const float point_light_intensity = pathtracer::point_light.intensity_multiplier;
+
+	cout << "integrator   point light  bounces  generic ms  specialized ms  saved\n";
+	cout << fixed;
+	for(pathtracer::Integrator integrator : { pathtracer::INTEGRATOR_DEPTH_FIRST, pathtracer::INTEGRATOR_WAVEFRONT })
+	{
+		pathtracer::settings.integrator = integrator;
+		for(bool point_light : { true, false })
+		{
+			pathtracer::point_light.intensity_multiplier = point_light ? point_light_intensity : 0.0f;
+			for(int bounces : { 1, 2, 4, 5, 8 })
+			{
+				pathtracer::settings.max_bounces = bounces;
+				// Alternated, so that both see the same load on the machine
+				float generic = FLT_MAX, specialized = FLT_MAX;
+				for(int i = 0; i < REPEATS; i++)
+				{
+					generic = std::min(generic, timeRender(false));
+					specialized = std::min(specialized, timeRender(true));
+				}
+				cout << setw(11) << left
+				     << (integrator == pathtracer::INTEGRATOR_WAVEFRONT ? "wavefront" : "depth first") << "  "
+				     << setw(11) << (point_light ? "on" : "off") << right << "  " << setw(7) << bounces << "  "
+				     << setw(10) << setprecision(3) << generic << "  " << setw(14) << specialized << "  "
+				     << setw(4) << setprecision(0) << 100.0f * (1.0f - specialized / generic) << "%\n";
+			}
+		}
+	}
+	return 0;
+}
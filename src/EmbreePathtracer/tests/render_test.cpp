@@ -0,0 +1,91 @@
+///////////////////////////////////////////////////////////////////////////
+// Renders the room of test::addRoom(). This is built twice. The precise
+// build saves the image to the file given on the command line, and the
+// PATHTRACER_FAST_MATH build renders it again and fails if the image differs from the saved one by
+// more than MAX_RELATIVE_RMSE (the RMSE over the mean pixel value).
+//
+// Both renders use the same random numbers, so most paths take the same
+// directions in both and the difference is mostly the error of the
+// approximations, not noise.
+//
+// The precise build also renders the scene with the wavefront integrator.
+// The room is open on three sides and there is no environment map, so
+// this covers the paths that escape.
+///////////////////////////////////////////////////////////////////////////
+#include <cmath>
+#include <iostream>
+#include "../Pathtracer.h"
+#include "testscene.h"
+
+using namespace std;
+using namespace glm;
+
+const float MAX_RELATIVE_RMSE = 1e-3f;
+// The noise in the mean of a render at 16 spp
+const float MAX_RELATIVE_MEAN_ERROR = 1e-2f;
+
+static bool check(const char* name, double error, double bound)
+{
+	const bool ok = error >= 0.0 && error <= bound;
+	cout << (ok ? "ok     " : "FAILED ") << name << ": " << error << ", bound " << bound << "\n";
+	return ok;
+}
+
+int main(int argc, char* argv[])
+{
+	if(argc != 2)
+	{
+		cout << "Usage: " << argv[0] << " <precise render.pfm>\n";
+		return 1;
+	}
+	test::resetSettings();
+	pathtracer::settings.max_bounces = 4;
+	test::addRoom();
+	pathtracer::buildBVH();
+	test::render(64, 48, 16, test::ROOM_EYE, test::ROOM_TARGET);
+
+	const double mean = test::imageMean();
+	if(!(mean > 0.0))
+	{
+		cout << "FAILED: the render is black\n";
+		return 1;
+	}
+
+#ifndef PATHTRACER_FAST_MATH
+	pathtracer::storeReferenceImage();
+	if(!pathtracer::saveReferenceImage(argv[1]))
+	{
+		cout << "FAILED: could not write " << argv[1] << "\n";
+		return 1;
+	}
+	cout << "ok     precise render, mean " << mean << ", saved to " << argv[1] << "\n";
+
+	// The wavefront integrator on the same scene, where paths that leave the
+	// room find no environment map. The specialized variant draws the same
+	// random numbers as the depth first one. The generic variant also looks
+	// up the missing map, and draws them differently, so only its mean is
+	// the same.
+	bool passed = true;
+	pathtracer::settings.integrator = pathtracer::INTEGRATOR_WAVEFRONT;
+	test::render(64, 48, 16, test::ROOM_EYE, test::ROOM_TARGET);
+	const float relative_rmse = pathtracer::referenceError() / float(mean);
+	passed &= check("specialized wavefront render, RMSE against the depth first render", relative_rmse,
+	                MAX_RELATIVE_RMSE);
+	pathtracer::settings.specialize_integrator = false;
+	test::render(64, 48, 16, test::ROOM_EYE, test::ROOM_TARGET);
+	passed &= check("generic wavefront render, mean against the depth first render",
+	                std::abs(test::imageMean() / mean - 1.0), MAX_RELATIVE_MEAN_ERROR);
+	return passed ? 0 : 1;
+#else
+	if(!pathtracer::loadReferenceImage(argv[1]))
+	{
+		cout << "FAILED: run the precise render first\n";
+		return 1;
+	}
+	const float relative_rmse = pathtracer::referenceError() / float(mean);
+	const bool ok = relative_rmse >= 0.0f && relative_rmse <= MAX_RELATIVE_RMSE;
+	cout << (ok ? "ok     " : "FAILED ") << "fast math render, RMSE against the precise render " << relative_rmse
+	     << " of the mean, bound " << MAX_RELATIVE_RMSE << "\n";
+	return ok ? 0 : 1;
+#endif
+}
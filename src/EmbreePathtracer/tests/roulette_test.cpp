@@ -0,0 +1,82 @@
+///////////////////////////////////////////////////////////////////////////
+// Renders the room of test::addRoom() with and without Russian roulette,
+// and fails if the image means differ by more than MAX_SIGMAS standard
+// errors: roulette must not change what the renderer converges to.
+//
+// The standard error of a mean is estimated from the means of the blocks
+// of BLOCK_SAMPLES paths per pixel it is made of. The Sobol sampler
+// stratifies across blocks, so this overestimates it, which only makes
+// the test more lenient.
+//
+// It also prints the time, the RMSE against a reference without roulette
+// (rendered with the independent sampler, so that its noise is not
+// correlated with either render) and the efficiency 1 / (RMSE^2 * seconds)
+// of both, which is how roulette is meant to pay off.
+///////////////////////////////////////////////////////////////////////////
+#include <cmath>
+#include <iostream>
+#include "../Pathtracer.h"
+#include "testscene.h"
+
+using namespace std;
+using namespace glm;
+
+const double MAX_SIGMAS = 4.0;
+const int WIDTH = 64, HEIGHT = 48;
+const int BLOCKS = 8;
+const int BLOCK_SAMPLES = 8;
+const int REFERENCE_SAMPLES = 1024;
+
+struct Result
+{
+	double mean, standard_error, seconds, rmse;
+};
+
+static Result render(bool russian_roulette)
+{
+	pathtracer::settings.russian_roulette = russian_roulette;
+	pathtracer::resize(WIDTH, HEIGHT);
+	double mean = 0.0, sum = 0.0, sum_squared = 0.0;
+	for(int block = 1; block <= BLOCKS; block++)
+	{
+		test::renderMore(BLOCK_SAMPLES, test::ROOM_EYE, test::ROOM_TARGET);
+		const double new_mean = test::imageMean();
+		const double block_mean = block * new_mean - (block - 1) * mean;
+		sum += block_mean;
+		sum_squared += block_mean * block_mean;
+		mean = new_mean;
+	}
+	const double variance = (sum_squared - sum * sum / BLOCKS) / (BLOCKS - 1);
+	Result result;
+	result.mean = mean;
+	result.standard_error = std::sqrt(std::max(variance, 0.0) / BLOCKS);
+	result.seconds = pathtracer::integrator_stats.total_time_ms / 1000.0;
+	result.rmse = pathtracer::referenceError();
+	cout << "       roulette " << (russian_roulette ? "on: " : "off:") << " mean " << result.mean << " +- "
+	     << result.standard_error << ", " << result.seconds << " s, RMSE " << result.rmse << ", efficiency "
+	     << 1.0 / (result.rmse * result.rmse * result.seconds) << "\n";
+	return result;
+}
+
+int main()
+{
+	test::resetSettings();
+	test::addRoom();
+	pathtracer::buildBVH();
+
+	pathtracer::settings.russian_roulette = false;
+	pathtracer::sampling_settings.sampler = pathtracer::SAMPLER_INDEPENDENT;
+	test::render(WIDTH, HEIGHT, REFERENCE_SAMPLES, test::ROOM_EYE, test::ROOM_TARGET);
+	pathtracer::storeReferenceImage();
+	pathtracer::sampling_settings.sampler = pathtracer::SAMPLER_SOBOL;
+
+	const Result without = render(false);
+	const Result with = render(true);
+	const double sigmas = std::abs(with.mean - without.mean)
+	                      / std::sqrt(with.standard_error * with.standard_error
+	                                  + without.standard_error * without.standard_error);
+	const bool ok = sigmas <= MAX_SIGMAS;
+	cout << (ok ? "ok     " : "FAILED ") << "mean with roulette against the mean without it: " << sigmas
+	     << " standard errors, bound " << MAX_SIGMAS << "\n";
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,119 @@
+#include "testscene.h"
+#include <glm/gtc/matrix_transform.hpp>
+#include "../Pathtracer.h"
+#include "../sampling.h"
+
+using namespace glm;
+
+namespace test
+{
+labhelper::Material material(const vec3& color, float reflectivity, float metalness, float fresnel,
+                             float shininess, float emission)
+{
+	labhelper::Material m;
+	m.m_name = "test";
+	m.m_color = color;
+	m.m_reflectivity = reflectivity;
+	m.m_metalness = metalness;
+	m.m_fresnel = fresnel;
+	m.m_shininess = shininess;
+	m.m_emission = emission;
+	m.m_transparency = 0.0f;
+	return m;
+}
+
+void addQuad(labhelper::Model* model, uint32_t material, const vec3& p0, const vec3& p1, const vec3& p2,
+             const vec3& p3)
+{
+	labhelper::Mesh mesh;
+	mesh.m_name = "quad";
+	mesh.m_material_idx = material;
+	mesh.m_start_index = uint32_t(model->m_positions.size());
+	mesh.m_number_of_vertices = 6;
+	model->m_meshes.push_back(mesh);
+	const vec3 normal = normalize(cross(p1 - p0, p2 - p0));
+	for(const vec3& p : { p0, p1, p2, p0, p2, p3 })
+	{
+		model->m_positions.push_back(p);
+		model->m_normals.push_back(normal);
+		model->m_texture_coordinates.push_back(vec2(0.0f));
+	}
+}
+
+void addRoom()
+{
+	labhelper::Model* room = new labhelper::Model;
+	room->m_name = "room";
+	room->m_filename = "room.obj";
+	room->m_materials.push_back(material(vec3(0.8f), 0.0f, 0.0f, 0.0f, 0.0f, 0.0f));
+	room->m_materials.push_back(material(vec3(0.8f, 0.2f, 0.2f), 0.0f, 0.0f, 0.0f, 0.0f, 0.0f));
+	room->m_materials.push_back(material(vec3(0.9f, 0.7f, 0.4f), 1.0f, 1.0f, 0.9f, 500.0f, 0.0f));
+	room->m_materials.push_back(material(vec3(0.2f, 0.4f, 0.8f), 0.5f, 0.0f, 0.04f, 80.0f, 0.0f));
+	room->m_materials.push_back(material(vec3(1.0f, 0.9f, 0.8f), 0.0f, 0.0f, 0.0f, 0.0f, 10.0f));
+	// Floor, back wall and left wall
+	addQuad(room, 0, vec3(-5, 0, 5), vec3(5, 0, 5), vec3(5, 0, -5), vec3(-5, 0, -5));
+	addQuad(room, 0, vec3(-5, 0, -5), vec3(5, 0, -5), vec3(5, 10, -5), vec3(-5, 10, -5));
+	addQuad(room, 1, vec3(-5, 0, 5), vec3(-5, 0, -5), vec3(-5, 10, -5), vec3(-5, 10, 5));
+	// A glossy metal panel leaning against the back wall
+	addQuad(room, 2, vec3(0, 0, -2), vec3(4, 0, -2), vec3(4, 5, -4.5f), vec3(0, 5, -4.5f));
+	// The top and two sides of a glossy block
+	addQuad(room, 3, vec3(-3, 2, 1), vec3(-1, 2, 1), vec3(-1, 2, -1), vec3(-3, 2, -1));
+	addQuad(room, 3, vec3(-3, 0, 1), vec3(-1, 0, 1), vec3(-1, 2, 1), vec3(-3, 2, 1));
+	addQuad(room, 3, vec3(-1, 0, 1), vec3(-1, 0, -1), vec3(-1, 2, -1), vec3(-1, 2, 1));
+	// The lamp, facing down
+	addQuad(room, 4, vec3(-1, 9.9f, -1), vec3(1, 9.9f, -1), vec3(1, 9.9f, 1), vec3(-1, 9.9f, 1));
+	pathtracer::addModel(room, mat4(1.0f));
+
+	pathtracer::point_light.intensity_multiplier = 100.0f;
+	pathtracer::point_light.position = vec3(3.0f, 8.0f, 3.0f);
+}
+
+void resetSettings()
+{
+	pathtracer::settings.subsampling = 1;
+	pathtracer::settings.max_bounces = 8;
+	pathtracer::settings.max_paths_per_pixel = 0;
+	pathtracer::settings.integrator = pathtracer::INTEGRATOR_DEPTH_FIRST;
+	pathtracer::settings.ray_streams = true;
+	pathtracer::settings.reorder_rays = true;
+	pathtracer::settings.specialize_integrator = true;
+	pathtracer::settings.simd_shading = true;
+	pathtracer::settings.russian_roulette = true;
+	pathtracer::settings.roulette_start_bounce = 3;
+	pathtracer::settings.roulette_min_survival = 0.05f;
+	pathtracer::settings.emissive_light_sampling = true;
+	pathtracer::sampling_settings.sampler = pathtracer::SAMPLER_SOBOL;
+	pathtracer::geometry_settings.accelerator = pathtracer::ACCELERATOR_BVH8;
+	pathtracer::point_light.intensity_multiplier = 0.0f;
+	pathtracer::point_light.color = vec3(1.0f);
+	pathtracer::point_light.position = vec3(0.0f);
+	pathtracer::environment.multiplier = 0.0f;
+}
+
+void render(int width, int height, int samples, const vec3& eye, const vec3& target)
+{
+	pathtracer::resize(width, height);
+	renderMore(samples, eye, target);
+}
+
+void renderMore(int samples, const vec3& eye, const vec3& target)
+{
+	const float aspect = float(pathtracer::rendered_image.width) / float(pathtracer::rendered_image.height);
+	const mat4 V = lookAt(eye, target, vec3(0.0f, 1.0f, 0.0f));
+	const mat4 P = perspective(radians(45.0f), aspect, 0.1f, 100.0f);
+	for(int i = 0; i < samples; i++)
+	{
+		pathtracer::tracePaths(V, P);
+	}
+}
+
+double imageMean()
+{
+	double mean = 0.0;
+	for(const vec3& c : pathtracer::rendered_image.data)
+	{
+		mean += (c.x + c.y + c.z) / 3.0f;
+	}
+	return mean / double(pathtracer::rendered_image.data.size());
+}
+} // namespace test
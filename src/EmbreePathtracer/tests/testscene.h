@@ -0,0 +1,50 @@
+#pragma once
+#include <cstdint>
+#include <glm/glm.hpp>
+#include <Model.h>
+
+///////////////////////////////////////////////////////////////////////////
+// Helpers for the tests that render: scenes are built in code rather than
+// loaded, so that the tests don't depend on any files. Models are never
+// freed, since labhelper releases their OpenGL buffers when they are and
+// the tests have no OpenGL context.
+///////////////////////////////////////////////////////////////////////////
+namespace test
+{
+// A material with no textures and no transparency
+labhelper::Material material(const glm::vec3& color, float reflectivity, float metalness, float fresnel,
+                             float shininess, float emission);
+
+// Add a quad (p0, p1, p2, p3, counter clockwise seen from the side it
+// faces) to a model as a mesh of its own, with flat normals
+void addQuad(labhelper::Model* model, uint32_t material, const glm::vec3& p0, const glm::vec3& p1,
+             const glm::vec3& p2, const glm::vec3& p3);
+
+///////////////////////////////////////////////////////////////////////////
+// Add a room with diffuse walls, a glossy metal panel and a glossy
+// dielectric block, lit by an emissive panel, to the scene, and set the
+// point light to go with it. It is open on three sides. Seen best from
+// ROOM_EYE, looking at ROOM_TARGET.
+///////////////////////////////////////////////////////////////////////////
+void addRoom();
+const glm::vec3 ROOM_EYE = glm::vec3(0.0f, 5.0f, 14.0f);
+const glm::vec3 ROOM_TARGET = glm::vec3(0.0f, 3.0f, 0.0f);
+
+///////////////////////////////////////////////////////////////////////////
+// Set every path tracer setting like main.cpp does, and select our own
+// BVH8 accelerator, so that results don't depend on the embree version.
+// There is no point light and no environment map until a test adds them.
+///////////////////////////////////////////////////////////////////////////
+void resetSettings();
+
+///////////////////////////////////////////////////////////////////////////
+// Render samples paths per pixel into pathtracer::rendered_image, with a
+// perspective camera at eye looking at target
+///////////////////////////////////////////////////////////////////////////
+void render(int width, int height, int samples, const glm::vec3& eye, const glm::vec3& target);
+// Render samples more paths per pixel into the image, without restarting
+void renderMore(int samples, const glm::vec3& eye, const glm::vec3& target);
+
+// The mean over the pixels and color channels of pathtracer::rendered_image
+double imageMean();
+} // namespace test
@@ -0,0 +1,426 @@
+#include "Pathtracer.h"
+#include <algorithm>
+#include <vector>
+
+#include "embree.h"
+#include "raystream.h"
+#include "material.h"
+#include "sampling.h"
+#include "brdf_simd.h"
+
+using namespace std;
+using namespace glm;
+
+namespace pathtracer
+{
+///////////////////////////////////////////////////////////////////////////
+// The wavefront integrator does not follow one path at a time to its end.
+// Instead all paths of a tile are started together and advanced one bounce
+// at a time: first every path is shaded, with the paths grouped by the
+// material they hit, then the continuation rays of all paths are traced,
+// and finally the paths that ended are removed so that the next bounce
+// only touches live paths. Since the rays of a bounce are all known up
+// front, the shadow and continuation rays are collected into streams and
+// traced in bulk.
+///////////////////////////////////////////////////////////////////////////
+const int TILE_SIZE = 32;
+
+///////////////////////////////////////////////////////////////////////////
+// A light sample whose shadow ray is set up, but whose contribution needs
+// the BRDF along shadow_ray.d
+///////////////////////////////////////////////////////////////////////////
+struct PendingLightSample
+{
+	LightSample sample;
+	vec3 Li;
+	float pdf; // Of the light sampling strategy, 0 for the point light or no sample
+};
+
+///////////////////////////////////////////////////////////////////////////
+// The state of all paths in a tile, in SoA form. Only the first count
+// entries are live.
+///////////////////////////////////////////////////////////////////////////
+struct PathStates
+{
+	vector<Ray> rays;
+	vector<vec3> throughput;
+	vector<vec3> radiance;
+	vector<int> pixel;
+	vector<RandomState> random; // Where each path is in its random sequence
+	vector<bool> alive;
+	vector<Intersection> hits;
+	vector<uint32_t> shading_queue;
+	size_t count = 0;
+	// Rays of the current bounce, waiting to be traced
+	DirectLightBatch direct_light;
+	RayStream extension_rays;
+	vector<float> pdf; // Of the direction each path continues in
+	// Hits of one material being shaded with the SIMD kernels, with their
+	// light samples waiting for the kernels to evaluate the BRDF
+	BRDFBatch brdf_batch;
+	vector<PendingLightSample> point_light_samples;
+	vector<PendingLightSample> environment_light_samples;
+	vector<PendingLightSample> emissive_light_samples;
+	// Paths whose continuation ray escaped, with the directions to look the
+	// environment up in, all at once
+	vector<uint32_t> escaped;
+	vector<float> escaped_direction[3];
+	vector<float> escaped_radiance[3];
+
+	PathStates(size_t capacity)
+	    : rays(capacity)
+	    , throughput(capacity)
+	    , radiance(capacity)
+	    , pixel(capacity)
+	    , random(capacity)
+	    , alive(capacity)
+	    , hits(capacity)
+	    , shading_queue(capacity)
+	    , pdf(capacity)
+	    , point_light_samples(capacity)
+	    , environment_light_samples(capacity)
+	    , emissive_light_samples(capacity)
+	    , escaped(capacity)
+	{
+		for(int c = 0; c < 3; c++)
+		{
+			escaped_direction[c].resize(capacity);
+			escaped_radiance[c].resize(capacity);
+		}
+	}
+
+	void add(const Ray& r, int p)
+	{
+		rays[count] = r;
+		throughput[count] = vec3(1.0f);
+		radiance[count] = vec3(0.0f);
+		pixel[count] = p;
+		beginSample(uint32_t(p % rendered_image.width), uint32_t(p / rendered_image.width),
+		            uint32_t(rendered_image.number_of_samples));
+		random[count] = randomState();
+		alive[count] = true;
+		pdf[count] = 0.0f; // A camera ray
+		count++;
+	}
+};
+
+///////////////////////////////////////////////////////////////////////////
+// Start a path for every pixel of the tile. The camera rays are traced as
+// packets, and pixels whose camera ray misses the scene are done at once.
+///////////////////////////////////////////////////////////////////////////
+static void generatePaths(PathStates& paths, int x0, int y0, const vec3& camera_pos, const mat4& inv_PV)
+{
+	const int x1 = std::min(x0 + TILE_SIZE, rendered_image.width);
+	const int y1 = std::min(y0 + TILE_SIZE, rendered_image.height);
+	paths.count = 0;
+	RayPacket packet;
+	for(int y = y0; y < y1; y += PACKET_HEIGHT)
+	{
+		for(int x = x0; x < x1; x += PACKET_WIDTH)
+		{
+			generateCameraRays(packet, x, y, camera_pos, inv_PV);
+			intersect(packet);
+			for(int lane = 0; lane < RAY_PACKET_SIZE; lane++)
+			{
+				if(!packet.valid[lane])
+					continue;
+				const int pixel = (y + lane / PACKET_WIDTH) * rendered_image.width + x + lane % PACKET_WIDTH;
+				Ray r = getRay(packet, lane);
+				if(r.geomID == RTC_INVALID_GEOMETRY_ID)
+					accumulateSample(pixel, integrator_stats.features.environment_light ? Lenvironment(r.d) : vec3(0.0f));
+				else if(settings.max_bounces == 0)
+					accumulateSample(pixel, vec3(0.0f));
+				else
+					paths.add(r, pixel);
+			}
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Evaluate the BRDF of the batch along the pending light samples of the
+// paths shading_queue[begin, ...), and queue the shadow rays of those that
+// carry light. Samples of lights that BRDF sampling can hit are weighted
+// against the BRDF pdf, like shadeVertex() does.
+///////////////////////////////////////////////////////////////////////////
+static void addLightSamples(PathStates& paths, size_t begin, const MaterialClosure& closure,
+                            vector<PendingLightSample>& pending)
+{
+	BRDFBatch& batch = paths.brdf_batch;
+	for(size_t k = 0; k < batch.size(); k++)
+	{
+		for(int c = 0; c < 3; c++)
+		{
+			batch.wi[c][k] = pending[k].sample.shadow_ray.d[c];
+		}
+	}
+	bestBRDFKernels().evaluate(closure, batch);
+	for(size_t k = 0; k < batch.size(); k++)
+	{
+		const uint32_t i = paths.shading_queue[begin + k];
+		const vec3 f(batch.f[0][k], batch.f[1][k], batch.f[2][k]);
+		LightSample& light_sample = pending[k].sample;
+		const float weight =
+		    pending[k].pdf > 0.0f ? powerHeuristic(pending[k].pdf, batch.pdf[k]) / pending[k].pdf : 1.0f;
+		light_sample.contribution = paths.throughput[i] * f * pending[k].Li
+		                            * (std::max(0.0f, dot(light_sample.shadow_ray.d, paths.hits[i].shading_normal))
+		                               * weight);
+		if(light_sample.contribution != vec3(0.0f))
+			paths.direct_light.add(light_sample, i);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Shade the paths shading_queue[begin, end), which all hit the same
+// material, with the SIMD BRDF kernels: f along the light samples and the
+// sampled continuation are computed for all of them at once. Otherwise
+// this does what shadePathVertex() does for each path, and draws the same
+// random numbers in the same order.
+///////////////////////////////////////////////////////////////////////////
+static void shadeBatch(PathStates& paths, size_t begin, size_t end, int bounce)
+{
+	const IntegratorFeatures& features = integrator_stats.features;
+	const MaterialClosure& closure = *paths.hits[paths.shading_queue[begin]].material;
+	BRDFBatch& batch = paths.brdf_batch;
+	batch.resize(end - begin);
+	for(size_t k = 0; k < batch.size(); k++)
+	{
+		const uint32_t i = paths.shading_queue[begin + k];
+		const Intersection& hit = paths.hits[i];
+		for(int c = 0; c < 3; c++)
+		{
+			batch.wo[c][k] = hit.wo[c];
+			batch.normal[c][k] = hit.shading_normal[c];
+			batch.tangent[c][k] = hit.tangent[c];
+			batch.bitangent[c][k] = hit.bitangent[c];
+		}
+		if(features.direct_light)
+		{
+			PendingLightSample& pending = paths.point_light_samples[k];
+			vec3 wi;
+			samplePointLight(hit, pending.sample.shadow_ray, wi, pending.Li);
+			pending.pdf = 0.0f;
+		}
+		randomState() = paths.random[i];
+		if(features.environment_light)
+		{
+			PendingLightSample& pending = paths.environment_light_samples[k];
+			vec3 wi;
+			sampleEnvironmentLight(hit, pending.sample.shadow_ray, wi, pending.Li, pending.pdf);
+		}
+		if(features.emission)
+		{
+			PendingLightSample& pending = paths.emissive_light_samples[k];
+			vec3 wi;
+			sampleEmissiveLight(hit, pending.sample.shadow_ray, wi, pending.Li, pending.pdf);
+		}
+		for(int c = 0; c < 3; c++)
+		{
+			batch.u[c][k] = randf();
+		}
+		paths.random[i] = randomState();
+	}
+
+	if(features.direct_light)
+		addLightSamples(paths, begin, closure, paths.point_light_samples);
+	if(features.environment_light)
+		addLightSamples(paths, begin, closure, paths.environment_light_samples);
+	if(features.emission)
+		addLightSamples(paths, begin, closure, paths.emissive_light_samples);
+
+	if(features.emission && closure.emission != vec3(0.0f))
+	{
+		for(size_t k = 0; k < batch.size(); k++)
+		{
+			const uint32_t i = paths.shading_queue[begin + k];
+			paths.radiance[i] +=
+			    paths.throughput[i] * closure.emission * emissionWeight(paths.hits[i], paths.rays[i], paths.pdf[i]);
+		}
+	}
+
+	bestBRDFKernels().sample(closure, batch);
+	for(size_t k = 0; k < batch.size(); k++)
+	{
+		const uint32_t i = paths.shading_queue[begin + k];
+		const vec3 wi(batch.wi[0][k], batch.wi[1][k], batch.wi[2][k]);
+		const vec3 f(batch.f[0][k], batch.f[1][k], batch.f[2][k]);
+		paths.pdf[i] = batch.pdf[k];
+		paths.alive[i] = continuePath(paths.hits[i], wi, f, batch.pdf[k], paths.throughput[i], paths.rays[i]);
+		if(paths.alive[i] && settings.russian_roulette)
+		{
+			randomState() = paths.random[i];
+			paths.alive[i] = survivesRoulette(bounce, paths.throughput[i]);
+			paths.random[i] = randomState();
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Shade the hit of every live path. The paths are visited sorted by
+// material, so that paths hitting the same material are shaded together,
+// in SIMD batches with settings.simd_shading. Shadow rays are queued
+// rather than traced. The paths that continue go on to the given bounce.
+///////////////////////////////////////////////////////////////////////////
+static void shade(PathStates& paths, int bounce)
+{
+	for(size_t i = 0; i < paths.count; i++)
+	{
+		paths.hits[i] = getIntersection(paths.rays[i]);
+		paths.shading_queue[i] = uint32_t(i);
+	}
+	std::sort(paths.shading_queue.begin(), paths.shading_queue.begin() + paths.count,
+	          [&paths](uint32_t a, uint32_t b) {
+		          return std::less<const MaterialClosure*>()(paths.hits[a].material,
+		                                                         paths.hits[b].material);
+	          });
+	paths.direct_light.clear();
+	if(settings.simd_shading)
+	{
+		size_t begin = 0;
+		while(begin < paths.count)
+		{
+			const MaterialClosure* material = paths.hits[paths.shading_queue[begin]].material;
+			size_t end = begin + 1;
+			while(end < paths.count && paths.hits[paths.shading_queue[end]].material == material)
+				end++;
+			shadeBatch(paths, begin, end, bounce);
+			begin = end;
+		}
+		return;
+	}
+	for(size_t q = 0; q < paths.count; q++)
+	{
+		const uint32_t i = paths.shading_queue[q];
+		randomState() = paths.random[i];
+		paths.alive[i] = shadePathVertex(paths.hits[i], paths.throughput[i], paths.radiance[i], paths.rays[i],
+		                                 paths.pdf[i], paths.direct_light, i)
+		                 && survivesRoulette(bounce, paths.throughput[i]);
+		paths.random[i] = randomState();
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Trace the shadow rays queued during shading, and add the direct light
+// of the paths whose shadow ray reached the light.
+///////////////////////////////////////////////////////////////////////////
+static void traceShadowRays(PathStates& paths)
+{
+	paths.direct_light.trace(
+	    [&paths](uint32_t i, const vec3& contribution) { paths.radiance[i] += contribution; });
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Trace the continuation rays of all live paths. Paths that escape the
+// scene pick up the environment, if it contributes, looked up for all of
+// them at once, and end.
+///////////////////////////////////////////////////////////////////////////
+static void extend(PathStates& paths)
+{
+	paths.extension_rays.clear();
+	for(size_t i = 0; i < paths.count; i++)
+	{
+		if(paths.alive[i])
+			paths.extension_rays.add(paths.rays[i], uint32_t(i));
+	}
+	paths.extension_rays.intersect(settings.ray_streams, settings.reorder_rays);
+	size_t number_escaped = 0;
+	for(size_t k = 0; k < paths.extension_rays.size(); k++)
+	{
+		const uint32_t i = paths.extension_rays.id(k);
+		paths.rays[i] = paths.extension_rays.ray(k);
+		if(paths.rays[i].geomID == RTC_INVALID_GEOMETRY_ID)
+		{
+			paths.escaped[number_escaped] = i;
+			for(int c = 0; c < 3; c++)
+			{
+				paths.escaped_direction[c][number_escaped] = paths.rays[i].d[c];
+			}
+			number_escaped++;
+			paths.alive[i] = false;
+		}
+	}
+	// Without an environment they end with what they have, like in Li()
+	if(!integrator_stats.features.environment_light)
+		return;
+
+	const float* const directions[3] = { paths.escaped_direction[0].data(), paths.escaped_direction[1].data(),
+		                                 paths.escaped_direction[2].data() };
+	float* const radiance[3] = { paths.escaped_radiance[0].data(), paths.escaped_radiance[1].data(),
+		                         paths.escaped_radiance[2].data() };
+	Lenvironment(directions, number_escaped, radiance);
+	for(size_t k = 0; k < number_escaped; k++)
+	{
+		const uint32_t i = paths.escaped[k];
+		// Weighted against sampling the environment directly, see
+		// shadeVertex()
+		const float weight = powerHeuristic(paths.pdf[i], environmentLightPdf(paths.rays[i].d));
+		const vec3 L(radiance[0][k], radiance[1][k], radiance[2][k]);
+		paths.radiance[i] += paths.throughput[i] * L * weight;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Write out the radiance of paths that have ended and move the live paths
+// to the front of the arrays.
+///////////////////////////////////////////////////////////////////////////
+static void compact(PathStates& paths)
+{
+	size_t live = 0;
+	for(size_t i = 0; i < paths.count; i++)
+	{
+		if(!paths.alive[i])
+		{
+			accumulateSample(paths.pixel[i], paths.radiance[i]);
+			continue;
+		}
+		if(i != live)
+		{
+			paths.rays[live] = paths.rays[i];
+			paths.throughput[live] = paths.throughput[i];
+			paths.radiance[live] = paths.radiance[i];
+			paths.pixel[live] = paths.pixel[i];
+			paths.random[live] = paths.random[i];
+			paths.pdf[live] = paths.pdf[i];
+			paths.alive[live] = true;
+		}
+		live++;
+	}
+	paths.count = live;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Trace one path per pixel with the wavefront integrator
+///////////////////////////////////////////////////////////////////////////
+void tracePathsWavefront(const vec3& camera_pos, const mat4& inv_PV)
+{
+	const int tiles_x = (rendered_image.width + TILE_SIZE - 1) / TILE_SIZE;
+	const int tiles_y = (rendered_image.height + TILE_SIZE - 1) / TILE_SIZE;
+
+	#pragma omp parallel
+	{
+		PathStates paths(TILE_SIZE * TILE_SIZE);
+
+		#pragma omp for schedule(dynamic)
+		for(int tile = 0; tile < tiles_x * tiles_y; tile++)
+		{
+			generatePaths(paths, (tile % tiles_x) * TILE_SIZE, (tile / tiles_x) * TILE_SIZE, camera_pos, inv_PV);
+			for(int bounce = 0; bounce < settings.max_bounces && paths.count > 0; bounce++)
+			{
+				shade(paths, bounce + 1);
+				traceShadowRays(paths);
+				extend(paths);
+				compact(paths);
+			}
+			// Paths that are still alive ran out of bounces. With emissive
+			// light sampling they get the emission their last ray found, see
+			// Li().
+			for(size_t i = 0; i < paths.count; i++)
+			{
+				if(integrator_stats.features.emission)
+					paths.radiance[i] += paths.throughput[i] * Lemitted(paths.rays[i], paths.pdf[i]);
+				accumulateSample(paths.pixel[i], paths.radiance[i]);
+			}
+		}
+	}
+}
+} // namespace pathtracer